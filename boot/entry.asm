@@ -1,17 +1,25 @@
 BITS 32
+
+MBOOT_MAGIC equ 0x1BADB002
+MBOOT_FLAGS equ 0x03            ; page-align modules, provide memory info/map
+
 SECTION .multiboot
     align 4
-    dd 0x1BADB002
-    dd 0x00
-    dd -(0x1BADB002)
+    dd MBOOT_MAGIC
+    dd MBOOT_FLAGS
+    dd -(MBOOT_MAGIC + MBOOT_FLAGS)
 
 SECTION .text
 GLOBAL _start
 EXTERN kernel_main
+EXTERN cpus
 
 _start:
     cli
     mov esp, stack_top
+    mov dword [stack_bottom], cpus  ; this_cpu(): the boot stack is CPU 0's
+    push ebx                    ; multiboot_info_t *
+    push eax                    ; bootloader magic
     call kernel_main
 
 .hang:
@@ -19,6 +27,7 @@ _start:
     jmp .hang
 
 section .bss
-align 16
+align 8192                      ; TASK_STACK_SIZE, like every other kernel stack
+stack_bottom:
 resb 8192
-stack_top:
\ No newline at end of file
+stack_top:
@@ -0,0 +1,659 @@
+/*
+ * Local APIC and IOAPIC
+ *
+ * Discovery reads the firmware tables through a small window of kernel
+ * pages (they usually sit at the top of RAM, past the direct map); the
+ * search for their root pointers only looks at the first megabyte,
+ * which the direct map covers. The register pages stay mapped
+ * uncached at APIC_MMIO_VIRT.
+ */
+
+#include "apic.h"
+#include "pic.h"
+#include "idt.h"
+#include "io.h"
+#include "cpu.h"
+#include "paging.h"
+#include "timer.h"
+#include "clock.h"
+#include "vga.h"
+#include "string.h"
+#include <stddef.h>
+
+#define IA32_APIC_BASE_MSR  0x1B
+#define APIC_BASE_ENABLE    (1 << 11)
+
+// IOAPIC: an index register and a data window
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WINDOW       0x10
+#define IOAPIC_REG_VERSION  0x01
+#define IOAPIC_REDIR(pin)   (0x10 + 2 * (pin))
+
+#define IOAPIC_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_LEVEL        (1 << 15)
+#define IOAPIC_MASKED       (1 << 16)
+
+// MADT / MP interrupt flags: polarity in bits 0-1, trigger in bits 2-3
+#define INTI_POLARITY_MASK  0x3
+#define INTI_ACTIVE_LOW     0x3
+#define INTI_TRIGGER_MASK   0xC
+#define INTI_LEVEL          0xC
+
+// IMCR: on some MP systems the 8259s are wired to the CPU until this
+// is flipped to send interrupts through the APIC
+#define IMCR_SELECT         0x22
+#define IMCR_DATA           0x23
+
+#define ISA_IRQS            16
+#define NO_GSI              0xFFFFFFFF
+
+typedef struct {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    acpi_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+    char signature[4];          // "_MP_"
+    uint32_t config_table;
+    uint8_t length;             // In 16-byte units
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];        // [0]: default config, [1] bit 7: IMCR
+} __attribute__((packed)) mp_pointer_t;
+
+typedef struct {
+    char signature[4];          // "PCMP"
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+typedef struct {
+    uint8_t id;
+    uint32_t phys;
+    uint32_t gsi_base;
+    uint32_t pins;
+    volatile uint32_t *regs;
+} ioapic_t;
+
+// Where an ISA IRQ arrives, after the firmware's overrides
+typedef struct {
+    uint32_t gsi;
+    uint16_t flags;             // INTI_* polarity and trigger
+    // MP tables name an IOAPIC and pin; resolved once they are mapped
+    uint8_t mp_ioapic;
+    uint8_t mp_pin;
+} isa_route_t;
+
+volatile uint32_t *lapic_eoi = NULL;
+
+static volatile uint32_t *lapic = NULL;
+static uint32_t lapic_phys;
+static int active = 0;
+static const char *found_in = NULL;
+static int need_imcr = 0;
+
+static ioapic_t ioapics[APIC_MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static uint8_t cpu_ids[APIC_MAX_CPUS];
+static uint32_t cpu_count = 0;
+static isa_route_t isa_routes[ISA_IRQS];
+
+extern void irq_spurious(void);
+
+/* ====== Firmware tables ====== */
+
+static int sig_match(const char *a, const char *b, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) return 0;
+    }
+    return 1;
+}
+
+static int checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        sum += b[i];
+    }
+    return sum == 0;
+}
+
+// Map [phys, phys + len) at the table window; replaces the last mapping
+static void *table_map(uint32_t phys, uint32_t len) {
+    uint32_t base = phys & PAGE_MASK;
+    uint32_t pages = (phys + len - base + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (len == 0 || pages > APIC_TABLE_PAGES) return NULL;
+    if (page_map_range(APIC_TABLE_VIRT, base, pages, 0) != 0) return NULL;
+    return (void *)(APIC_TABLE_VIRT + (phys - base));
+}
+
+// A whole ACPI table: the header first, for its length
+static acpi_header_t *acpi_map(uint32_t phys) {
+    acpi_header_t *header = table_map(phys, sizeof(acpi_header_t));
+    if (!header) return NULL;
+    uint32_t length = header->length;
+    if (length < sizeof(acpi_header_t)) return NULL;
+
+    header = table_map(phys, length);
+    if (!header || !checksum_ok(header, length)) return NULL;
+    return header;
+}
+
+// 16-byte aligned search of low memory (inside the direct map)
+static void *scan_low(const char *sig, uint32_t sig_len, uint32_t phys,
+                      uint32_t len, uint32_t check_len) {
+    for (uint32_t p = phys; p + check_len <= phys + len; p += 16) {
+        void *virt = phys_to_virt(p);
+        if (sig_match(virt, sig, sig_len) && checksum_ok(virt, check_len)) {
+            return virt;
+        }
+    }
+    return NULL;
+}
+
+// EBDA first, then the places the specs allow after it
+static void *scan_firmware(const char *sig, uint32_t sig_len, uint32_t check_len) {
+    uint32_t ebda = (uint32_t)*(uint16_t *)phys_to_virt(0x40E) << 4;
+    void *found = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000) {
+        found = scan_low(sig, sig_len, ebda, 1024, check_len);
+    }
+    if (!found) found = scan_low(sig, sig_len, 0x9FC00, 1024, check_len);
+    if (!found) found = scan_low(sig, sig_len, 0xE0000, 0x20000, check_len);
+    return found;
+}
+
+static void add_cpu(uint8_t apic_id) {
+    if (cpu_count < APIC_MAX_CPUS) {
+        cpu_ids[cpu_count++] = apic_id;
+    }
+}
+
+static void add_ioapic(uint8_t id, uint32_t phys, uint32_t gsi_base) {
+    if (ioapic_count < APIC_MAX_IOAPICS) {
+        ioapic_t *io = &ioapics[ioapic_count++];
+        io->id = id;
+        io->phys = phys;
+        io->gsi_base = gsi_base;
+    }
+}
+
+static int madt_parse(void) {
+    acpi_rsdp_t *rsdp = scan_firmware("RSD PTR ", 8, sizeof(acpi_rsdp_t));
+    if (!rsdp) return -1;
+
+    // Copy the table list out: the window is reused for each table
+    uint32_t tables[32];
+    uint32_t table_count = 0;
+    acpi_header_t *rsdt = acpi_map(rsdp->rsdt_address);
+    if (!rsdt || !sig_match(rsdt->signature, "RSDT", 4)) return -1;
+    uint32_t *entries = (uint32_t *)(rsdt + 1);
+    uint32_t n = (rsdt->length - sizeof(acpi_header_t)) / 4;
+    for (uint32_t i = 0; i < n && table_count < 32; i++) {
+        tables[table_count++] = entries[i];
+    }
+
+    for (uint32_t t = 0; t < table_count; t++) {
+        acpi_header_t *header = acpi_map(tables[t]);
+        if (!header || !sig_match(header->signature, "APIC", 4)) continue;
+
+        acpi_madt_t *madt = (acpi_madt_t *)header;
+        lapic_phys = madt->lapic_address;
+
+        uint8_t *p = (uint8_t *)(madt + 1);
+        uint8_t *end = (uint8_t *)madt + madt->header.length;
+        while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+            switch (p[0]) {
+                case 0:     // Processor local APIC: uid, apic id, flags
+                    if (*(uint32_t *)(p + 4) & 1) add_cpu(p[3]);
+                    break;
+                case 1:     // IOAPIC: id, reserved, address, GSI base
+                    add_ioapic(p[2], *(uint32_t *)(p + 4), *(uint32_t *)(p + 8));
+                    break;
+                case 2:     // ISA override: bus, irq, GSI, flags
+                    if (p[3] < ISA_IRQS) {
+                        isa_routes[p[3]].gsi = *(uint32_t *)(p + 4);
+                        isa_routes[p[3]].flags = *(uint16_t *)(p + 8);
+                    }
+                    break;
+            }
+            p += p[1];
+        }
+        found_in = "ACPI MADT";
+        return ioapic_count ? 0 : -1;
+    }
+    return -1;
+}
+
+static int mp_parse(void) {
+    mp_pointer_t *mp = scan_firmware("_MP_", 4, sizeof(mp_pointer_t));
+    if (!mp) return -1;
+    need_imcr = (mp->features[1] & 0x80) != 0;
+
+    // Default configurations have no table: one IOAPIC where it always is
+    if (mp->features[0] != 0 || mp->config_table == 0) {
+        lapic_phys = 0xFEE00000;
+        add_ioapic(0, 0xFEC00000, 0);
+        found_in = "MP default configuration";
+        return 0;
+    }
+
+    mp_config_t *config = table_map(mp->config_table, sizeof(mp_config_t));
+    if (!config || !sig_match(config->signature, "PCMP", 4)) return -1;
+    uint32_t length = config->length;
+    config = table_map(mp->config_table, length);
+    if (!config || !checksum_ok(config, length)) return -1;
+    lapic_phys = config->lapic_address;
+
+    uint8_t isa_bus[32] = { 0 };    // Bitmap of bus ids that are ISA
+    uint8_t *p = (uint8_t *)(config + 1);
+    uint8_t *end = (uint8_t *)config + length;
+    for (uint32_t i = 0; i < config->entry_count && p < end; i++) {
+        switch (p[0]) {
+            case 0:     // Processor: apic id, version, flags (bit 0 usable)
+                if (p[3] & 1) add_cpu(p[1]);
+                p += 20;
+                break;
+            case 1:     // Bus: id, type string
+                if (sig_match((char *)p + 2, "ISA", 3)) {
+                    isa_bus[p[1] / 8] |= 1 << (p[1] % 8);
+                }
+                p += 8;
+                break;
+            case 2:     // IOAPIC: id, version, flags, address
+                if (p[3] & 1) add_ioapic(p[1], *(uint32_t *)(p + 4), NO_GSI);
+                p += 8;
+                break;
+            case 3: {   // I/O interrupt: type, flags, bus, irq, ioapic, pin
+                uint8_t bus = p[4], irq = p[5];
+                if (p[1] == 0 && (isa_bus[bus / 8] & (1 << (bus % 8))) && irq < ISA_IRQS) {
+                    isa_routes[irq].flags = *(uint16_t *)(p + 2);
+                    isa_routes[irq].mp_ioapic = p[6];
+                    isa_routes[irq].mp_pin = p[7];
+                    isa_routes[irq].gsi = NO_GSI;
+                }
+                p += 8;
+                break;
+            }
+            default:    // Local interrupt and anything newer: 8 bytes
+                p += 8;
+                break;
+        }
+    }
+    found_in = "MP table";
+    return ioapic_count ? 0 : -1;
+}
+
+/* ====== Registers ====== */
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+uint32_t lapic_id(void) {
+    return lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+static uint32_t ioapic_read(ioapic_t *io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(ioapic_t *io, uint32_t reg, uint32_t value) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static ioapic_t *ioapic_for_gsi(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        ioapic_t *io = &ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->pins) return io;
+    }
+    return NULL;
+}
+
+static int map_registers(void) {
+    uint32_t flags = PTE_WRITE | PTE_PCACHE | PTE_PWRT;     // Uncached
+
+    if (page_map(APIC_MMIO_VIRT, lapic_phys, flags) != 0) return -1;
+    lapic = (volatile uint32_t *)APIC_MMIO_VIRT;
+
+    // MP tables leave GSI numbering to us: IOAPICs in order, pins packed
+    uint32_t next_gsi = 0;
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        ioapic_t *io = &ioapics[i];
+        uint32_t virt = APIC_MMIO_VIRT + (i + 1) * PAGE_SIZE;
+        if (page_map(virt, io->phys & PAGE_MASK, flags) != 0) return -1;
+        io->regs = (volatile uint32_t *)(virt + (io->phys & ~PAGE_MASK));
+        io->pins = ((ioapic_read(io, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+        if (io->gsi_base == NO_GSI) io->gsi_base = next_gsi;
+        next_gsi = io->gsi_base + io->pins;
+
+        // Everything masked until a driver asks for it
+        for (uint32_t pin = 0; pin < io->pins; pin++) {
+            ioapic_write(io, IOAPIC_REDIR(pin), IOAPIC_MASKED);
+            ioapic_write(io, IOAPIC_REDIR(pin) + 1, 0);
+        }
+    }
+
+    for (int irq = 0; irq < ISA_IRQS; irq++) {
+        isa_route_t *route = &isa_routes[irq];
+        if (route->gsi != NO_GSI) continue;
+        for (uint32_t i = 0; i < ioapic_count; i++) {
+            if (ioapics[i].id == route->mp_ioapic) {
+                route->gsi = ioapics[i].gsi_base + route->mp_pin;
+            }
+        }
+        if (route->gsi == NO_GSI) route->gsi = irq;
+    }
+    return 0;
+}
+
+static void lapic_enable(void) {
+    if (cpu_features_edx() & CPUID_FEAT_EDX_MSR) {
+        uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+        if (!(base & APIC_BASE_ENABLE)) {
+            wrmsr(IA32_APIC_BASE_MSR, base | APIC_BASE_ENABLE);
+        }
+    }
+
+    lapic_write(LAPIC_TPR, 0);                          // Accept every vector
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);     // No 8259 ExtINT
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+void apic_send_ipi(uint32_t apic_id, uint32_t icr_low) {
+    // The ICR is this CPU's own, so only its interrupts need to be off
+    uint32_t flags = local_irq_save();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING);
+    local_irq_restore(flags);
+}
+
+/* ====== ISA IRQ routing ====== */
+
+void apic_enable_irq(int irq) {
+    // IRQ 2 is the 8259 cascade; its GSI usually belongs to the PIT
+    if (irq < 0 || irq >= ISA_IRQS || irq == 2) return;
+
+    isa_route_t *route = &isa_routes[irq];
+    ioapic_t *io = ioapic_for_gsi(route->gsi);
+    if (!io) return;
+
+    // ISA defaults (flags 0) are edge-triggered, active high
+    uint32_t low = 32 + irq;
+    if ((route->flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW) low |= IOAPIC_ACTIVE_LOW;
+    if ((route->flags & INTI_TRIGGER_MASK) == INTI_LEVEL) low |= IOAPIC_LEVEL;
+
+    uint32_t pin = route->gsi - io->gsi_base;
+    uint32_t flags = irq_save();
+    ioapic_write(io, IOAPIC_REDIR(pin) + 1, lapic_id() << 24);
+    ioapic_write(io, IOAPIC_REDIR(pin), low);
+    irq_restore(flags);
+}
+
+void apic_disable_irq(int irq) {
+    if (irq < 0 || irq >= ISA_IRQS || irq == 2) return;
+
+    ioapic_t *io = ioapic_for_gsi(isa_routes[irq].gsi);
+    if (!io) return;
+
+    uint32_t pin = isa_routes[irq].gsi - io->gsi_base;
+    uint32_t flags = irq_save();
+    ioapic_write(io, IOAPIC_REDIR(pin), IOAPIC_MASKED);
+    irq_restore(flags);
+}
+
+/* ====== LAPIC timer ====== */
+
+static void lapic_timer_periodic(void);
+static void lapic_timer_oneshot(uint32_t cycles);
+static uint32_t lapic_timer_read(int *expired);
+
+static timer_source_t lapic_timer = {
+    .name = "LAPIC timer",
+    .max_cycles = 0xFFFFFFFF,
+    .set_periodic = lapic_timer_periodic,
+    .set_oneshot = lapic_timer_oneshot,
+    .read = lapic_timer_read,
+};
+
+static void lapic_timer_periodic(void) {
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer.cycles_per_tick);
+}
+
+static void lapic_timer_oneshot(uint32_t cycles) {
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, cycles);
+}
+
+static uint32_t lapic_timer_read(int *expired) {
+    uint32_t left = lapic_read(LAPIC_TIMER_CURRENT);
+    if (expired) {
+        *expired = (left == 0);     // A one-shot stops at 0
+    }
+    return left;
+}
+
+// LAPIC timer counts in one tick, measured against the TSC
+static uint32_t lapic_timer_calibrate(void) {
+    uint32_t tsc_per_tick = clock_tsc_hz() / TIMER_HZ;
+    if (tsc_per_tick == 0) return 0;
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < tsc_per_tick);
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    irq_restore(flags);
+
+    return counted;
+}
+
+/* ====== Setup ====== */
+
+int apic_init(void) {
+    vga_print("[*] Looking for an APIC...\n");
+
+    for (int irq = 0; irq < ISA_IRQS; irq++) {
+        isa_routes[irq].gsi = irq;      // Identity unless overridden
+    }
+
+    if (!(cpu_features_edx() & CPUID_FEAT_EDX_APIC)) {
+        vga_print("[!] No local APIC, staying on the 8259 PIC\n");
+        return -1;
+    }
+    int found = madt_parse() == 0;
+    if (!found) {
+        ioapic_count = cpu_count = 0;
+        for (int irq = 0; irq < ISA_IRQS; irq++) {
+            isa_routes[irq].gsi = irq;
+            isa_routes[irq].flags = 0;
+        }
+        found = mp_parse() == 0;
+    }
+    page_unmap_range(APIC_TABLE_VIRT, APIC_TABLE_PAGES);
+    if (!found) {
+        vga_print("[!] No MADT or MP table, staying on the 8259 PIC\n");
+        return -1;
+    }
+    if (cpu_count == 0) add_cpu(0);
+
+    if (map_registers() != 0) {
+        vga_print("[!] Could not map the APIC registers, staying on the 8259 PIC\n");
+        lapic = NULL;
+        return -1;
+    }
+    lapic_enable();
+    idt_set_entry(APIC_SPURIOUS_VECTOR, (uint32_t)irq_spurious, 0x08, 0x8E);
+
+    // Hand over every IRQ the 8259s had enabled, then mask them for good
+    uint32_t flags = irq_save();
+    uint16_t enabled = ~pic_get_mask();
+    pic_set_mask(0xFFFF);
+    if (need_imcr) {
+        outb(IMCR_SELECT, 0x70);
+        outb(IMCR_DATA, 0x01);
+    }
+    lapic_eoi = &lapic[LAPIC_EOI / 4];
+    active = 1;
+    for (int irq = 0; irq < ISA_IRQS; irq++) {
+        if (enabled & (1 << irq)) apic_enable_irq(irq);
+    }
+    irq_restore(flags);
+
+    // The tick moves to the LAPIC timer if the TSC can measure it
+    uint32_t per_tick = lapic_timer_calibrate();
+    if (per_tick > 1) {
+        lapic_timer.cycles_per_tick = per_tick;
+        apic_disable_irq(0);
+        timer_set_source(&lapic_timer);
+    }
+
+    char buf[16];
+    vga_print("[+] APIC (");
+    vga_print(found_in);
+    vga_print("): ");
+    utoa(cpu_count, buf, 10);
+    vga_print(buf);
+    vga_print(" CPU(s), ");
+    utoa(ioapic_count, buf, 10);
+    vga_print(buf);
+    vga_print(" IOAPIC(s), tick from the ");
+    vga_print(timer_source_name());
+    vga_print("\n");
+    return 0;
+}
+
+void apic_cpu_init(void) {
+    lapic_enable();
+
+    // The boot CPU's tick rate, so the scheduler preempts here too; only
+    // the boot CPU's timer advances the clock (timer.c)
+    if (lapic_timer.cycles_per_tick) {
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+        lapic_timer_periodic();
+    }
+}
+
+int apic_active(void) {
+    return active;
+}
+
+uint32_t apic_cpu_count(void) {
+    return active ? cpu_count : 1;
+}
+
+uint32_t apic_cpu_apic_id(uint32_t index) {
+    return index < cpu_count ? cpu_ids[index] : 0;
+}
+
+/* ====== Info ====== */
+
+static void print_hex(const char *label, uint32_t value) {
+    char buf[16];
+    vga_print(label);
+    vga_print("0x");
+    utoa(value, buf, 16);
+    vga_print(buf);
+}
+
+static void print_dec(const char *label, uint32_t value) {
+    char buf[16];
+    vga_print(label);
+    utoa(value, buf, 10);
+    vga_print(buf);
+}
+
+void apic_print_info(void) {
+    if (!active) {
+        vga_print("Interrupts: 8259 PIC (no APIC in use)\n");
+        vga_print("  Tick source: ");
+        vga_print(timer_source_name());
+        vga_print("\n");
+        return;
+    }
+
+    vga_print("Interrupts: APIC, from the ");
+    vga_print(found_in);
+    vga_print("\n");
+    print_hex("  Local APIC: ", lapic_phys);
+    print_dec(", id ", lapic_id());
+    print_hex(", version ", lapic_read(LAPIC_VERSION) & 0xFF);
+    vga_print("\n");
+
+    vga_print("  CPUs (APIC ids):");
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        print_dec(" ", cpu_ids[i]);
+    }
+    vga_print("\n");
+
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        print_dec("  IOAPIC ", ioapics[i].id);
+        print_hex(": ", ioapics[i].phys);
+        print_dec(", GSI ", ioapics[i].gsi_base);
+        print_dec("-", ioapics[i].gsi_base + ioapics[i].pins - 1);
+        vga_print("\n");
+    }
+
+    for (int irq = 0; irq < ISA_IRQS; irq++) {
+        isa_route_t *route = &isa_routes[irq];
+        if (route->gsi == (uint32_t)irq && route->flags == 0) continue;
+        print_dec("  IRQ ", irq);
+        print_dec(" -> GSI ", route->gsi);
+        if ((route->flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW) vga_print(", active low");
+        if ((route->flags & INTI_TRIGGER_MASK) == INTI_LEVEL) vga_print(", level");
+        vga_print("\n");
+    }
+
+    vga_print("  Tick source: ");
+    vga_print(timer_source_name());
+    if (lapic_timer.cycles_per_tick) {
+        print_dec(" (", lapic_timer.cycles_per_tick);
+        vga_print(" counts/tick at /16)");
+    }
+    vga_print("\n");
+}
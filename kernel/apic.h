@@ -0,0 +1,86 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+/*
+ * Local APIC and IOAPIC
+ *
+ * Found through the ACPI MADT, or the Intel MP table on older firmware.
+ * When the APIC is in use the ISA IRQs are routed through the IOAPIC to
+ * the same vectors (32 + irq) the 8259s used, the 8259s are masked, and
+ * interrupts are acknowledged with one MMIO write to the LAPIC instead
+ * of port I/O. The LAPIC timer takes over the tick when the TSC is there
+ * to calibrate it. Without an APIC, or without either table, the 8259
+ * path stays as it was.
+ */
+
+#define APIC_MMIO_VIRT      0xFFB00000  // LAPIC page, then one per IOAPIC
+#define APIC_TABLE_VIRT     0xFFA00000  // Window for reading firmware tables
+#define APIC_TABLE_PAGES    16
+
+#define APIC_MAX_CPUS       16
+#define APIC_MAX_IOAPICS    4
+
+#define APIC_SPURIOUS_VECTOR 0xFF
+#define APIC_TIMER_VECTOR    32         // Same vector as IRQ 0
+
+// Local APIC registers, byte offsets
+#define LAPIC_ID            0x020
+#define LAPIC_VERSION       0x030
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV_16  0x3
+
+// Interrupt command register, low word: vector, delivery mode, status
+#define LAPIC_ICR_INIT      0x500
+#define LAPIC_ICR_STARTUP   0x600       // Vector field is the start page
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_ICR_ASSERT    0x4000
+
+// Acknowledge the interrupt being handled: the stubs write here when it
+// is set, and fall back to the 8259s when it is NULL
+extern volatile uint32_t *lapic_eoi;
+
+// Needs paging and the heap (maps the registers); call with the 8259s
+// already set up. Returns 0 if the APIC took over.
+int apic_init(void);
+int apic_active(void);
+
+// Route or mask an ISA IRQ at the IOAPIC (pic_enable_irq() calls these)
+void apic_enable_irq(int irq);
+void apic_disable_irq(int irq);
+
+// The same setup on an application processor, its timer included
+void apic_cpu_init(void);
+
+// Send an IPI (ICR low word: vector and mode) to one local APIC and wait
+// for it to be accepted
+void apic_send_ipi(uint32_t apic_id, uint32_t icr_low);
+
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+uint32_t lapic_id(void);
+
+// Processors listed by the firmware, boot processor included
+uint32_t apic_cpu_count(void);
+uint32_t apic_cpu_apic_id(uint32_t index);
+
+void apic_print_info(void);
+
+#endif
@@ -1,8 +1,20 @@
 #include "ata.h"
 #include "io.h"
+#include "pic.h"
+#include "cpu.h"
+#include "wait.h"
 #include <stdint.h>
 
 static int ata_present = 0;
+static uint32_t ata_sectors = 0;   /* LBA28 capacity from IDENTIFY */
+
+/* Set by IRQ 14; cleared before each command */
+static volatile int ata_irq_seen = 0;
+static wait_queue_t ata_waiters = WAIT_QUEUE_INIT;
+
+/* Held from selecting the drive to the end of the command */
+static int ata_busy = 0;
+static wait_queue_t ata_lock_waiters = WAIT_QUEUE_INIT;
 
 /* 400ns delay */
 static inline void ata_400ns_delay(void) {
@@ -33,6 +45,50 @@ static int ata_wait_drq(uint32_t spins) {
     return 0;
 }
 
+/* Wait for the drive to finish a command phase. A caller with interrupts
+ * on sleeps until IRQ 14; inside an irq_save() section (swap, reclaim,
+ * system calls) nothing else may run, so it polls as before. The status
+ * poll afterwards is then only a check: the drive is already done. */
+static int ata_wait_irq(void) {
+    if (irq_enabled()) {
+        /* BSY as well: a late IRQ from a polled command may set the flag */
+        wait_event_timeout(ata_waiters,
+                           ata_irq_seen && !(inb(ATA_ALT_STATUS) & ATA_STATUS_BSY),
+                           ATA_IRQ_TIMEOUT);
+    }
+    return ata_wait_not_busy(2000000);
+}
+
+/* One command at a time: its issuer may sleep until IRQ 14 between
+ * phases, and the taskfile and ata_irq_seen are its until the end.
+ * Polled callers take it too, and only sleep here while a sleeping
+ * task's command is in flight. */
+static void ata_lock(void) {
+    uint32_t flags = irq_save();
+    wait_event(ata_lock_waiters, !ata_busy);
+    ata_busy = 1;
+    irq_restore(flags);
+}
+
+int ata_idle(void) {
+    return !ata_busy;
+}
+
+static void ata_unlock(void) {
+    uint32_t flags = irq_save();
+    ata_busy = 0;
+    wait_wake_one(&ata_lock_waiters);
+    irq_restore(flags);
+}
+
+void ata_interrupt_handler(void) {
+    inb(ATA_STATUS);        /* Reading status acks the drive's interrupt */
+    uint32_t flags = irq_save();
+    ata_irq_seen = 1;
+    wait_wake_all(&ata_waiters);
+    irq_restore(flags);
+}
+
 /* -------------------------------------------------- */
 /* ATA INIT — IDENTIFY BASED (CORRECT WAY)             */
 /* -------------------------------------------------- */
@@ -66,7 +122,14 @@ void ata_init(void) {
     for (int i = 0; i < 256; i++)
         identify[i] = inw(ATA_DATA);
 
+    /* Words 60-61: total addressable sectors */
+    ata_sectors = identify[60] | ((uint32_t)identify[61] << 16);
     ata_present = 1;
+
+    /* Interrupts on (nIEN clear), through the slave PIC's cascade */
+    outb(ATA_DEV_CONTROL, 0);
+    pic_enable_irq(2);
+    pic_enable_irq(14);
 }
 
 /* Single source of truth */
@@ -74,11 +137,14 @@ int ata_is_present(void) {
     return ata_present;
 }
 
+uint32_t ata_get_sector_count(void) {
+    return ata_present ? ata_sectors : 0;
+}
+
 /* -------------------------------------------------- */
 /* READ SECTOR                                        */
 /* -------------------------------------------------- */
-int ata_read_sector(uint32_t lba, uint8_t *buf) {
-    if (!ata_present) return -1;
+static int ata_pio_read(uint32_t lba, uint8_t *buf) {
     if (!ata_wait_not_busy(1000000)) return -1;
 
     outb(ATA_DRIVE, ATA_MASTER | ((lba >> 24) & 0x0F));
@@ -87,8 +153,11 @@ int ata_read_sector(uint32_t lba, uint8_t *buf) {
     outb(ATA_LBA_LOW, lba & 0xFF);
     outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
     outb(ATA_LBA_HIGH, (lba >> 16) & 0xFF);
+    ata_irq_seen = 0;
     outb(ATA_COMMAND, ATA_CMD_READ_SECTORS);
 
+    /* The drive interrupts once the sector is in its buffer */
+    if (!ata_wait_irq()) return -1;
     if (!ata_wait_drq(2000000)) return -1;
 
     for (int i = 0; i < 256; i++) {
@@ -103,8 +172,7 @@ int ata_read_sector(uint32_t lba, uint8_t *buf) {
 /* -------------------------------------------------- */
 /* WRITE SECTOR                                       */
 /* -------------------------------------------------- */
-int ata_write_sector(uint32_t lba, const uint8_t *buf) {
-    if (!ata_present) return -1;
+static int ata_pio_write(uint32_t lba, const uint8_t *buf) {
     if (!ata_wait_not_busy(1000000)) return -1;
 
     outb(ATA_DRIVE, ATA_MASTER | ((lba >> 24) & 0x0F));
@@ -117,29 +185,50 @@ int ata_write_sector(uint32_t lba, const uint8_t *buf) {
 
     if (!ata_wait_drq(2000000)) return -1;
 
+    ata_irq_seen = 0;
     for (int i = 0; i < 256; i++) {
         uint16_t w = buf[i * 2] | (buf[i * 2 + 1] << 8);
         outw(ATA_DATA, w);
     }
 
-    if (!ata_wait_not_busy(2000000)) return -1;
+    /* ...and again once it is on the disk */
+    if (!ata_wait_irq()) return -1;
+    if (inb(ATA_STATUS) & (ATA_STATUS_ERR | ATA_STATUS_DF)) return -1;
     return 0;
 }
 
+int ata_read_sector(uint32_t lba, uint8_t *buf) {
+    if (!ata_present) return -1;
+    ata_lock();
+    int result = ata_pio_read(lba, buf);
+    ata_unlock();
+    return result;
+}
+
+int ata_write_sector(uint32_t lba, const uint8_t *buf) {
+    if (!ata_present) return -1;
+    ata_lock();
+    int result = ata_pio_write(lba, buf);
+    ata_unlock();
+    return result;
+}
+
 /* -------------------------------------------------- */
 /* IDENTIFY (USER CALL)                               */
 /* -------------------------------------------------- */
 int ata_identify(uint16_t *buf) {
     if (!ata_present) return -1;
 
+    ata_lock();
     outb(ATA_DRIVE, ATA_MASTER);
     ata_400ns_delay();
     outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
 
-    if (!ata_wait_drq(2000000)) return -1;
-
-    for (int i = 0; i < 256; i++)
-        buf[i] = inw(ATA_DATA);
-
-    return 0;
+    int ok = ata_wait_drq(2000000);
+    if (ok) {
+        for (int i = 0; i < 256; i++)
+            buf[i] = inw(ATA_DATA);
+    }
+    ata_unlock();
+    return ok ? 0 : -1;
 }
@@ -12,6 +12,8 @@
 #define ATA_DRIVE           0x1F6
 #define ATA_STATUS          0x1F7
 #define ATA_COMMAND         0x1F7
+#define ATA_ALT_STATUS      0x3F6   /* Status without acking the interrupt */
+#define ATA_DEV_CONTROL     0x3F6   /* Written: bit 1 (nIEN) masks the IRQ */
 
 #define ATA_CMD_READ_SECTORS    0x20
 #define ATA_CMD_WRITE_SECTORS   0x30
@@ -31,10 +33,19 @@
 
 #define ATA_SECTOR_SIZE 512
 
+/* Ticks to wait for the drive's interrupt before giving up */
+#define ATA_IRQ_TIMEOUT 200
+
 void ata_init(void);
 int ata_is_present(void);
+uint32_t ata_get_sector_count(void);
 int ata_read_sector(uint32_t lba, uint8_t *buffer);
 int ata_write_sector(uint32_t lba, const uint8_t *buffer);
 int ata_identify(uint16_t *buffer);
+/* No command in flight. Checked inside an irq_save() section, the
+ * reads and writes that follow in it can't have to sleep for the drive. */
+int ata_idle(void);
+/* IRQ 14: the drive finished a command phase */
+void ata_interrupt_handler(void);
 
 #endif
\ No newline at end of file
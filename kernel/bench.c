@@ -0,0 +1,495 @@
+#include "bench.h"
+#include "paging.h"
+#include "vga.h"
+#include "string.h"
+#include "cpu.h"
+#include "task.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "timer.h"
+#include "clock.h"
+#include "apic.h"
+#include "idt.h"
+#include "smp.h"
+#include "wait.h"
+#include <stddef.h>
+
+// Scratch virtual range for the 4KB alias of the direct map
+#define BENCH_ALIAS_VIRT   0xD0000000
+#define BENCH_WALK_PASSES  16
+#define BENCH_SWITCH_PAGES 64     // Kernel pages touched after each switch
+#define BENCH_SWITCHES     1000
+#define BENCH_FORKS        50
+#define BENCH_IRQS         10000
+#define BENCH_SMP_ITERS    (1u << 25)  // Split between the workers
+
+// Vectors for bench_irq(), clear of the IRQs and the spurious vector
+#define BENCH_VECTOR_NONE  0xF0
+#define BENCH_VECTOR_PIC   0xF1
+#define BENCH_VECTOR_LAPIC 0xF2
+
+static void print_cycles(const char *label, uint32_t cycles, uint32_t count) {
+    char buf[16];
+    vga_print(label);
+    utoa(cycles / count, buf, 10);
+    vga_print(buf);
+    vga_print(" cycles each\n");
+}
+
+// Read one word per page over [base, base + size), several times over.
+// Each page touch needs a translation, so with 4KB pages this thrashes
+// the TLB while 4MB pages cover the whole range with a few entries.
+static uint32_t walk(uint32_t base, uint32_t size, int passes) {
+    volatile uint32_t *p;
+    uint32_t sum = 0;
+
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (int pass = 0; pass < passes; pass++) {
+        for (uint32_t off = 0; off < size; off += PAGE_SIZE) {
+            p = (volatile uint32_t *)(base + off);
+            sum += *p;
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+    irq_restore(flags);
+
+    (void)sum;
+    // No 64-bit division in the kernel; a walk never gets near 2^32 cycles
+    return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+}
+
+void bench_tlb(void) {
+    uint32_t size = DIRECT_MAP_SIZE;
+    uint32_t accesses = (size / PAGE_SIZE) * BENCH_WALK_PASSES;
+    char buf[16];
+
+    vga_print("TLB benchmark: ");
+    itoa(size / 1024 / 1024, buf, 10);
+    vga_print(buf);
+    vga_print("MB walk, one read per page, ");
+    itoa(BENCH_WALK_PASSES, buf, 10);
+    vga_print(buf);
+    vga_print(" passes\n");
+
+    // Same physical memory, mapped again with 4KB PTEs
+    if (page_map_range(BENCH_ALIAS_VIRT, 0, size / PAGE_SIZE, PTE_WRITE) != 0) {
+        vga_print("ERROR: could not build the 4KB alias\n");
+        return;
+    }
+
+    // Warm the caches so both walks see the same data cache state
+    walk(KERNEL_VIRT_BASE, size, BENCH_WALK_PASSES);
+    uint32_t direct = walk(KERNEL_VIRT_BASE, size, BENCH_WALK_PASSES);
+    walk(BENCH_ALIAS_VIRT, size, BENCH_WALK_PASSES);
+    uint32_t small = walk(BENCH_ALIAS_VIRT, size, BENCH_WALK_PASSES);
+
+    page_unmap_range(BENCH_ALIAS_VIRT, size / PAGE_SIZE);
+
+    print_cycles(paging_large_pages() ? "  Direct map (4MB pages): "
+                                      : "  Direct map (4KB pages, no PSE): ",
+                 direct, accesses);
+    print_cycles("  4KB alias:               ", small, accesses);
+    if (direct > 0) {
+        vga_print("  4KB pages are ");
+        utoa(small / direct, buf, 10);
+        vga_print(buf);
+        vga_print(".");
+        utoa((small % direct) * 10 / direct, buf, 10);
+        vga_print(buf);
+        vga_print("x slower\n");
+    }
+}
+
+// Bounce between two address spaces, touching the same kernel pages in
+// each, and time a round trip
+static uint32_t switch_round_trips(address_space_t *a, address_space_t *b) {
+    uint32_t size = BENCH_SWITCH_PAGES * PAGE_SIZE;
+
+    uint32_t flags = irq_save();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_SWITCHES; i++) {
+        paging_switch(b);
+        walk(BENCH_ALIAS_VIRT, size, 1);
+        paging_switch(a);
+        walk(BENCH_ALIAS_VIRT, size, 1);
+    }
+    uint64_t cycles = rdtsc() - start;
+    irq_restore(flags);
+
+    return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+}
+
+void bench_cr3(void) {
+    char buf[16];
+
+    if (!paging_global_pages()) {
+        vga_print("CPU has no global pages (PGE); nothing to compare\n");
+        return;
+    }
+
+    address_space_t *home = paging_current_space();
+    address_space_t *other = paging_space_create();
+    if (!other) {
+        vga_print("ERROR: could not create an address space\n");
+        return;
+    }
+
+    // Kernel pages mapped with 4KB PTEs, so each one needs its own TLB entry
+    if (page_map_range(BENCH_ALIAS_VIRT, 0, BENCH_SWITCH_PAGES, PTE_WRITE) != 0) {
+        vga_print("ERROR: could not map benchmark pages\n");
+        paging_space_destroy(other);
+        return;
+    }
+
+    vga_print("CR3 switch benchmark: ");
+    itoa(BENCH_SWITCHES, buf, 10);
+    vga_print(buf);
+    vga_print(" round trips, ");
+    itoa(BENCH_SWITCH_PAGES, buf, 10);
+    vga_print(buf);
+    vga_print(" kernel pages touched per switch\n");
+
+    uint32_t loads = paging_get_cr3_loads();
+    switch_round_trips(home, other);
+    uint32_t global = switch_round_trips(home, other);
+
+    paging_set_global(0);
+    switch_round_trips(home, other);
+    uint32_t flushed = switch_round_trips(home, other);
+    paging_set_global(1);
+    loads = paging_get_cr3_loads() - loads;
+
+    page_unmap_range(BENCH_ALIAS_VIRT, BENCH_SWITCH_PAGES);
+    paging_space_destroy(other);
+
+    print_cycles("  Global kernel pages: ", global, BENCH_SWITCHES * 2);
+    print_cycles("  Without global:      ", flushed, BENCH_SWITCHES * 2);
+    vga_print("  CR3 loads: ");
+    utoa(loads, buf, 10);
+    vga_print(buf);
+    vga_print("\n");
+}
+
+// Parent for the fork benchmark; never actually scheduled in
+static void bench_fork_idle(void) {
+    for (;;) {
+        asm volatile("hlt");
+    }
+}
+
+static task_t *find_task(int id) {
+    for (int i = 0; ; i++) {
+        task_t *task = get_task_ptr(i);
+        if (task == NULL || (int)task->id == id) return task;
+    }
+}
+
+// Fork a parent with more and more of its heap backed, tearing each
+// child down straight away. With copy-on-write the cost per fork is a
+// PTE walk, not a copy of the parent's memory.
+void bench_fork(void) {
+    static const uint32_t sizes[] = { 0, 64, 256, 1024 };   // Pages backed in the parent
+    const uint32_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    uint32_t results[sizeof(sizes) / sizeof(sizes[0])];
+    char buf[16];
+
+    task_t *parent = task_create(bench_fork_idle);
+    if (!parent) {
+        vga_print("ERROR: could not create the parent task\n");
+        return;
+    }
+
+    // Run as the parent, without the timer switching away underneath
+    uint32_t flags = irq_save();
+    task_t *saved_task = current_task;
+    address_space_t *saved_space = paging_current_space();
+    current_task = parent;
+    paging_switch(parent->space);
+
+    uint32_t touched = 0;
+    for (uint32_t s = 0; s < nsizes; s++) {
+        // Back more of the heap; each write faults a page in
+        for (; touched < sizes[s]; touched++) {
+            *(volatile uint32_t *)(TASK_HEAP_BASE + touched * PAGE_SIZE) = touched;
+        }
+
+        uint64_t start = rdtsc();
+        for (int i = 0; i < BENCH_FORKS; i++) {
+            task_destroy(find_task(task_fork(bench_fork_idle)));
+        }
+        uint64_t cycles = rdtsc() - start;
+        results[s] = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+    }
+
+    // With a child alive, the parent's next write pays for one page copy
+    vmm_stats_t before, after;
+    vmm_get_stats(&before);
+    task_t *child = find_task(task_fork(bench_fork_idle));
+    *(volatile uint32_t *)TASK_HEAP_BASE = 0;
+    vmm_get_stats(&after);
+
+    current_task = saved_task;
+    paging_switch(saved_space);
+    irq_restore(flags);
+
+    task_destroy(child);
+    task_destroy(parent);
+
+    vga_print("Fork+exit benchmark: ");
+    itoa(BENCH_FORKS, buf, 10);
+    vga_print(buf);
+    vga_print(" forks per size\n");
+    for (uint32_t s = 0; s < nsizes; s++) {
+        vga_print("  Parent with ");
+        utoa(sizes[s], buf, 10);
+        vga_print(buf);
+        vga_print(" pages: ");
+        utoa(results[s] / BENCH_FORKS, buf, 10);
+        vga_print(buf);
+        vga_print(" cycles/fork\n");
+    }
+    vga_print("  Page copies on the first write after fork: ");
+    utoa(after.cow_copies - before.cow_copies, buf, 10);
+    vga_print(buf);
+    vga_print("\n");
+}
+
+// Yield with a timestamp taken just before the int 0x80. The task that
+// resumes counts the hop if it came straight from the other benchmark
+// task, with no third task (idle) run in between.
+static volatile uint32_t hop_start;
+static volatile uint32_t hop_switches;
+static task_t *volatile hop_from;
+static uint32_t hop_cycles, hop_samples;
+static volatile int switch_bench_running;
+
+static void bench_yield(void) {
+    hop_from = current_task;
+    hop_switches = task_get_switch_count();
+    hop_start = (uint32_t)rdtsc();
+    task_yield();
+    uint32_t end = (uint32_t)rdtsc();
+
+    if (hop_from != current_task && task_get_switch_count() == hop_switches + 1) {
+        hop_cycles += end - hop_start;
+        hop_samples++;
+    }
+}
+
+static void bench_switch_partner(void) {
+    while (switch_bench_running) {
+        bench_yield();
+    }
+}
+
+void bench_switch(void) {
+    char buf[16];
+
+    hop_cycles = hop_samples = 0;
+    switch_bench_running = 1;
+    if (!task_create(bench_switch_partner)) {
+        vga_print("ERROR: could not create the partner task\n");
+        return;
+    }
+
+    uint32_t switches = task_get_switch_count();
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCH_SWITCHES; i++) {
+        bench_yield();
+    }
+    uint64_t cycles = rdtsc() - start;
+    switches = task_get_switch_count() - switches;
+
+    // The partner returns from its entry function and is freed by idle
+    switch_bench_running = 0;
+
+    vga_print("Context switch benchmark: ");
+    itoa(BENCH_SWITCHES, buf, 10);
+    vga_print(buf);
+    vga_print(" yields from the shell\n");
+    if (hop_samples) {
+        print_cycles("  Task to task (int 0x80 to resumed): ", hop_cycles, hop_samples);
+    }
+    if (switches) {
+        print_cycles("  Per switch, whole run queue:        ",
+                     cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles, switches);
+    }
+    vga_print("  Switches: ");
+    utoa(switches, buf, 10);
+    vga_print(buf);
+    vga_print(", direct hops timed: ");
+    utoa(hop_samples, buf, 10);
+    vga_print(buf);
+    vga_print("\n");
+}
+
+// One second of the shell sleeping: irq_0s taken and ticks counted
+static void nohz_sample(const char *label, int nohz) {
+    char buf[16];
+    timer_stats_t before, after;
+
+    timer_set_nohz(nohz);
+    timer_get_stats(&before);
+    uint32_t start = timer_get_ticks();
+    uint64_t start_ns = ktime_ns();
+    timer_sleep(1000);
+    uint32_t elapsed = timer_get_ticks() - start;
+    timespec_t measured;
+    ktime_to_timespec(ktime_ns() - start_ns, &measured);
+    timer_get_stats(&after);
+
+    vga_print(label);
+    utoa(after.interrupts - before.interrupts, buf, 10);
+    vga_print(buf);
+    vga_print(" wakeups/s, ");
+    utoa(elapsed, buf, 10);
+    vga_print(buf);
+    vga_print(" ticks (");
+    utoa(after.skipped - before.skipped, buf, 10);
+    vga_print(buf);
+    vga_print(" without an interrupt), ");
+    utoa(measured.tv_sec * 1000 + measured.tv_nsec / NSEC_PER_MSEC, buf, 10);
+    vga_print(buf);
+    vga_print("ms by the TSC\n");
+}
+
+void bench_nohz(void) {
+    vga_print("Timer interrupts over 1s with the system idle:\n");
+    nohz_sample("  Periodic tick: ", 0);
+    nohz_sample("  Dynamic tick:  ", 1);
+}
+
+extern void irq_bench_none(void);
+extern void irq_bench_pic(void);
+extern void irq_bench_lapic(void);
+
+// Cycles for BENCH_IRQS round trips through one vector
+#define TIME_INTS(vector) ({                                \
+    uint64_t _start = rdtsc();                              \
+    for (int _i = 0; _i < BENCH_IRQS; _i++) {               \
+        asm volatile("int %0" : : "i"(vector) : "memory");  \
+    }                                                       \
+    uint64_t _cycles = rdtsc() - _start;                    \
+    _cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)_cycles;  \
+})
+
+void bench_irq(void) {
+    idt_set_entry(BENCH_VECTOR_NONE, (uint32_t)irq_bench_none, 0x08, 0x8E);
+    idt_set_entry(BENCH_VECTOR_PIC, (uint32_t)irq_bench_pic, 0x08, 0x8E);
+    if (lapic_eoi) {
+        idt_set_entry(BENCH_VECTOR_LAPIC, (uint32_t)irq_bench_lapic, 0x08, 0x8E);
+    }
+
+    // Nothing is in service, so the EOIs themselves change nothing
+    uint32_t flags = irq_save();
+    uint32_t none = TIME_INTS(BENCH_VECTOR_NONE);
+    uint32_t pic = TIME_INTS(BENCH_VECTOR_PIC);
+    uint32_t lapic = lapic_eoi ? TIME_INTS(BENCH_VECTOR_LAPIC) : 0;
+    irq_restore(flags);
+
+    char buf[16];
+    vga_print("Interrupt entry to EOI and back (int + EOI + iret), ");
+    utoa(BENCH_IRQS, buf, 10);
+    vga_print(buf);
+    vga_print(" each:\n");
+    print_cycles("  No EOI:             ", none, BENCH_IRQS);
+    print_cycles("  8259 (port 0x20):   ", pic, BENCH_IRQS);
+    if (lapic_eoi) {
+        print_cycles("  LAPIC (MMIO write): ", lapic, BENCH_IRQS);
+    } else {
+        vga_print("  LAPIC: not in use\n");
+    }
+    vga_print(apic_active() ? "  IRQs are acknowledged through the LAPIC\n"
+                            : "  IRQs are acknowledged through the 8259s\n");
+}
+
+/* ====== CPU-bound work across CPUs ====== */
+
+static wait_queue_t smp_start_wq = WAIT_QUEUE_INIT;
+static wait_queue_t smp_done_wq = WAIT_QUEUE_INIT;
+static volatile int smp_go;
+static volatile uint32_t smp_left;
+static uint32_t smp_chunk;
+
+// Held at the gate until all are created, so they start queued together
+// on the shell's CPU and the idle CPUs have to steal them
+static void bench_smp_worker(void) {
+    wait_event(smp_start_wq, smp_go);
+
+    volatile uint32_t x = 1;
+    for (uint32_t i = smp_chunk; i; i--) {
+        x = x * 1664525 + 1013904223;
+    }
+
+    uint32_t flags = irq_save();
+    if (--smp_left == 0) {
+        wait_wake_all(&smp_done_wq);
+    }
+    irq_restore(flags);
+}
+
+// Milliseconds for BENCH_SMP_ITERS split between `workers` tasks, 0 if
+// they could not all be created
+static uint32_t smp_run(uint32_t workers) {
+    smp_go = 0;
+    smp_left = 0;
+    smp_chunk = BENCH_SMP_ITERS / workers;
+
+    uint32_t created = 0;
+    while (created < workers && task_create(bench_smp_worker)) {
+        created++;
+    }
+    smp_left = created;
+
+    uint64_t start = ktime_ns();
+    uint32_t flags = irq_save();
+    smp_go = 1;
+    wait_wake_all(&smp_start_wq);
+    irq_restore(flags);
+    wait_event(smp_done_wq, smp_left == 0);
+    timespec_t elapsed;
+    ktime_to_timespec(ktime_ns() - start, &elapsed);
+
+    if (created < workers) return 0;
+    uint32_t ms = elapsed.tv_sec * 1000 + elapsed.tv_nsec / NSEC_PER_MSEC;
+    return ms ? ms : 1;
+}
+
+void bench_smp(void) {
+    char buf[16];
+    uint32_t ncpus = smp_cpu_count();
+
+    vga_print("CPU-bound work, ");
+    utoa(BENCH_SMP_ITERS, buf, 10);
+    vga_print(buf);
+    vga_print(" iterations split between N workers:\n");
+
+    uint32_t base = 0;
+    for (uint32_t n = 1; n <= ncpus; n++) {
+        uint32_t ms = smp_run(n);
+        if (ms == 0) {
+            vga_print("ERROR: could not create the workers\n");
+            return;
+        }
+        if (n == 1) base = ms;
+
+        uint32_t speedup = base * 100 / ms;
+        vga_print("  ");
+        utoa(n, buf, 10);
+        vga_print(buf);
+        vga_print(n == 1 ? " worker:  " : " workers: ");
+        utoa(ms, buf, 10);
+        vga_print(buf);
+        vga_print("ms, speedup ");
+        utoa(speedup / 100, buf, 10);
+        vga_print(buf);
+        vga_print(speedup % 100 < 10 ? ".0" : ".");
+        utoa(speedup % 100, buf, 10);
+        vga_print(buf);
+        vga_print("x\n");
+    }
+    if (ncpus == 1) {
+        vga_print("  Only one CPU online: nothing to compare against\n");
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+/*
+ * In-kernel micro-benchmarks, run from the shell. Timings are in TSC
+ * cycles with interrupts off, so they are comparable between runs on
+ * the same machine but not across machines.
+ */
+
+// Walk the direct map through 4MB pages and through a 4KB alias of
+// the same memory, reporting cycles per access for each
+void bench_tlb(void);
+
+// Switch CR3 back and forth between two address spaces with kernel
+// pages marked global, then with CR4.PGE off, reporting cycles per switch
+void bench_cr3(void);
+
+// Time fork() plus teardown of the child for parents of growing size
+void bench_fork(void);
+
+// Yield back and forth between the shell and a second task, reporting
+// cycles per switch. Interrupts stay on: the other task has to run.
+void bench_switch(void);
+
+// Sleep for a second with the periodic tick, then with the dynamic tick,
+// reporting timer interrupts taken and ticks counted for each
+void bench_nohz(void);
+
+// Take a software interrupt that acknowledges the 8259 with port I/O,
+// then one that writes the LAPIC's EOI register, reporting cycles for
+// each round trip against one with no EOI at all
+void bench_irq(void);
+
+// Split a fixed amount of CPU-bound work between 1, 2, ... N workers
+// for N CPUs online, reporting wall time (ktime_ns) and speedup over one
+void bench_smp(void);
+
+#endif
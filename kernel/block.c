@@ -3,6 +3,11 @@
 #endif
 #include "block.h"
 #include "ata.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "paging.h"
+#include "cpu.h"
+#include "wait.h"
 #include <stdint.h>
 
 // Simple memcpy implementation
@@ -14,60 +19,152 @@ static void memcpy(void *dest, const void *src, uint32_t n) {
     }
 }
 
-// Block cache
-static block_cache_entry_t block_cache[BLOCK_CACHE_SIZE];
+// Block cache: entries come from a slab cache and sit on an LRU list
+static kmem_cache_t *block_entry_cache;
+static block_cache_entry_t *lru_head = NULL;   // Most recently used
+static block_cache_entry_t *lru_tail = NULL;
+static int cache_entries = 0;
+static wait_queue_t entry_waiters = WAIT_QUEUE_INIT;     // For busy entries
 
-// I/O request queue (static allocation)
-static io_request_t io_requests[IO_QUEUE_SIZE];
+// I/O request queue (FIFO, requests allocated on demand)
+static kmem_cache_t *io_request_cache;
+static io_request_t *io_queue_head = NULL;
+static io_request_t *io_queue_tail = NULL;
 static int io_request_count = 0;
 
+static uint32_t block_shrink_count(void);
+static uint32_t block_shrink(uint32_t target);
+
+static shrinker_t block_shrinker = {
+    .name = "block-cache",
+    .cost = SHRINK_COST_CACHE,
+    .count = block_shrink_count,
+    .scan = block_shrink,
+};
+
 // Initialize block device layer
 void block_init(void) {
     ata_init();
 
-    // Initialize cache
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        block_cache[i].valid = 0;
-        block_cache[i].dirty = 0;
-        block_cache[i].ref_count = 0;
-    }
+    // Initialize cache; entries are allocated as blocks are first used
+    block_entry_cache = kmem_cache_create("block_cache", sizeof(block_cache_entry_t), 0);
+    pmm_register_shrinker(&block_shrinker);
 
     // Initialize I/O queue
     block_queue_init();
 }
 
-// Find a cache entry for the given block, or find an empty slot
-static block_cache_entry_t *find_cache_entry(uint32_t block_num) {
-    // First, look for existing entry
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].valid && block_cache[i].block_num == block_num) {
-            return &block_cache[i];
+static void lru_remove(block_cache_entry_t *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        lru_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru_tail = entry->prev;
+    }
+}
+
+static void lru_push_front(block_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+// Least recently used entry nobody holds, written back if dirty
+static block_cache_entry_t *evict_entry(void) {
+    for (block_cache_entry_t *entry = lru_tail; entry; entry = entry->prev) {
+        if (entry->ref_count != 0) continue;
+
+        if (entry->dirty) {
+            // The write may sleep on the disk: hold the entry meanwhile,
+            // and leave it be if someone wanted it or it is still dirty
+            entry->ref_count++;
+            entry->busy = 1;
+            if (ata_write_sector(entry->block_num, entry->data) == 0) {
+                entry->dirty = 0;
+            }
+            entry->busy = 0;
+            entry->ref_count--;
+            wait_wake_all(&entry_waiters);
+            if (entry->ref_count != 0 || entry->dirty) continue;
         }
+        entry->valid = 0;
+        return entry;
+    }
+    return NULL;
+}
+
+// Find the cache entry for block_num, or claim one for it (not yet
+// valid), and take a reference. Grows the cache only into spare memory.
+// Every entry on the list is named by its block_num from the moment it
+// is claimed, so a block being read in is found rather than claimed
+// twice. The entry comes back busy: the caller fills or rewrites it,
+// then put_cache_entry() lets the next one in.
+static block_cache_entry_t *find_cache_entry(uint32_t block_num) {
+    uint32_t flags = irq_save();
+
+    block_cache_entry_t *entry;
+    for (entry = lru_head; entry; entry = entry->next) {
+        if (entry->block_num == block_num) break;
     }
 
-    // Not found, look for empty slot
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (!block_cache[i].valid) {
-            return &block_cache[i];
+    if (entry) {
+        lru_remove(entry);
+        lru_push_front(entry);
+        entry->ref_count++;         // Can't be evicted while we wait
+        irq_restore(flags);
+
+        for (;;) {
+            wait_event(entry_waiters, !entry->busy);
+            flags = irq_save();
+            int claimed = !entry->busy;
+            if (claimed) entry->busy = 1;
+            irq_restore(flags);
+            if (claimed) return entry;
         }
     }
 
-    // No empty slot, use LRU (simple: first valid entry)
-    // In a real implementation, we'd track access times
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].valid && block_cache[i].ref_count == 0) {
-            // Write back if dirty
-            if (block_cache[i].dirty) {
-                ata_write_sector(block_cache[i].block_num, block_cache[i].data);
-                block_cache[i].dirty = 0;
-            }
-            block_cache[i].valid = 0;
-            return &block_cache[i];
+    if (cache_entries < BLOCK_CACHE_MIN ||
+        (cache_entries < BLOCK_CACHE_MAX && !pmm_under_pressure())) {
+        entry = kmem_cache_alloc(block_entry_cache);
+        if (entry) {
+            entry->ref_count = 0;
+            lru_push_front(entry);
+            cache_entries++;
         }
     }
+    if (!entry) {
+        entry = evict_entry();
+    }
 
-    // All entries are in use, return NULL (shouldn't happen with proper ref counting)
-    return NULL;
+    if (entry) {
+        lru_remove(entry);
+        lru_push_front(entry);
+        entry->block_num = block_num;
+        entry->valid = 0;
+        entry->dirty = 0;
+        entry->busy = 1;
+        entry->ref_count++;
+    }
+
+    irq_restore(flags);
+    return entry;
+}
+
+static void put_cache_entry(block_cache_entry_t *entry) {
+    uint32_t flags = irq_save();
+    entry->busy = 0;
+    entry->ref_count--;
+    wait_wake_all(&entry_waiters);
+    irq_restore(flags);
 }
 
 // Read a block, using cache
@@ -79,19 +176,18 @@ int block_read(uint32_t block_num, uint8_t *buffer) {
         return ata_read_sector(block_num, buffer);
     }
 
-    if (!entry->valid || entry->block_num != block_num) {
-        // Load from disk
+    if (!entry->valid) {
+        // Load from disk; on failure the next reader of the block retries
         if (ata_read_sector(block_num, entry->data) != 0) {
+            put_cache_entry(entry);
             return -1;
         }
-        entry->block_num = block_num;
         entry->valid = 1;
         entry->dirty = 0;
     }
 
-    entry->ref_count++;
     memcpy(buffer, entry->data, BLOCK_SIZE);
-    entry->ref_count--;
+    put_cache_entry(entry);
 
     return 0;
 }
@@ -107,79 +203,127 @@ int block_write(uint32_t block_num, const uint8_t *buffer) {
 
     // Copy data to cache
     memcpy(entry->data, buffer, BLOCK_SIZE);
-    entry->block_num = block_num;
     entry->valid = 1;
     entry->dirty = 1;
-    entry->ref_count++;
 
     // For write-through cache, also write to disk immediately
     int result = ata_write_sector(block_num, buffer);
     if (result == 0) {
         entry->dirty = 0; // Clear dirty flag
     }
-    entry->ref_count--;
+    put_cache_entry(entry);
 
     return result;
 }
 
 // Flush all dirty blocks to disk
 void block_flush(void) {
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].valid && block_cache[i].dirty) {
-            ata_write_sector(block_cache[i].block_num, block_cache[i].data);
-            block_cache[i].dirty = 0;
+    for (block_cache_entry_t *entry = lru_head; entry; entry = entry->next) {
+        if (entry->valid && entry->dirty) {
+            ata_write_sector(entry->block_num, entry->data);
+            entry->dirty = 0;
         }
     }
 }
 
+/* ====== Reclaim ====== */
+
+// Entries above the guaranteed minimum, in pages
+static uint32_t block_shrink_count(void) {
+    if (cache_entries <= BLOCK_CACHE_MIN) return 0;
+    return (cache_entries - BLOCK_CACHE_MIN) * sizeof(block_cache_entry_t) / PAGE_SIZE;
+}
+
+// Drop least recently used entries until target pages came back
+static uint32_t block_shrink(uint32_t target) {
+    uint32_t free_before = pmm_get_free_pages();
+    uint32_t max_entries = target * (PAGE_SIZE / sizeof(block_cache_entry_t));
+
+    uint32_t flags = irq_save();
+    for (uint32_t dropped = 0; dropped < max_entries && cache_entries > BLOCK_CACHE_MIN; dropped++) {
+        block_cache_entry_t *entry = evict_entry();
+        if (!entry) break;
+        lru_remove(entry);
+        cache_entries--;
+        kmem_cache_free(block_entry_cache, entry);
+    }
+    irq_restore(flags);
+
+    // Pages only come back once a whole slab empties
+    return pmm_get_free_pages() - free_before;
+}
+
 // Initialize I/O request queue
 void block_queue_init(void) {
+    if (io_request_cache == NULL) {
+        io_request_cache = kmem_cache_create("io_request", sizeof(io_request_t), 0);
+    }
+    io_queue_head = NULL;
+    io_queue_tail = NULL;
     io_request_count = 0;
 }
 
 // Add a request to the I/O queue
 int block_queue_request(io_operation_t op, uint32_t block_num, uint8_t *buffer) {
-    if (io_request_count >= IO_QUEUE_SIZE) return -1; // Queue full
+    io_request_t *req = kmem_cache_alloc(io_request_cache);
+    if (req == NULL) return -1; // Out of memory
 
-    io_request_t *req = &io_requests[io_request_count++];
     req->operation = op;
     req->block_num = block_num;
     req->buffer = buffer;
     req->completed = 0;
     req->success = 0;
+    req->next = NULL;
+
+    if (io_queue_tail) {
+        io_queue_tail->next = req;
+    } else {
+        io_queue_head = req;
+    }
+    io_queue_tail = req;
+    io_request_count++;
 
     return 0;
 }
 
-// Process pending I/O requests
+// Process pending I/O requests, freeing each one once it completes
 void block_process_queue(void) {
-    for (int i = 0; i < io_request_count; i++) {
-        io_request_t *req = &io_requests[i];
-        if (req->completed) continue;
+    while (io_queue_head) {
+        io_request_t *req = io_queue_head;
 
         if (req->operation == IO_READ) {
             req->success = (block_read(req->block_num, req->buffer) == 0);
         } else if (req->operation == IO_WRITE) {
             req->success = (block_write(req->block_num, req->buffer) == 0);
         }
-
         req->completed = 1;
+
+        io_queue_head = req->next;
+        if (io_queue_head == NULL) {
+            io_queue_tail = NULL;
+        }
+        io_request_count--;
+        kmem_cache_free(io_request_cache, req);
     }
 }
 
 // Get cache statistics
+int block_get_cache_entries(void) {
+    return cache_entries;
+}
+
 int block_get_cache_valid_count(void) {
     int count = 0;
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].valid) count++;
+    for (block_cache_entry_t *entry = lru_head; entry; entry = entry->next) {
+        if (entry->valid) count++;
     }
     return count;
 }
 
 int block_get_cache_dirty_count(void) {
     int count = 0;
-    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
-        if (block_cache[i].valid && block_cache[i].dirty) count++;
+    for (block_cache_entry_t *entry = lru_head; entry; entry = entry->next) {
+        if (entry->valid && entry->dirty) count++;
     }
     return count;
 }
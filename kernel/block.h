@@ -6,19 +6,22 @@
 // Block size (matches ATA sector size)
 #define BLOCK_SIZE 512
 
-// Maximum number of cached blocks
-#define BLOCK_CACHE_SIZE 32
-
-// I/O queue size
-#define IO_QUEUE_SIZE 16
+// The cache can always hold BLOCK_CACHE_MIN blocks, and grows towards
+// BLOCK_CACHE_MAX while memory is plentiful. Under memory pressure the
+// PMM shrinks it back.
+#define BLOCK_CACHE_MIN 32
+#define BLOCK_CACHE_MAX 1024
 
 // Block cache entry
-typedef struct {
+typedef struct block_cache_entry {
     uint32_t block_num;     // Block number (LBA)
     uint8_t data[BLOCK_SIZE]; // Block data
     int dirty;              // 1 if modified and needs writing
     int valid;              // 1 if cache entry is valid
     int ref_count;          // Reference count
+    int busy;               // Being filled or written; others wait for it
+    struct block_cache_entry *next;     // LRU order, most recently used first
+    struct block_cache_entry *prev;
 } block_cache_entry_t;
 
 // I/O request types
@@ -49,6 +52,7 @@ int block_queue_request(io_operation_t op, uint32_t block_num, uint8_t *buffer);
 void block_process_queue(void);
 
 // Information functions
+int block_get_cache_entries(void);
 int block_get_cache_valid_count(void);
 int block_get_cache_dirty_count(void);
 int block_get_queue_pending_count(void);
@@ -0,0 +1,117 @@
+#include "clock.h"
+#include "io.h"
+#include "cpu.h"
+#include "timer.h"
+#include "vga.h"
+#include "string.h"
+#include <stddef.h>
+
+#define PIT_CHANNEL_2   0x42
+#define PIT_CONTROL     0x43
+#define PIT_FREQUENCY   1193182
+#define PIT_CH2_ONESHOT 0xB0    // Channel 2, low then high byte, mode 0
+
+#define PIT_GATE_PORT   0x61
+#define PIT_GATE_CH2    0x01    // Channel 2 counts while set
+#define PIT_SPEAKER     0x02    // Channel 2 output drives the speaker
+#define PIT_OUT_CH2     0x20    // Channel 2 output, high once the count ends
+
+#define CALIBRATE_MS     10
+#define CALIBRATE_RUNS   3
+#define CALIBRATE_SPINS  10000000   // Give up if OUT2 never goes high
+
+static uint64_t tsc_base;
+static uint32_t tsc_hz = 0;
+
+// ns = cycles * (ns_whole + ns_frac / 2^32); no 64-bit divide needed
+static uint32_t ns_whole;
+static uint32_t ns_frac;
+
+// (hi:lo) / d, for a quotient known to fit in 32 bits
+static inline uint32_t div_64_32(uint32_t hi, uint32_t lo, uint32_t d, uint32_t *rem) {
+    uint32_t q, r;
+    asm("divl %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    if (rem) *rem = r;
+    return q;
+}
+
+// Cycles for one CALIBRATE_MS run of PIT channel 2, or 0 if it never ends
+static uint32_t calibrate_once(void) {
+    uint32_t count = PIT_FREQUENCY / (1000 / CALIBRATE_MS);
+
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~PIT_SPEAKER) & ~PIT_GATE_CH2);
+    outb(PIT_CONTROL, PIT_CH2_ONESHOT);
+    outb(PIT_CHANNEL_2, count & 0xFF);
+    outb(PIT_CHANNEL_2, (count >> 8) & 0xFF);
+
+    // Raising the gate starts the count
+    outb(PIT_GATE_PORT, ((gate & ~PIT_SPEAKER) | PIT_GATE_CH2));
+    uint64_t start = rdtsc();
+    uint32_t spins = CALIBRATE_SPINS;
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT_CH2) && --spins);
+    uint64_t cycles = rdtsc() - start;
+
+    outb(PIT_GATE_PORT, gate);
+    if (spins == 0 || cycles > 0xFFFFFFFF) return 0;
+    return (uint32_t)cycles;
+}
+
+void clock_init(void) {
+    vga_print("[*] Calibrating TSC...\n");
+
+    if (!(cpu_features_edx() & CPUID_FEAT_EDX_TSC)) {
+        vga_print("[!] No TSC, clock runs at tick resolution\n");
+        return;
+    }
+
+    // Shortest run: the others lost time to SMIs or the like
+    uint32_t flags = irq_save();
+    uint32_t best = 0;
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint32_t cycles = calibrate_once();
+        if (cycles && (best == 0 || cycles < best)) best = cycles;
+    }
+    tsc_base = rdtsc();
+    irq_restore(flags);
+
+    if (best == 0 || best > 0xFFFFFFFF / (1000 / CALIBRATE_MS)) {
+        vga_print("[!] TSC calibration failed, clock runs at tick resolution\n");
+        return;
+    }
+    tsc_hz = best * (1000 / CALIBRATE_MS);
+
+    uint32_t rem;
+    ns_whole = NSEC_PER_SEC / tsc_hz;
+    rem = NSEC_PER_SEC % tsc_hz;
+    ns_frac = div_64_32(rem, 0, tsc_hz, NULL);
+
+    char buf[16];
+    vga_print("[+] TSC: ");
+    utoa(tsc_hz / 1000000, buf, 10);
+    vga_print(buf);
+    vga_print(" MHz\n");
+}
+
+uint64_t ktime_ns(void) {
+    if (tsc_hz == 0) {
+        return (uint64_t)timer_get_ticks() * TIMER_MS_PER_TICK * NSEC_PER_MSEC;
+    }
+
+    uint64_t cycles = rdtsc() - tsc_base;
+    uint32_t hi = cycles >> 32, lo = (uint32_t)cycles;
+    return cycles * ns_whole
+         + (uint64_t)hi * ns_frac
+         + (((uint64_t)lo * ns_frac) >> 32);
+}
+
+void ktime_to_timespec(uint64_t ns, timespec_t *ts) {
+    // Seconds fit in 32 bits for 136 years of uptime
+    uint32_t rem;
+    ts->tv_sec = div_64_32((uint32_t)(ns >> 32), (uint32_t)ns, NSEC_PER_SEC, &rem);
+    ts->tv_nsec = rem;
+}
+
+uint32_t clock_tsc_hz(void) {
+    return tsc_hz;
+}
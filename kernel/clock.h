@@ -0,0 +1,37 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/*
+ * High-resolution monotonic clock
+ *
+ * The TSC is calibrated against PIT channel 2 at boot and read directly
+ * from then on, so a timestamp costs an rdtsc and a few multiplies
+ * rather than waiting on the 100Hz tick. Without a usable TSC it falls
+ * back to ticks, at 10ms resolution.
+ */
+
+#define NSEC_PER_SEC    1000000000u
+#define NSEC_PER_MSEC   1000000u
+#define NSEC_PER_USEC   1000u
+
+// clock_gettime() clock ids
+#define CLOCK_MONOTONIC 1
+
+typedef struct {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+// Needs the PIT and runs with interrupts off, about 30ms
+void clock_init(void);
+
+// Nanoseconds since clock_init()
+uint64_t ktime_ns(void);
+void ktime_to_timespec(uint64_t ns, timespec_t *ts);
+
+// Calibrated TSC rate, 0 if running off ticks
+uint32_t clock_tsc_hz(void);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Time-stamp counter (cycles since reset)
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Index of the lowest set bit; value must not be 0
+static inline uint32_t bit_scan_forward(uint32_t value) {
+    uint32_t index;
+    asm("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_FEAT_EDX_PSE  (1 << 3)     // 4MB pages
+#define CPUID_FEAT_EDX_TSC  (1 << 4)     // rdtsc
+#define CPUID_FEAT_EDX_MSR  (1 << 5)     // rdmsr/wrmsr
+#define CPUID_FEAT_EDX_APIC (1 << 9)     // On-chip local APIC
+#define CPUID_FEAT_EDX_PGE  (1 << 13)    // Global pages
+
+#define CR4_PSE             (1 << 4)
+#define CR4_PGE             (1 << 7)
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(0));
+}
+
+static inline uint32_t cpu_features_edx(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+// Faulting linear address of the last page fault
+static inline uint32_t read_cr2(void) {
+    uint32_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    return cr2;
+}
+
+// Drop the TLB entry for one virtual address
+static inline void invlpg(uint32_t virt) {
+    asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// Interrupts off on this CPU only, returning the previous EFLAGS for
+// local_irq_restore(). For code that touches nothing another CPU does:
+// its own local APIC, its own run queue under a spinlock.
+static inline uint32_t local_irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void local_irq_restore(uint32_t flags) {
+    if (flags & 0x200) {
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+static inline int irq_enabled(void) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
+
+// The kernel lock (smp.c): nests, and is what irq_save() sections
+// exclude each other with once other CPUs are running
+void kernel_lock(void);
+void kernel_unlock(void);
+
+// Disable interrupts and take the kernel lock, returning the previous
+// EFLAGS for irq_restore(). With one CPU the lock costs a counter; with
+// more, a section is still exclusive against every other one, on any
+// CPU, which is what all the code written for one CPU relies on.
+static inline uint32_t irq_save(void) {
+    uint32_t flags = local_irq_save();
+    kernel_lock();
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    kernel_unlock();
+    local_irq_restore(flags);
+}
+
+#endif
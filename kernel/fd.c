@@ -9,9 +9,11 @@
 #include "keyboard.h"
 #include "string.h"
 #include "task.h"
+#include "kmalloc.h"
 
-/* Global pipe pool */
-static pipe_t pipes[PIPE_MAX];
+/* Pipes and per-process fd tables are allocated on demand from slab caches */
+static kmem_cache_t *pipe_cache;
+static kmem_cache_t *fd_table_cache;
 
 /* Default console fd table (used before tasks are running) */
 static fd_table_t kernel_fd_table;
@@ -37,23 +39,21 @@ static int find_free_fd_from(fd_table_t *table, int start) {
 }
 
 static pipe_t *alloc_pipe(void) {
-    for (int i = 0; i < PIPE_MAX; i++) {
-        if (!pipes[i].active) {
-            pipes[i].active = 1;
-            pipes[i].read_pos = 0;
-            pipes[i].write_pos = 0;
-            pipes[i].count = 0;
-            pipes[i].readers = 0;
-            pipes[i].writers = 0;
-            return &pipes[i];
-        }
+    pipe_t *pipe = kmem_cache_alloc(pipe_cache);
+    if (pipe) {
+        pipe->read_pos = 0;
+        pipe->write_pos = 0;
+        pipe->count = 0;
+        pipe->readers = 0;
+        pipe->writers = 0;
+        wait_queue_init(&pipe->writer_wait);
     }
-    return NULL;
+    return pipe;
 }
 
 static void free_pipe(pipe_t *pipe) {
     if (pipe) {
-        pipe->active = 0;
+        kmem_cache_free(pipe_cache, pipe);
     }
 }
 
@@ -62,10 +62,9 @@ static void free_pipe(pipe_t *pipe) {
 void fd_init(void) {
     vga_print("[*] Initializing I/O subsystem...\n");
     
-    /* Initialize pipe pool */
-    for (int i = 0; i < PIPE_MAX; i++) {
-        pipes[i].active = 0;
-    }
+    /* Pipe objects and fd tables come from dedicated caches */
+    pipe_cache = kmem_cache_create("pipe", sizeof(pipe_t), 0);
+    fd_table_cache = kmem_cache_create("fd_table", sizeof(fd_table_t), 0);
     
     /* Initialize kernel fd table with standard I/O */
     fd_table_init(&kernel_fd_table);
@@ -76,10 +75,7 @@ void fd_init(void) {
     itoa(FD_MAX, buf, 10);
     vga_print(buf);
     vga_print(" per process\n");
-    vga_print("    - Pipes available: ");
-    itoa(PIPE_MAX, buf, 10);
-    vga_print(buf);
-    vga_print("\n");
+    vga_print("    - Pipes: allocated on demand\n");
     vga_print("    - stdin=0, stdout=1, stderr=2\n");
 }
 
@@ -113,6 +109,33 @@ void fd_table_init(fd_table_t *table) {
     table->entries[STDERR_FILENO].ref_count = 1;
 }
 
+fd_table_t *fd_table_create(void) {
+    fd_table_t *table = kmem_cache_alloc(fd_table_cache);
+    if (!table) return NULL;
+
+    fd_table_init(table);
+    return table;
+}
+
+fd_table_t *fd_table_clone(fd_table_t *src) {
+    fd_table_t *table = kmem_cache_alloc(fd_table_cache);
+    if (!table) return NULL;
+
+    if (src) {
+        fd_table_copy(table, src);
+    } else {
+        fd_table_init(table);
+    }
+    return table;
+}
+
+void fd_table_destroy(fd_table_t *table) {
+    if (!table) return;
+
+    fd_table_close_all(table);
+    kmem_cache_free(fd_table_cache, table);
+}
+
 void fd_table_copy(fd_table_t *dest, fd_table_t *src) {
     if (!dest || !src) return;
     
@@ -250,6 +273,9 @@ int fd_close(fd_table_t *table, int fd) {
         entry->data.pipe->readers--;
         if (entry->data.pipe->readers == 0 && entry->data.pipe->writers == 0) {
             free_pipe(entry->data.pipe);
+        } else if (entry->data.pipe->readers == 0) {
+            /* Blocked writers get a broken pipe */
+            wait_wake_all(&entry->data.pipe->writer_wait);
         }
     } else if (entry->type == FD_TYPE_PIPE_WRITE && entry->data.pipe) {
         entry->data.pipe->writers--;
@@ -306,6 +332,7 @@ int fd_read(fd_table_t *table, int fd, void *buf, uint32_t count) {
                 pipe->count--;
             }
             
+            wait_wake_all(&pipe->writer_wait);
             return to_read;
         }
         
@@ -347,12 +374,11 @@ int fd_write(fd_table_t *table, int fd, const void *buf, uint32_t count) {
             uint32_t written = 0;
             
             while (written < count) {
-                /* Wait for space in buffer */
-                while (pipe->count >= PIPE_BUFFER_SIZE) {
-                    if (pipe->readers == 0) {
-                        return written > 0 ? written : -1;
-                    }
-                    /* In a real OS, we'd block here */
+                /* Sleep until a reader makes room or goes away */
+                wait_event(pipe->writer_wait,
+                           pipe->count < PIPE_BUFFER_SIZE || pipe->readers == 0);
+                if (pipe->readers == 0) {
+                    return written > 0 ? written : -1;
                 }
                 
                 pipe->buffer[pipe->write_pos] = cbuf[written];
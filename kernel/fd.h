@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "wait.h"
 
 /*
  * Day 10: I/O Subsystem
@@ -14,9 +15,6 @@
 /* Maximum file descriptors per process */
 #define FD_MAX          16
 
-/* Maximum number of system-wide pipes */
-#define PIPE_MAX        8
-
 /* Pipe buffer size */
 #define PIPE_BUFFER_SIZE 512
 
@@ -61,7 +59,7 @@ typedef struct pipe {
     uint32_t count;             /* Bytes currently in buffer */
     uint32_t readers;           /* Number of read ends open */
     uint32_t writers;           /* Number of write ends open */
-    uint8_t active;             /* Is pipe in use? */
+    wait_queue_t writer_wait;   /* Writers waiting for room */
 } pipe_t;
 
 /* File descriptor entry */
@@ -89,6 +87,15 @@ void fd_init(void);
 /* Initialize file descriptor table for a new process */
 void fd_table_init(fd_table_t *table);
 
+/* Allocate and initialize a table with stdin/stdout/stderr */
+fd_table_t *fd_table_create(void);
+
+/* Allocate a copy of `src` (for fork); a fresh table if src is NULL */
+fd_table_t *fd_table_clone(fd_table_t *src);
+
+/* Close every descriptor and free the table */
+void fd_table_destroy(fd_table_t *table);
+
 /* Copy file descriptor table (for fork) */
 void fd_table_copy(fd_table_t *dest, fd_table_t *src);
 
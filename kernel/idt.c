@@ -1,6 +1,8 @@
 #include "idt.h"
 #include "vga.h"
 #include "string.h"
+#include "cpu.h"
+#include "vmm.h"
 
 static IDTEntry idt[IDT_ENTRIES];
 static IDTPointer idt_ptr;
@@ -122,12 +124,45 @@ void idt_init(void) {
     load_idt(&idt_ptr);
 }
 
-void interrupt_handler(int int_num, int err_code) {
-    if (int_num < 32) {
+// Application processors share the table; each loads it for itself
+void idt_load(void) {
+    load_idt(&idt_ptr);
+}
+
+// Exception 14: try to back the page, otherwise there is no way to retry
+static void page_fault_handler(interrupt_frame_t *frame) {
+    uint32_t addr = read_cr2();
+    if (vmm_handle_fault(addr, frame->err_code) == 0) {
+        return;
+    }
+
+    char buf[16];
+    vga_print("\nPage fault at 0x");
+    utoa(addr, buf, 16);
+    vga_print(buf);
+    vga_print(" (");
+    vga_print(frame->err_code & PF_PRESENT ? "protection, " : "not present, ");
+    vga_print(frame->err_code & PF_WRITE ? "write" : "read");
+    vga_print(") EIP=0x");
+    utoa(frame->eip, buf, 16);
+    vga_print(buf);
+    vga_print("\nSystem halted\n");
+
+    for (;;) {
+        asm volatile("cli; hlt");
+    }
+}
+
+void interrupt_handler(interrupt_frame_t *frame) {
+    uint32_t flags = irq_save();
+    if (frame->int_num == 14) {
+        page_fault_handler(frame);
+    } else if (frame->int_num < 32) {
         vga_print("Exception ");
         char buf[16];
-        itoa(int_num, buf, 10);
+        itoa(frame->int_num, buf, 10);
         vga_print(buf);
         vga_print("\n");
     }
+    irq_restore(flags);
 }
@@ -18,7 +18,17 @@ typedef struct {
     uint32_t base;           // Base address of IDT
 } __attribute__((packed)) IDTPointer;
 
+// Stack layout built by isr_common_stub, irq_0 and int_80_wrapper,
+// lowest address first
+typedef struct {
+    uint32_t ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;   // pusha
+    uint32_t int_num, err_code;
+    uint32_t eip, cs, eflags;                           // Pushed by the CPU
+} interrupt_frame_t;
+
 void idt_init(void);
+void idt_load(void);     // Load the table on this CPU (APs)
 void idt_set_entry(int num, uint32_t handler, uint16_t selector, uint8_t type_attr);
 
 #endif
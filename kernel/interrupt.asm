@@ -5,8 +5,12 @@
 [EXTERN interrupt_handler]
 [EXTERN timer_interrupt_handler]
 [EXTERN keyboard_interrupt_handler]
-[EXTERN current_task]
-[EXTERN task_switch]
+[EXTERN ata_interrupt_handler]
+[EXTERN lapic_eoi]
+[EXTERN task_schedule]
+[EXTERN task_finish_switch]
+[EXTERN smp_reschedule_interrupt]
+[EXTERN smp_tlb_interrupt]
 
 ; Macro for CPU exceptions (no error code)
 %macro ISR_NOERRCODE 1
@@ -72,8 +76,13 @@ isr_common_stub:
     mov fs, ax
     mov gs, ax
     
-    call interrupt_handler   ; C function: void interrupt_handler(int int_num, int err_code)
-    
+    push esp                 ; Argument: pointer to the frame just built
+    call interrupt_handler   ; C function: void interrupt_handler(interrupt_frame_t *frame)
+    add esp, 4
+
+; Resume the frame at esp. irq_0 and int 0x80 get here with esp pointing
+; at whichever task's frame the scheduler picked.
+interrupt_return:
     pop eax
     mov ds, ax
     mov es, ax
@@ -86,9 +95,28 @@ isr_common_stub:
 
 ; IRQ handlers (Hardware interrupts 32-47)
 
+; End of interrupt for IRQ %1: one write to the local APIC's EOI register
+; once apic_init() has set lapic_eoi, port writes to the 8259s before
+; that. Clobbers eax.
+%macro IRQ_EOI 1
+    mov eax, [lapic_eoi]
+    test eax, eax
+    jz %%pic
+    mov dword [eax], 0
+    jmp %%done
+%%pic:
+    mov al, 0x20
+    %if %1 >= 8
+    out 0xA0, al             ; Slave first, then the master it cascades through
+    %endif
+    out 0x20, al
+%%done:
+%endmacro
+
 [GLOBAL irq_0]
 irq_0:
-    cli
+    push byte 0              ; Same frame as the exceptions, so every task
+    push byte 32             ; switched out is resumed the same way
     pusha
     mov eax, ds
     push eax
@@ -97,27 +125,20 @@ irq_0:
     mov es, ax
     mov fs, ax
     mov gs, ax
-    
+
+    push esp                 ; interrupt_frame_t *timer_interrupt_handler(frame)
     call timer_interrupt_handler
-    cmp eax, 0
-    je .no_switch
+    mov esp, eax             ; Frame to resume, possibly on another task's stack
+    call task_finish_switch  ; Settle the kernel lock and the task left
 
-.no_switch:    
-    mov al, 0x20
-    out 0x20, al             ; EOI to master PIC
-    pop eax
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-    popa
-    sti
-    iret
+    IRQ_EOI 0
+    jmp interrupt_return
 
 
 [GLOBAL irq_1]
 irq_1:
-    cli
+    push byte 0
+    push byte 33
     pusha
     mov eax, ds
     push eax
@@ -127,16 +148,34 @@ irq_1:
     mov fs, ax
     mov gs, ax
     call keyboard_interrupt_handler
-    mov al, 0x20
-    out 0x20, al             ; EOI to master PIC
-    pop eax
+    IRQ_EOI 1
+
+    push esp                 ; A key may have woken a task that outranks
+    call task_schedule       ; the one interrupted
+    mov esp, eax
+    call task_finish_switch
+    jmp interrupt_return
+
+[GLOBAL irq_14]
+irq_14:
+    push byte 0
+    push byte 46
+    pusha
+    mov eax, ds
+    push eax
+    mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
-    popa
-    sti
-    iret
+    call ata_interrupt_handler
+    IRQ_EOI 14
+
+    push esp                 ; Wakes the task waiting on the disk
+    call task_schedule
+    mov esp, eax
+    call task_finish_switch
+    jmp interrupt_return
 
 ; Stub handlers for other IRQs
 %macro STUB_IRQ 1
@@ -144,11 +183,7 @@ irq_1:
 irq_%1:
     cli
     pusha
-    mov al, 0x20
-    out 0x20, al
-    %if %1 >= 8
-    out 0xA0, al
-    %endif
+    IRQ_EOI %1
     popa
     sti
     iret
@@ -166,9 +201,67 @@ STUB_IRQ 10
 STUB_IRQ 11
 STUB_IRQ 12
 STUB_IRQ 13
-STUB_IRQ 14
 STUB_IRQ 15
 
+; Reschedule IPI from another CPU (smp_send_reschedule()). Built like
+; irq_0, since it may switch tasks.
+[GLOBAL irq_reschedule]
+irq_reschedule:
+    push byte 0
+    push dword 0xFD
+    pusha
+    mov eax, ds
+    push eax
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov eax, [lapic_eoi]     ; Only sent once the local APIC is up
+    mov dword [eax], 0
+
+    push esp                 ; interrupt_frame_t *smp_reschedule_interrupt(frame)
+    call smp_reschedule_interrupt
+    mov esp, eax
+    call task_finish_switch
+    jmp interrupt_return
+
+; TLB shootdown IPI: flush, then EOI
+[GLOBAL irq_tlb_flush]
+irq_tlb_flush:
+    pusha
+    call smp_tlb_interrupt
+    mov eax, [lapic_eoi]
+    mov dword [eax], 0
+    popa
+    iret
+
+; Local APIC spurious vector: no EOI
+[GLOBAL irq_spurious]
+irq_spurious:
+    iret
+
+; Targets for bench_irq(): taken with int, acknowledged one way each
+[GLOBAL irq_bench_none]
+irq_bench_none:
+    iret
+
+[GLOBAL irq_bench_pic]
+irq_bench_pic:
+    push eax
+    mov al, 0x20
+    out 0x20, al
+    pop eax
+    iret
+
+[GLOBAL irq_bench_lapic]
+irq_bench_lapic:
+    push eax
+    mov eax, [lapic_eoi]
+    mov dword [eax], 0
+    pop eax
+    iret
+
 
 ; System call hamdler (intx80)
 
@@ -176,25 +269,24 @@ STUB_IRQ 15
 [GLOBAL int_80_wrapper]
 int_80_wrapper:
     cli
+    push byte 0
+    push dword 0x80          ; (push byte would sign-extend it)
     pusha
-    mov edx, ecx
-    mov ecx, ebx
-    mov ebx, eax
-    
-    push edx
-    push ecx
-    push ebx
+    mov eax, ds
     push eax
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
 
+    ; interrupt_frame_t *int_80_handler(frame): number and arguments are
+    ; in frame->eax, ebx, ecx, edx and the result goes back in frame->eax
+    push esp
     call int_80_handler
-
-    add esp, 16
-
-    mov [esp+28], eax
-
-    popa
-    sti
-    iret
+    mov esp, eax             ; A yield may resume another task
+    call task_finish_switch
+    jmp interrupt_return
 
 ; Load IDT function
 [GLOBAL load_idt]
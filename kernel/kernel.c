@@ -5,9 +5,15 @@
 #include "idt.h"
 #include "pic.h"
 #include "timer.h"
+#include "clock.h"
+#include "apic.h"
+#include "smp.h"
 #include "memory.h"
 #include "paging.h"
 #include "pmm.h"
+#include "kmalloc.h"
+#include "vmm.h"
+#include "swap.h"
 #include "task.h"
 #include "tasks_demo.h"
 #include "syscall.h"
@@ -17,10 +23,12 @@
 #include "ata.h"
 #include "block.h"
 #include "tasks_11.h"
+#include "multiboot.h"
+#include "bench.h"
 
 #define INPUT_MAX 128
 
-void kernel_main(void) {
+void kernel_main(uint32_t magic, multiboot_info_t *mbi) {
     vga_clear();
     vga_print("=== OASIS ===\n");
     vga_print("Initializing interrupt system...\n\n");
@@ -32,8 +40,9 @@ void kernel_main(void) {
     pic_init();
 
     vga_print("[*] Initializing timer (100 Hz)...\n");
-    timer_init(100);
+    timer_init(TIMER_HZ);
     pic_enable_irq(0);
+    clock_init();
 
     vga_print("[*] Initializing keyboard...\n");
     keyboard_init();
@@ -48,7 +57,7 @@ void kernel_main(void) {
     vga_print("[*] Initializing memory system...\n");
     
     vga_print("[*] Detecting memory (e820)...\n");
-    memory_init();
+    memory_init(magic, mbi);
     memory_print_map();
 
     uint32_t total_mem = memory_get_total_usable();
@@ -58,11 +67,17 @@ void kernel_main(void) {
     vga_print(buf);
     vga_print("MB\n\n");
 
-    pmm_init(total_mem);
+    pmm_init(&e820_map);
 
     paging_init();
     paging_enable();
 
+    kmalloc_init();
+    vmm_init();
+
+    // Needs paging to map its registers
+    apic_init();
+
     vga_print("\n[+] Memory system initialized\n");
 
     vga_print("\n[*] Initializing task manager...\n");
@@ -73,6 +88,7 @@ void kernel_main(void) {
 
     vga_print("\n[*] Initializing block device layer...\n");
     block_init();
+    swap_init();
 
     vga_print("\n[*] Initializing system calls...\n");
     syscall_init();
@@ -80,14 +96,14 @@ void kernel_main(void) {
     vga_print("[*] Creating tasks...\n");
     vga_print("[DEBUG] About to call task_create with task_idle\n");
 
-    task_create(task_idle);
+    task_t *idle = task_create(task_idle);
+    if (idle) {
+        task_set_priority(idle, TASK_PRIO_IDLE);
+    }
     vga_print("[DEBUG] Returned from first task_create\n");
 
-    task_create(task_worker);
-    vga_print("[DEBUG] Returned from second task_create\n");
-
-    task_create(task_block_test);
-    vga_print("[DEBUG] Returned from block test task_create\n");
+    // The other CPUs each make their own idle task; this one is CPU 0's
+    smp_init();
 
     vga_print("[+] Tasks created and ready\n");
     vga_print("[*] Tasks managed by scheduler (timer-driven)\n");
@@ -113,8 +129,25 @@ void kernel_main(void) {
                 vga_print("  clear     - clear screen\n");
                 vga_print("  uptime    - show system uptime\n");
                 vga_print("  meminfo   - show memory info\n");
+                vga_print("  slabinfo  - show kernel heap caches\n");
+                vga_print("  pftest    - back a reserved region on demand\n");
+                vga_print("  mmaptest  - mmap/munmap/brk and region merging\n");
+                vga_print("  swapinfo  - swap usage and clock statistics\n");
+                vga_print("  swaptest  - evict a region to disk and read it back\n");
+                vga_print("  shrinkers - memory watermarks and reclaimable caches\n");
+                vga_print("  dmatest   - allocate contiguous DMA buffers\n");
+                vga_print("  tlbbench  - time a memory walk with 4MB vs 4KB pages\n");
+                vga_print("  cr3bench  - time address space switches with/without global pages\n");
+                vga_print("  forkbench - time copy-on-write fork+exit\n");
+                vga_print("  ctxbench  - time a context switch between two tasks\n");
+                vga_print("  nohzbench - timer wakeups per second, periodic vs dynamic tick\n");
+                vga_print("  irqbench  - interrupt entry to EOI, 8259 vs LAPIC\n");
+                vga_print("  apicinfo  - interrupt controllers, CPUs and IRQ routing\n");
+                vga_print("  cpuinfo   - CPUs online, their run queues and IPIs\n");
+                vga_print("  smpbench  - CPU-bound workers on 1..N CPUs\n");
                 vga_print("  taskinfo  - show task info\n");
                 vga_print("  runtasks  - execute all tasks\n");
+                vga_print("  sleeptest - many tasks sleeping on the timer wheel\n");
                 vga_print("  iotest    - test I/O subsystem (Day 10)\n");
                 vga_print("  fdinfo    - show file descriptor table\n");
                 vga_print("  pipetest  - test pipe communication\n");
@@ -123,10 +156,12 @@ void kernel_main(void) {
             } else if (strcmp(input, "clear") == 0) {
                 vga_clear();
             } else if (strcmp(input, "uptime") == 0) {
-                uint32_t ticks = timer_get_ticks();
-                uint32_t seconds = ticks / 100;
+                timespec_t now;
+                ktime_to_timespec(ktime_ns(), &now);
+                uint32_t seconds = now.tv_sec;
                 uint32_t minutes = seconds / 60;
                 uint32_t hours = minutes / 60;
+                uint32_t millis = now.tv_nsec / NSEC_PER_MSEC;
                 seconds %= 60;
                 minutes %= 60;
                 
@@ -140,7 +175,42 @@ void kernel_main(void) {
                 vga_print("m ");
                 itoa(seconds, buf, 10);
                 vga_print(buf);
+                vga_print(millis < 10 ? ".00" : millis < 100 ? ".0" : ".");
+                itoa(millis, buf, 10);
+                vga_print(buf);
                 vga_print("s\n");
+            } else if (strcmp(input, "tlbbench") == 0) {
+                bench_tlb();
+            } else if (strcmp(input, "cr3bench") == 0) {
+                bench_cr3();
+            } else if (strcmp(input, "forkbench") == 0) {
+                bench_fork();
+            } else if (strcmp(input, "ctxbench") == 0) {
+                bench_switch();
+            } else if (strcmp(input, "nohzbench") == 0) {
+                bench_nohz();
+            } else if (strcmp(input, "irqbench") == 0) {
+                bench_irq();
+            } else if (strcmp(input, "apicinfo") == 0) {
+                apic_print_info();
+            } else if (strcmp(input, "cpuinfo") == 0) {
+                smp_print_info();
+            } else if (strcmp(input, "smpbench") == 0) {
+                bench_smp();
+            } else if (strcmp(input, "pftest") == 0) {
+                vmm_fault_demo();
+            } else if (strcmp(input, "mmaptest") == 0) {
+                vmm_mmap_demo();
+            } else if (strcmp(input, "swapinfo") == 0) {
+                swap_print_info();
+            } else if (strcmp(input, "swaptest") == 0) {
+                swap_demo();
+            } else if (strcmp(input, "shrinkers") == 0) {
+                pmm_print_shrinkers();
+            } else if (strcmp(input, "dmatest") == 0) {
+                pmm_contig_demo();
+            } else if (strcmp(input, "slabinfo") == 0) {
+                kmem_print_info();
             } else if (strcmp(input, "meminfo") == 0) {
                 char buf[16];
                 vga_print("Physical Memory Info:\n");
@@ -150,52 +220,116 @@ void kernel_main(void) {
                 vga_print(" (");
                 itoa(pmm_get_free_pages() * 4, buf, 10);
                 vga_print(buf);
-                vga_print(" KB)\n");
+                vga_print(" KB; ");
+                utoa(pmm_zone_free_pages(PMM_ZONE_DMA), buf, 10);
+                vga_print(buf);
+                vga_print(" below 16MB)\n");
                 
                 vga_print("  Total usable: ");
                 itoa(memory_get_total_usable() / 1024 / 1024, buf, 10);
                 vga_print(buf);
                 vga_print(" MB\n");
+
+                pmm_stats_t stats;
+                pmm_get_stats(&stats);
+                vga_print("  Allocations: ");
+                itoa(stats.allocs, buf, 10);
+                vga_print(buf);
+                vga_print(" (");
+                itoa(stats.failures, buf, 10);
+                vga_print(buf);
+                vga_print(" failed)\n");
+                vga_print("  Search steps: ");
+                itoa(stats.search_steps, buf, 10);
+                vga_print(buf);
+                vga_print(" (");
+                itoa(stats.allocs ? stats.search_steps / stats.allocs : 0, buf, 10);
+                vga_print(buf);
+                vga_print(" per alloc)\n");
+                vga_print("  Compactions: ");
+                utoa(stats.compactions, buf, 10);
+                vga_print(buf);
+                vga_print(" (");
+                utoa(stats.compact_success, buf, 10);
+                vga_print(buf);
+                vga_print(" succeeded, ");
+                utoa(stats.pages_migrated, buf, 10);
+                vga_print(buf);
+                vga_print(" pages moved)\n");
+                vga_print("  Init time: ");
+                utoa(stats.init_cycles, buf, 10);
+                vga_print(buf);
+                vga_print(" cycles\n");
+                vga_print("  Zeroed pool: ");
+                itoa(pmm_zero_pool_count(), buf, 10);
+                vga_print(buf);
+                vga_print("/");
+                itoa(PMM_ZERO_POOL_SIZE, buf, 10);
+                vga_print(buf);
+                vga_print(" pages, ");
+                itoa(stats.zero_hits, buf, 10);
+                vga_print(buf);
+                vga_print(" hits, ");
+                itoa(stats.zero_misses, buf, 10);
+                vga_print(buf);
+                vga_print(" misses\n");
+                vga_print("  Page tables: ");
+                itoa(paging_get_table_count(), buf, 10);
+                vga_print(buf);
+                vga_print(" allocated\n");
+                vga_print("  CR3 loads: ");
+                utoa(paging_get_cr3_loads(), buf, 10);
+                vga_print(buf);
+                vga_print(paging_global_pages() ? " (kernel pages global)\n" : "\n");
+                uint32_t page_flushes, full_flushes;
+                paging_get_tlb_stats(&page_flushes, &full_flushes);
+                vmm_stats_t vstats;
+                vmm_get_stats(&vstats);
+                vga_print("  Page faults: ");
+                utoa(vstats.minor_faults, buf, 10);
+                vga_print(buf);
+                vga_print(" minor, ");
+                utoa(vstats.major_faults, buf, 10);
+                vga_print(buf);
+                vga_print(" major, ");
+                utoa(vstats.bad_faults, buf, 10);
+                vga_print(buf);
+                vga_print(" unresolved\n");
+                vga_print("  Zero-page maps: ");
+                utoa(vstats.zero_maps, buf, 10);
+                vga_print(buf);
+                vga_print(", COW copies: ");
+                utoa(vstats.cow_copies, buf, 10);
+                vga_print(buf);
+                vga_print("\n");
+                vga_print("  TLB flushes: ");
+                utoa(page_flushes, buf, 10);
+                vga_print(buf);
+                vga_print(" single-page, ");
+                utoa(full_flushes, buf, 10);
+                vga_print(buf);
+                vga_print(" full\n");
             } else if (strcmp(input, "taskinfo") == 0) {
                 task_print_info();
             } else if (strcmp(input, "runtasks") == 0) {
                 vga_print("\n[*] Executing tasks...\n");
-                
-                task_t *task1 = get_task_ptr(0);
-                if (task1 && task1->id != 0) {
-                    vga_print("[*] Running Task ");
-                    char buf[16];
-                    itoa(task1->id, buf, 10);
-                    vga_print(buf);
-                    vga_print(":\n");
-                    
-                    void (*entry_func)(void) = (void (*)(void))task1->context.eip;
-                    entry_func();
-                    
-                    vga_print("\n[+] Task ");
-                    itoa(task1->id, buf, 10);
-                    vga_print(buf);
-                    vga_print(" completed\n\n");
-                }
-                
-                task_t *task2 = get_task_ptr(1);
-                if (task2 && task2->id != 0) {
-                    vga_print("[*] Running Task ");
-                    char buf[16];
-                    itoa(task2->id, buf, 10);
-                    vga_print(buf);
-                    vga_print(":\n");
-                    
-                    void (*entry_func)(void) = (void (*)(void))task2->context.eip;
-                    entry_func();
-                    
-                    vga_print("\n[+] Task ");
-                    itoa(task2->id, buf, 10);
-                    vga_print(buf);
-                    vga_print(" completed\n\n");
+
+                // The demo tasks run alongside the shell under the
+                // scheduler; wait here until both have exited
+                task_t *worker = task_create(task_worker);
+                task_t *block_test = task_create(task_block_test);
+                uint32_t ids[2] = { worker ? worker->id : 0, block_test ? block_test->id : 0 };
+
+                for (int i = 0; i < 2; i++) {
+                    task_t *task;
+                    while (ids[i] && (task = task_find(ids[i])) && task->state != TASK_DEAD) {
+                        task_yield();
+                    }
                 }
                 
                 vga_print("[+] All tasks completed\n");
+            } else if (strcmp(input, "sleeptest") == 0) {
+                task_sleep_demo();
             } else if (strcmp(input, "iotest") == 0) {
                 vga_print("\n[*] Running I/O Subsystem Tests (Day 10)...\n");
                 task_io_full_test();
@@ -296,12 +430,16 @@ disktest_done:
                 vga_print("  Block size: 512 bytes\n");
                 vga_print("  Cache size: ");
                 char buf[16];
-                itoa(BLOCK_CACHE_SIZE, buf, 10);
+                int cache_entries = block_get_cache_entries();
+                itoa(cache_entries, buf, 10);
                 vga_print(buf);
                 vga_print(" entries (");
-                itoa(BLOCK_CACHE_SIZE * 512 / 1024, buf, 10);
+                itoa(cache_entries * 512 / 1024, buf, 10);
                 vga_print(buf);
-                vga_print(" KB)\n");
+                vga_print(" KB, grows to ");
+                itoa(BLOCK_CACHE_MAX, buf, 10);
+                vga_print(buf);
+                vga_print(")\n");
                 
                 vga_print("Cache Statistics:\n");
                 int valid_entries = block_get_cache_valid_count();
@@ -311,7 +449,7 @@ disktest_done:
                 itoa(valid_entries, buf, 10);
                 vga_print(buf);
                 vga_print("/");
-                itoa(BLOCK_CACHE_SIZE, buf, 10);
+                itoa(cache_entries, buf, 10);
                 vga_print(buf);
                 vga_print("\n");
                 
@@ -321,11 +459,6 @@ disktest_done:
                 vga_print(" (need flushing)\n");
                 
                 vga_print("I/O Queue Status:\n");
-                vga_print("  Queue size: ");
-                itoa(IO_QUEUE_SIZE, buf, 10);
-                vga_print(buf);
-                vga_print(" slots\n");
-                
                 vga_print("  Pending requests: ");
                 itoa(block_get_queue_pending_count(), buf, 10);
                 vga_print(buf);
@@ -1,7 +1,9 @@
 #include "keyboard.h"
 #include "io.h"
 #include "vga.h"
+#include "wait.h"
 #include <stdint.h>
+#include <stddef.h>
 
 #define KEYBOARD_DATA 0x60
 #define KEYBOARD_BUFFER_SIZE 256
@@ -16,6 +18,7 @@ static const char keymap[128] = {
 static char keyboard_buffer[KEYBOARD_BUFFER_SIZE];
 static int read_pos = 0;
 static int write_pos = 0;
+static wait_queue_t readers = WAIT_QUEUE_INIT;  // In keyboard_getchar()
 
 void keyboard_init(void) {
 }
@@ -30,16 +33,18 @@ void keyboard_interrupt_handler(void) {
     char c = keymap[scancode];
     
     if (c != 0) {
+        uint32_t flags = irq_save();
         keyboard_buffer[write_pos] = c;
         write_pos = (write_pos + 1) % KEYBOARD_BUFFER_SIZE;
         
+        wait_wake_all(&readers);
+        irq_restore(flags);
     }
 }
 
 char keyboard_getchar(void) {
-    while (read_pos == write_pos) {
-        asm("hlt");  
-    }
+    // Sleep until the interrupt handler has a key for us
+    wait_event(readers, read_pos != write_pos);
 
     char c = keyboard_buffer[read_pos];
     read_pos = (read_pos + 1) % KEYBOARD_BUFFER_SIZE;
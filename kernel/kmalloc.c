@@ -0,0 +1,382 @@
+/*
+ * Kernel heap: slab caches and kmalloc()
+ *
+ * Slab pages come from the PMM below DIRECT_MAP_SIZE so they are always
+ * reachable through the kernel's direct map. Each slab page starts with a
+ * kmem_slab_t header, which is how kfree() finds the owning cache. The
+ * first object is shifted by a per-slab colour offset so equal objects in
+ * different slabs don't all compete for the same cache lines.
+ */
+
+#include "kmalloc.h"
+#include "pmm.h"
+#include "paging.h"
+#include "string.h"
+#include "vga.h"
+#include "cpu.h"
+#include <stddef.h>
+
+#define SLAB_MAGIC          0x51AB51AB
+#define LARGE_MAGIC         0x1A26E000
+#define KMEM_COLOUR_ALIGN   32      /* Colours are spaced one cache line apart */
+#define KMEM_MAX_EMPTY      4       /* Empty slabs a cache keeps while memory is plentiful */
+#define KMALLOC_CLASSES     8       /* 8, 16, ..., 1024 */
+
+struct kmem_slab {
+    uint32_t magic;
+    kmem_cache_t *cache;
+    kmem_slab_t *next;
+    kmem_slab_t *prev;
+    void *free;                 /* First free object; each one links to the next */
+    uint32_t inuse;
+};
+
+/* Header in front of allocations too big for a size class */
+typedef struct {
+    uint32_t magic;
+    uint32_t order;
+    uint32_t reserved[2];       /* Keeps the returned pointer 16-byte aligned */
+} kmalloc_large_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(kmem_slab_t) + 15) & ~15u)
+
+/* The cache that kmem_cache_t objects themselves come from */
+static kmem_cache_t cache_cache;
+static kmem_cache_t *cache_list = NULL;
+static kmem_cache_t *size_caches[KMALLOC_CLASSES];
+
+/* ====== Helper Functions ====== */
+
+static uint32_t first_object_offset(kmem_cache_t *cache) {
+    return (SLAB_HEADER_SIZE + cache->align - 1) & ~(cache->align - 1);
+}
+
+static uint32_t colour_step(kmem_cache_t *cache) {
+    return cache->align > KMEM_COLOUR_ALIGN ? cache->align : KMEM_COLOUR_ALIGN;
+}
+
+static kmem_slab_t **slab_list(kmem_cache_t *cache, kmem_slab_t *slab) {
+    if (slab->inuse == 0) return &cache->empty;
+    if (slab->inuse == cache->objs_per_slab) return &cache->full;
+    return &cache->partial;
+}
+
+static void slab_list_push(kmem_slab_t **head, kmem_slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(kmem_slab_t **head, kmem_slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static int kmem_cache_setup(kmem_cache_t *cache, const char *name, uint32_t size, uint32_t align) {
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (align & (align - 1)) return -1;     /* Must be a power of two */
+    if (size < sizeof(void *)) size = sizeof(void *);
+
+    int i = 0;
+    for (; name[i] && i < KMEM_NAME_MAX - 1; i++) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = 0;
+
+    cache->align = align;
+    cache->size = (size + align - 1) & ~(align - 1);
+
+    uint32_t offset = first_object_offset(cache);
+    if (offset + cache->size > PAGE_SIZE) return -1;
+
+    cache->objs_per_slab = (PAGE_SIZE - offset) / cache->size;
+    uint32_t leftover = PAGE_SIZE - offset - cache->objs_per_slab * cache->size;
+    cache->colours = leftover / colour_step(cache) + 1;
+    cache->colour_next = 0;
+
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->slabs = 0;
+    cache->empty_slabs = 0;
+    cache->active_objs = 0;
+
+    cache->next = cache_list;
+    cache_list = cache;
+    return 0;
+}
+
+/* Add one empty slab to the cache */
+static kmem_slab_t *kmem_cache_grow(kmem_cache_t *cache) {
+    uint32_t phys = pmm_alloc_pages_below(0, DIRECT_MAP_SIZE);
+    if (!phys) return NULL;
+
+    kmem_slab_t *slab = (kmem_slab_t *)phys_to_virt(phys);
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->inuse = 0;
+
+    uint8_t *first = (uint8_t *)slab + first_object_offset(cache) +
+                     cache->colour_next * colour_step(cache);
+    cache->colour_next = (cache->colour_next + 1) % cache->colours;
+
+    /* Thread the free list through the objects, lowest address first */
+    slab->free = NULL;
+    for (uint32_t i = cache->objs_per_slab; i > 0; i--) {
+        void *obj = first + (i - 1) * cache->size;
+        *(void **)obj = slab->free;
+        slab->free = obj;
+    }
+
+    slab_list_push(&cache->empty, slab);
+    cache->slabs++;
+    cache->empty_slabs++;
+    return slab;
+}
+
+/* ====== Object Caches ====== */
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align) {
+    kmem_cache_t *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache) return NULL;
+
+    if (kmem_cache_setup(cache, name, size, align) != 0) {
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    if (!cache) return NULL;
+
+    uint32_t flags = irq_save();
+
+    /* Fill partial slabs first so empty ones can be given back */
+    kmem_slab_t *slab = cache->partial ? cache->partial : cache->empty;
+    if (!slab) {
+        slab = kmem_cache_grow(cache);
+        if (!slab) {
+            irq_restore(flags);
+            return NULL;
+        }
+    }
+
+    slab_list_remove(slab_list(cache, slab), slab);
+    if (slab->inuse == 0) {
+        cache->empty_slabs--;
+    }
+
+    void *obj = slab->free;
+    slab->free = *(void **)obj;
+    slab->inuse++;
+    cache->active_objs++;
+
+    slab_list_push(slab_list(cache, slab), slab);
+
+    irq_restore(flags);
+    return obj;
+}
+
+void *kmem_cache_zalloc(kmem_cache_t *cache) {
+    void *obj = kmem_cache_alloc(cache);
+    if (obj) {
+        memset(obj, 0, cache->size);
+    }
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj) return;
+
+    kmem_slab_t *slab = (kmem_slab_t *)((uint32_t)obj & PAGE_MASK);
+    if (slab->magic != SLAB_MAGIC || (cache && slab->cache != cache)) {
+        vga_print("WARNING: kmem_cache_free of a foreign object\n");
+        return;
+    }
+    cache = slab->cache;
+
+    uint32_t flags = irq_save();
+
+    slab_list_remove(slab_list(cache, slab), slab);
+
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->active_objs--;
+
+    if (slab->inuse == 0) {
+        uint32_t keep = pmm_under_pressure() ? 0 : KMEM_MAX_EMPTY;
+        if (cache->empty_slabs >= keep) {
+            /* Enough spare slabs already, give the page back */
+            slab->magic = 0;
+            cache->slabs--;
+            pmm_free_page(direct_virt_to_phys(slab));
+            irq_restore(flags);
+            return;
+        }
+        cache->empty_slabs++;
+    }
+
+    slab_list_push(slab_list(cache, slab), slab);
+
+    irq_restore(flags);
+}
+
+/* ====== Reclaim ====== */
+
+static uint32_t kmem_shrink_count(void) {
+    uint32_t count = 0;
+    for (kmem_cache_t *cache = cache_list; cache; cache = cache->next) {
+        count += cache->empty_slabs;
+    }
+    return count;
+}
+
+/* Hand back the spare empty slabs of every cache */
+static uint32_t kmem_shrink(uint32_t target) {
+    uint32_t freed = 0;
+    uint32_t flags = irq_save();
+
+    for (kmem_cache_t *cache = cache_list; cache && freed < target; cache = cache->next) {
+        while (cache->empty && freed < target) {
+            kmem_slab_t *slab = cache->empty;
+            slab_list_remove(&cache->empty, slab);
+            slab->magic = 0;
+            cache->slabs--;
+            cache->empty_slabs--;
+            pmm_free_page(direct_virt_to_phys(slab));
+            freed++;
+        }
+    }
+
+    irq_restore(flags);
+    return freed;
+}
+
+static shrinker_t kmem_shrinker = {
+    .name = "slab",
+    .cost = SHRINK_COST_FREE,
+    .count = kmem_shrink_count,
+    .scan = kmem_shrink,
+};
+
+/* ====== kmalloc ====== */
+
+void kmalloc_init(void) {
+    vga_print("[*] Initializing kernel heap...\n");
+
+    kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0);
+
+    uint32_t size = KMALLOC_MIN_SIZE;
+    for (int i = 0; i < KMALLOC_CLASSES; i++, size <<= 1) {
+        char name[KMEM_NAME_MAX] = "kmalloc-";
+        utoa(size, name + 8, 10);
+        size_caches[i] = kmem_cache_create(name, size, 0);
+    }
+    pmm_register_shrinker(&kmem_shrinker);
+
+    vga_print("[+] Kernel heap ready: size classes 8-");
+    char buf[16];
+    itoa(KMALLOC_MAX_SIZE, buf, 10);
+    vga_print(buf);
+    vga_print(" bytes\n");
+}
+
+void *kmalloc(uint32_t size) {
+    if (size == 0) return NULL;
+
+    if (size <= KMALLOC_MAX_SIZE) {
+        int index = 0;
+        uint32_t class_size = KMALLOC_MIN_SIZE;
+        while (class_size < size) {
+            class_size <<= 1;
+            index++;
+        }
+        return kmem_cache_alloc(size_caches[index]);
+    }
+
+    /* Too big for a size class: whole pages with a small header */
+    uint32_t order = 0;
+    while (((uint32_t)PAGE_SIZE << order) < size + sizeof(kmalloc_large_t)) {
+        order++;
+    }
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    uint32_t phys = pmm_alloc_pages_below(order, DIRECT_MAP_SIZE);
+    if (!phys) return NULL;
+
+    kmalloc_large_t *header = (kmalloc_large_t *)phys_to_virt(phys);
+    header->magic = LARGE_MAGIC;
+    header->order = order;
+    return header + 1;
+}
+
+void *kzalloc(uint32_t size) {
+    void *ptr = kmalloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) return;
+
+    uint32_t page = (uint32_t)ptr & PAGE_MASK;
+
+    if (((kmem_slab_t *)page)->magic == SLAB_MAGIC) {
+        kmem_cache_free(NULL, ptr);
+        return;
+    }
+
+    kmalloc_large_t *header = (kmalloc_large_t *)page;
+    if (header->magic == LARGE_MAGIC && (void *)(header + 1) == ptr) {
+        header->magic = 0;
+        pmm_free_pages(direct_virt_to_phys(header), header->order);
+        return;
+    }
+
+    vga_print("WARNING: kfree of an unknown pointer\n");
+}
+
+/* ====== Debug ====== */
+
+void kmem_print_info(void) {
+    vga_print("Slab caches:\n");
+    vga_print("  name             objsize  active/total  slabs\n");
+
+    char buf[16];
+    for (kmem_cache_t *cache = cache_list; cache; cache = cache->next) {
+        vga_print("  ");
+        vga_print(cache->name);
+        int len = 0;
+        while (cache->name[len]) len++;
+        for (int i = len; i < 17; i++) {
+            vga_putc(' ');
+        }
+        itoa(cache->size, buf, 10);
+        vga_print(buf);
+        vga_print("  ");
+        itoa(cache->active_objs, buf, 10);
+        vga_print(buf);
+        vga_print("/");
+        itoa(cache->slabs * cache->objs_per_slab, buf, 10);
+        vga_print(buf);
+        vga_print("  ");
+        itoa(cache->slabs, buf, 10);
+        vga_print(buf);
+        vga_print("\n");
+    }
+}
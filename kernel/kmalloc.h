@@ -0,0 +1,54 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include <stdint.h>
+
+/*
+ * Kernel heap
+ *
+ * Small objects come from slab caches: each slab is one page holding a
+ * header followed by equal-sized objects. kmalloc() uses a cache per
+ * power-of-two size class (8..1024 bytes) and whole pages above that.
+ * Subsystems with many objects of one type create a named cache with
+ * kmem_cache_create() so the objects are packed tightly.
+ */
+
+#define KMALLOC_MIN_SIZE   8
+#define KMALLOC_MAX_SIZE   1024     /* Largest size class served by a slab */
+#define KMEM_NAME_MAX      16
+
+typedef struct kmem_slab kmem_slab_t;
+
+typedef struct kmem_cache {
+    char name[KMEM_NAME_MAX];
+    uint32_t size;              /* Object size, rounded up to the alignment */
+    uint32_t align;
+    uint32_t objs_per_slab;
+    uint32_t colours;           /* Distinct first-object offsets per slab */
+    uint32_t colour_next;       /* Offset (in colour units) for the next slab */
+    kmem_slab_t *partial;       /* Slabs with free and used objects */
+    kmem_slab_t *full;          /* Slabs with no free objects */
+    kmem_slab_t *empty;         /* Slabs with no used objects */
+    uint32_t slabs;
+    uint32_t empty_slabs;
+    uint32_t active_objs;
+    struct kmem_cache *next;    /* All caches, for kmem_print_info() */
+} kmem_cache_t;
+
+/* Set up the size-class caches; needs paging (the direct map) */
+void kmalloc_init(void);
+
+void *kmalloc(uint32_t size);
+void *kzalloc(uint32_t size);
+void kfree(void *ptr);
+
+/* Named object caches */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Debug: print every cache */
+void kmem_print_info(void);
+
+#endif /* KMALLOC_H */
@@ -4,22 +4,54 @@
 
 e820_map_t e820_map = {0};
 
-void memory_init(void) {
-    e820_map.count = 2;
+static void memory_add_entry(uint64_t base, uint64_t length, uint32_t type) {
+    if (e820_map.count >= E820_MAX_ENTRIES) return;
+    if (length == 0 || base >= MEMORY_LIMIT) return;
 
-    e820_map.entries[0].base   = 0x00000000;
-    e820_map.entries[0].length = 0x00100000;
-    e820_map.entries[0].type   = E820_RESERVED;
+    // Only the 32-bit physical address space is usable without PAE
+    if (base + length > MEMORY_LIMIT) {
+        length = MEMORY_LIMIT - base;
+    }
+
+    e820_entry_t *entry = &e820_map.entries[e820_map.count++];
+    entry->base = base;
+    entry->length = length;
+    entry->type = type;
+    entry->acpi_attr = 0;
+}
+
+void memory_init(uint32_t magic, multiboot_info_t *mbi) {
+    e820_map.count = 0;
+
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+        // Walk the bootloader's copy of the BIOS memory map
+        uint32_t addr = mbi->mmap_addr;
+        uint32_t end = mbi->mmap_addr + mbi->mmap_length;
+        while (addr < end) {
+            multiboot_mmap_entry_t *mmap = (multiboot_mmap_entry_t *)addr;
+            memory_add_entry(mmap->base, mmap->length, mmap->type);
+            addr += mmap->size + sizeof(mmap->size);
+        }
+        return;
+    }
 
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && mbi && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+        // No map, but we know how much contiguous memory there is above 1MB
+        vga_print("WARNING: No multiboot memory map, using mem_upper\n");
+        memory_add_entry(0x00000000, 0x00100000, E820_RESERVED);
+        memory_add_entry(0x00100000, (uint64_t)mbi->mem_upper * 1024, E820_USABLE);
+        return;
+    }
 
-    e820_map.entries[1].base   = 0x00100000;
-    e820_map.entries[1].length = 0x07F00000; 
-    e820_map.entries[1].type   = E820_USABLE;
+    // Not booted by a multiboot loader: assume the classic 128MB layout
+    vga_print("WARNING: No multiboot memory info, assuming 128MB\n");
+    memory_add_entry(0x00000000, 0x00100000, E820_RESERVED);
+    memory_add_entry(0x00100000, 0x07F00000, E820_USABLE);
 }
 
 uint32_t memory_get_total_usable(void) {
     uint32_t total = 0;
-    for (int i = 0; i < e820_map.count; i++) {
+    for (uint32_t i = 0; i < e820_map.count; i++) {
         if (e820_map.entries[i].type == E820_USABLE) {
             total += e820_map.entries[i].length;
         }
@@ -29,21 +61,19 @@ uint32_t memory_get_total_usable(void) {
 
 void memory_print_map(void) {
     vga_print("Memory Map (e820):\n");
-    for(int i=0; i<e820_map.count; i++) {
+    for (uint32_t i = 0; i < e820_map.count; i++) {
         e820_entry_t *entry = &e820_map.entries[i];
-        
+
         vga_print(" [");
         char buf[16];
         itoa(i, buf, 10);
         vga_print(buf);
         vga_print("] base: 0x");
-        itoa((uint32_t)entry->base, buf, 16);
+        utoa((uint32_t)entry->base, buf, 16);
         vga_print(buf);
 
         vga_print(" Length: 0x");
-        itoa((uint32_t)entry->base, buf, 16);
-        vga_print(buf);
-        itoa((uint32_t)entry->length, buf, 16);
+        utoa((uint32_t)entry->length, buf, 16);
         vga_print(buf);
 
         vga_print(" Type: ");
@@ -2,6 +2,7 @@
 #define MEMORY_H
 
 #include <stdint.h>
+#include "multiboot.h"
 
 #define E820_MAX_ENTRIES 20
 #define E820_USABLE 1
@@ -9,6 +10,9 @@
 #define E820_ACPI 3
 #define E820_BAD 4
 
+// Highest physical address we can use without PAE
+#define MEMORY_LIMIT 0x100000000ULL
+
 typedef struct {
     uint64_t base;
     uint64_t length;
@@ -23,7 +27,7 @@ typedef struct {
 
 extern e820_map_t e820_map;
 
-void memory_init(void);
+void memory_init(uint32_t magic, multiboot_info_t *mbi);
 uint32_t memory_get_total_usable(void);
 void memory_print_map(void);
 
@@ -0,0 +1,35 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+/* Value the bootloader leaves in EAX when it jumps to _start */
+#define MULTIBOOT_BOOTLOADER_MAGIC  0x2BADB002
+
+/* multiboot_info_t.flags: which fields are valid */
+#define MULTIBOOT_INFO_MEMORY       0x00000001  /* mem_lower / mem_upper */
+#define MULTIBOOT_INFO_MEM_MAP      0x00000040  /* mmap_length / mmap_addr */
+
+/* Boot information structure (EBX at _start) */
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;         /* KB of memory below 1MB */
+    uint32_t mem_upper;         /* KB of memory above 1MB, up to the first hole */
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;       /* Size of the memory map buffer in bytes */
+    uint32_t mmap_addr;         /* Physical address of the first entry */
+} __attribute__((packed)) multiboot_info_t;
+
+/* Memory map entry; `size` does not include the size field itself */
+typedef struct {
+    uint32_t size;
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;              /* Same encoding as E820 (1 = usable) */
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+#endif
@@ -1,16 +1,73 @@
 #include "paging.h"
 #include "vga.h"
 #include "string.h"
+#include "cpu.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "swap.h"
+#include "smp.h"
+#include <stddef.h>
 
 // Kernel page directory (must be 4KB aligned, at 0x1000)
 __attribute__((aligned(0x1000)))
 pde_t kernel_page_dir[PAGE_DIR_SIZE];
 
-// Kernel page tables (1 table per 4MB of virtual space)
+// Boot page tables: identity map, direct map and the temp window.
+// Everything else gets its page table from the PMM on demand.
+#define BOOT_PAGE_TABLES 6
+
 __attribute__((aligned(0x1000)))
-static pte_t kernel_page_tables[10][PAGE_TABLE_SIZE];
+static pte_t kernel_page_tables[BOOT_PAGE_TABLES][PAGE_TABLE_SIZE];
+
+// Present entries per kernel page table, so empty ones can be given
+// back. Boot tables are pinned and never freed. User page tables are
+// counted in their address space instead.
+#define PAGE_TABLE_PINNED 0xFFFF
+static uint16_t page_table_used[PAGE_DIR_SIZE];
+static uint32_t page_tables_allocated = 0;
+
+static int paging_enabled = 0;
+static int use_large_pages = 0;
+static int use_global_pages = 0;
+
+// The boot directory is the kernel's own address space. Every other
+// space copies its kernel PDEs and is kept on a list so new kernel page
+// tables can be added to all of them.
+static address_space_t kernel_space;
+
+// Each CPU has its own CR3, so which space is current is per CPU too
+#define current_space (this_cpu()->space)
+static uint32_t cr3_loads = 0;
+
+static uint32_t tlb_page_flushes = 0;
+static uint32_t tlb_full_flushes = 0;
+
+// PDE 0 (identity map) and everything from 0xC0000000 up is shared
+static int is_kernel_pde(uint32_t dir_index) {
+    return dir_index == 0 || dir_index >= KERNEL_PDE_FIRST;
+}
+
+static uint16_t *table_used(uint32_t dir_index) {
+    if (is_kernel_pde(dir_index)) {
+        return &page_table_used[dir_index];
+    }
+    return &current_space->table_used[dir_index];
+}
+
+static void load_cr3(uint32_t dir_phys) {
+    asm volatile("mov %0, %%cr3" : : "r"(dir_phys) : "memory");
+    cr3_loads++;
+}
 
-static int page_table_index = 0;
+// Write a kernel PDE into every address space
+static void set_kernel_pde(uint32_t dir_index, pde_t pde) {
+    for (address_space_t *as = &kernel_space; as; as = as->next) {
+        as->dir[dir_index] = pde;
+    }
+}
+
+// Page table backing the temporary mapping window
+static pte_t *temp_page_table;
 
 void paging_init(void) {
     vga_print("[*] Initializing paging...\n");
@@ -18,25 +75,67 @@ void paging_init(void) {
     // Clear page directory
     for (int i = 0; i < PAGE_DIR_SIZE; i++) {
         kernel_page_dir[i] = 0;
+        page_table_used[i] = 0;
     }
     
+    // With PSE the identity map and direct map are plain 4MB PDEs: one
+    // TLB entry per 4MB instead of 1024. Otherwise build 4KB tables.
+    uint32_t features = cpu_features_edx();
+    use_large_pages = (features & CPUID_FEAT_EDX_PSE) != 0;
+
+    // Global kernel pages survive CR3 reloads on a task switch
+    use_global_pages = (features & CPUID_FEAT_EDX_PGE) != 0;
+    uint32_t global = use_global_pages ? PTE_GLOBAL : 0;
+
     // Identity map first 4MB (kernel code is here)
-    pte_t *pt = kernel_page_tables[0];
-    for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
-        pt[i] = (i * PAGE_SIZE) | PTE_PRESENT | PTE_WRITE;
+    pte_t *pt;
+    if (use_large_pages) {
+        kernel_page_dir[0] = 0 | PDE_LARGE | PTE_PRESENT | PTE_WRITE | global;
+    } else {
+        pt = kernel_page_tables[0];
+        for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
+            pt[i] = (i * PAGE_SIZE) | PTE_PRESENT | PTE_WRITE | global;
+        }
+        kernel_page_dir[0] = ((uint32_t)pt) | PTE_PRESENT | PTE_WRITE;
     }
-    kernel_page_dir[0] = ((uint32_t)pt) | PTE_PRESENT | PTE_WRITE;
+    page_table_used[0] = PAGE_TABLE_PINNED;
     
-    // Map kernel at 0xC0000000 (higher-half kernel)
-    // This allows kernel code to use high addresses
-    for (int i = 0; i < 4; i++) {
-        pt = kernel_page_tables[i + 1];
-        for (int j = 0; j < PAGE_TABLE_SIZE; j++) {
-            pt[j] = ((i * PAGE_SIZE * PAGE_TABLE_SIZE) + (j * PAGE_SIZE)) | 
-                    PTE_PRESENT | PTE_WRITE;
+    // Map physical 0-16MB at 0xC0000000 (higher-half kernel)
+    // This allows kernel code to use high addresses, and is where kmalloc
+    // memory is addressed from
+    for (int i = 0; i < DIRECT_MAP_SIZE / LARGE_PAGE_SIZE; i++) {
+        uint32_t dir_index = (KERNEL_VIRT_BASE >> 22) + i;
+        if (use_large_pages) {
+            kernel_page_dir[dir_index] = (i * LARGE_PAGE_SIZE) | PDE_LARGE | PTE_PRESENT | PTE_WRITE | global;
+        } else {
+            pt = kernel_page_tables[i + 1];
+            for (int j = 0; j < PAGE_TABLE_SIZE; j++) {
+                pt[j] = ((i * LARGE_PAGE_SIZE) + (j * PAGE_SIZE)) |
+                        PTE_PRESENT | PTE_WRITE | global;
+            }
+            kernel_page_dir[dir_index] = ((uint32_t)pt) | PTE_PRESENT | PTE_WRITE;
         }
-        kernel_page_dir[0xC00 + i] = ((uint32_t)pt) | PTE_PRESENT | PTE_WRITE;
+        page_table_used[dir_index] = PAGE_TABLE_PINNED;
+    }
+
+    // Temporary window for touching pages outside the identity map
+    temp_page_table = kernel_page_tables[5];
+    for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
+        temp_page_table[i] = 0;
     }
+    kernel_page_dir[PAGING_TEMP_VIRT >> 22] = ((uint32_t)temp_page_table) | PTE_PRESENT | PTE_WRITE;
+    page_table_used[PAGING_TEMP_VIRT >> 22] = PAGE_TABLE_PINNED;
+
+    // Last directory entry points back at the directory itself, so every
+    // page table shows up at PAGE_TABLES_VIRT wherever it lives physically
+    kernel_page_dir[PAGE_DIR_SIZE - 1] = ((uint32_t)kernel_page_dir) | PTE_PRESENT | PTE_WRITE;
+    page_table_used[PAGE_DIR_SIZE - 1] = PAGE_TABLE_PINNED;
+
+    kernel_space.dir = kernel_page_dir;
+    kernel_space.dir_phys = (uint32_t)kernel_page_dir;
+    kernel_space.next = NULL;
+    current_space = &kernel_space;
+    kernel_space.cpu_mask = 1u << smp_cpu_id();
     
     vga_print("[+] Paging structures initialized\n");
 }
@@ -44,17 +143,148 @@ void paging_init(void) {
 void paging_enable(void) {
     vga_print("[*] Enabling paging...\n");
     
+    // 4MB PDEs are only honoured with CR4.PSE set
+    if (use_large_pages) {
+        write_cr4(read_cr4() | CR4_PSE);
+    }
+
     // Load page directory address into CR3
-    uint32_t pd_addr = (uint32_t)kernel_page_dir;
-    asm volatile("mov %0, %%cr3" : : "r"(pd_addr));
+    load_cr3(kernel_space.dir_phys);
     
     // Enable paging bit in CR0
     uint32_t cr0;
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     cr0 |= 0x80000000;  // PG bit
+    cr0 |= 0x00010000;  // WP bit: read-only pages also bind ring 0 (copy-on-write)
     asm volatile("mov %0, %%cr0" : : "r"(cr0));
+    paging_enabled = 1;
+
+    // PGE may only be set once paging is on
+    if (use_global_pages) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
     
-    vga_print("[+] Paging enabled (CR0.PG = 1)\n");
+    vga_print("[+] Paging enabled (CR0.PG = 1)");
+    vga_print(use_large_pages ? ", kernel mapped with 4MB pages\n" : ", 4KB pages only (no PSE)\n");
+}
+
+int paging_large_pages(void) {
+    return use_large_pages;
+}
+
+int paging_global_pages(void) {
+    return use_global_pages && (read_cr4() & CR4_PGE);
+}
+
+void paging_set_global(int enable) {
+    if (!use_global_pages || !paging_enabled) return;
+
+    // Toggling PGE flushes the whole TLB, global entries included
+    uint32_t cr4 = read_cr4();
+    write_cr4(enable ? (cr4 | CR4_PGE) : (cr4 & ~CR4_PGE));
+}
+
+/* ====== Address Spaces ====== */
+
+address_space_t *paging_space_create(void) {
+    address_space_t *as = kzalloc(sizeof(address_space_t));
+    if (!as) return NULL;
+
+    // Keep directories inside the direct map so any of them can be edited
+    uint32_t dir_phys = pmm_alloc_pages_below(0, DIRECT_MAP_SIZE);
+    if (!dir_phys) {
+        kfree(as);
+        return NULL;
+    }
+    as->dir_phys = dir_phys;
+    as->dir = (pde_t *)phys_to_virt(dir_phys);
+
+    uint32_t flags = irq_save();
+
+    // Share every kernel PDE; the user half starts out empty
+    for (uint32_t i = 0; i < PAGE_DIR_SIZE; i++) {
+        as->dir[i] = is_kernel_pde(i) ? kernel_page_dir[i] : 0;
+    }
+    as->dir[PAGE_DIR_SIZE - 1] = dir_phys | PTE_PRESENT | PTE_WRITE;
+
+    as->next = kernel_space.next;
+    kernel_space.next = as;
+
+    irq_restore(flags);
+    return as;
+}
+
+void paging_space_destroy(address_space_t *as) {
+    if (!as || as == &kernel_space) return;
+
+    uint32_t flags = irq_save();
+
+    if (current_space == as) {
+        paging_switch(&kernel_space);
+    }
+
+    address_space_t *prev = &kernel_space;
+    while (prev->next && prev->next != as) {
+        prev = prev->next;
+    }
+    if (prev->next == as) {
+        prev->next = as->next;
+    }
+
+    // Only the user page tables belong to this space
+    for (uint32_t i = 1; i < KERNEL_PDE_FIRST; i++) {
+        if (as->dir[i] & PTE_PRESENT) {
+            pmm_free_page(as->dir[i] & PAGE_MASK);
+            page_tables_allocated--;
+        }
+    }
+
+    irq_restore(flags);
+
+    pmm_free_page(as->dir_phys);
+    kfree(as);
+}
+
+void paging_switch(address_space_t *as) {
+    if (!as) as = &kernel_space;
+    address_space_t *old = current_space;
+    if (as == old) return;
+
+    // In the new mask before its entries can be cached, out of the old
+    // one only once they can't
+    uint32_t cpu_bit = 1u << smp_cpu_id();
+    __sync_fetch_and_or(&as->cpu_mask, cpu_bit);
+    current_space = as;
+    if (paging_enabled) {
+        load_cr3(as->dir_phys);
+    }
+    __sync_fetch_and_and(&old->cpu_mask, ~cpu_bit);
+}
+
+void paging_cpu_init(void) {
+    current_space = &kernel_space;
+    __sync_fetch_and_or(&kernel_space.cpu_mask, 1u << smp_cpu_id());
+}
+
+address_space_t *paging_current_space(void) {
+    return current_space;
+}
+
+address_space_t *paging_kernel_space(void) {
+    return &kernel_space;
+}
+
+uint32_t paging_get_cr3_loads(void) {
+    return cr3_loads;
+}
+
+// Address of the page table covering dir_index. Before paging is on,
+// tables are reached physically; afterwards through the recursive slot.
+static pte_t *page_table_ptr(uint32_t dir_index) {
+    if (!paging_enabled) {
+        return (pte_t *)(current_space->dir[dir_index] & PAGE_MASK);
+    }
+    return (pte_t *)(PAGE_TABLES_VIRT + dir_index * PAGE_SIZE);
 }
 
 uint32_t virt_to_phys(uint32_t virt) {
@@ -62,12 +292,15 @@ uint32_t virt_to_phys(uint32_t virt) {
     uint32_t table_index = (virt >> 12) & 0x3FF;
     uint32_t offset = virt & 0xFFF;
     
-    pde_t pde = kernel_page_dir[dir_index];
+    pde_t pde = current_space->dir[dir_index];
     if (!(pde & PTE_PRESENT)) {
         return 0;  // Not mapped
     }
+    if (pde & PDE_LARGE) {
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
     
-    pte_t *pt = (pte_t *)(pde & PAGE_MASK);
+    pte_t *pt = page_table_ptr(dir_index);
     pte_t pte = pt[table_index];
     if (!(pte & PTE_PRESENT)) {
         return 0;  // Not mapped
@@ -76,24 +309,410 @@ uint32_t virt_to_phys(uint32_t virt) {
     return (pte & PAGE_MASK) | offset;
 }
 
-void page_map(uint32_t virt, uint32_t phys, uint32_t flags) {
+pte_t paging_get_pte(uint32_t virt) {
+    uint32_t dir_index = virt >> 22;
+    pde_t pde = current_space->dir[dir_index];
+    if (!(pde & PTE_PRESENT) || (pde & PDE_LARGE)) {
+        return 0;
+    }
+    return page_table_ptr(dir_index)[(virt >> 12) & 0x3FF];
+}
+
+void paging_clear_accessed(uint32_t virt) {
+    uint32_t irq_flags = irq_save();
+
+    pte_t *pt = page_table_ptr(virt >> 22);
+    uint32_t table_index = (virt >> 12) & 0x3FF;
+    if (pt[table_index] & PTE_ACCESSED) {
+        pt[table_index] &= ~PTE_ACCESSED;
+        tlb_flush_page(virt);   // Or the CPU won't walk the table to set it again
+    }
+
+    irq_restore(irq_flags);
+}
+
+void paging_write_protect(uint32_t virt) {
+    uint32_t irq_flags = irq_save();
+
+    pte_t *pt = page_table_ptr(virt >> 22);
+    uint32_t table_index = (virt >> 12) & 0x3FF;
+    if (pt[table_index] & PTE_WRITE) {
+        pt[table_index] &= ~PTE_WRITE;
+        tlb_flush_page(virt);
+    }
+
+    irq_restore(irq_flags);
+}
+
+void paging_set_swap_entry(uint32_t virt, pte_t entry) {
+    uint32_t irq_flags = irq_save();
+
+    pte_t *pt = page_table_ptr(virt >> 22);
+    pt[(virt >> 12) & 0x3FF] = (entry & ~PTE_PRESENT) | PTE_SWAPPED;
+    tlb_flush_page(virt);
+
+    irq_restore(irq_flags);
+}
+
+/* ====== TLB Maintenance ====== */
+
+// Other CPUs may have cached what was just flushed here: any of them
+// for kernel addresses, otherwise those with this space loaded
+static void tlb_shootdown(int kernel) {
+    smp_tlb_shootdown(kernel ? smp_online_mask() : current_space->cpu_mask);
+}
+
+void tlb_flush_page(uint32_t virt) {
+    if (!paging_enabled) return;
+    invlpg(virt);
+    tlb_page_flushes++;
+    tlb_shootdown(is_kernel_pde(virt >> 22));
+}
+
+// Drop every cached translation. Reloading CR3 keeps global entries,
+// so kernel ranges need a PGE toggle instead.
+static void tlb_flush_all_entries(int include_global) {
+    if (!paging_enabled) return;
+
+    uint32_t cr4 = read_cr4();
+    if (include_global && (cr4 & CR4_PGE)) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        asm volatile("mov %0, %%cr3" : : "r"(current_space->dir_phys) : "memory");
+    }
+    tlb_full_flushes++;
+}
+
+void tlb_flush_all(void) {
+    tlb_flush_all_entries(1);
+    tlb_shootdown(1);
+}
+
+void tlb_flush_local(void) {
+    tlb_flush_all_entries(1);
+}
+
+void tlb_flush_range(uint32_t virt, uint32_t count) {
+    if (!paging_enabled || count == 0) return;
+
+    uint32_t last = virt + (count - 1) * PAGE_SIZE;
+    int kernel = is_kernel_pde(virt >> 22) || is_kernel_pde(last >> 22);
+    if (count > TLB_FLUSH_THRESHOLD) {
+        // Past this many pages one full flush beats a string of invlpg
+        tlb_flush_all_entries(kernel);
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            invlpg(virt + i * PAGE_SIZE);
+            tlb_page_flushes++;
+        }
+    }
+    // One round of IPIs for the whole range
+    tlb_shootdown(kernel);
+}
+
+/* ====== Mapping ====== */
+
+// Install one PTE, leaving the TLB alone. Returns 1 if a present entry
+// was replaced (so a stale translation may be cached), 0 if the slot was
+// empty, -1 on failure. Caller holds interrupts off.
+static int map_one(uint32_t virt, uint32_t phys, uint32_t flags) {
     uint32_t dir_index = virt >> 22;
     uint32_t table_index = (virt >> 12) & 0x3FF;
+
+    if (dir_index == PAGE_DIR_SIZE - 1) {
+        vga_print("ERROR: page_map into the page table window\n");
+        return -1;
+    }
+
+    // Kernel mappings look the same in every address space
+    int kernel = is_kernel_pde(dir_index);
+    if (kernel && use_global_pages) {
+        flags |= PTE_GLOBAL;
+    }
+
+    pde_t *dir = current_space->dir;
     
-    // Ensure page directory entry exists
-    if (!(kernel_page_dir[dir_index] & PTE_PRESENT)) {
-        if (page_table_index >= 10) {
-            vga_print("ERROR: Out of page tables\n");
-            return;
+    // Ensure page directory entry exists. A not-present PDE is never
+    // cached, so the new table needs no flush.
+    if (!(dir[dir_index] & PTE_PRESENT)) {
+        // Comes back zeroed, so every entry starts out not-present
+        uint32_t pt_phys = pmm_alloc_zeroed_page();
+        if (!pt_phys) {
+            vga_print("ERROR: Out of memory for page table\n");
+            return -1;
         }
-        pte_t *pt = kernel_page_tables[page_table_index++];
-        for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
-            pt[i] = 0;
+        pde_t pde = pt_phys | PTE_PRESENT | PTE_WRITE;
+        if (kernel) {
+            set_kernel_pde(dir_index, pde);
+        } else {
+            dir[dir_index] = pde;
         }
-        kernel_page_dir[dir_index] = ((uint32_t)pt) | PTE_PRESENT | PTE_WRITE;
+        *table_used(dir_index) = 0;
+        page_tables_allocated++;
     }
     
+    if (dir[dir_index] & PDE_LARGE) {
+        vga_print("ERROR: page_map inside a 4MB page\n");
+        return -1;
+    }
+
+    // A user page needs the user bit at both levels
+    if ((flags & PTE_USER) && !(dir[dir_index] & PTE_USER)) {
+        if (kernel) {
+            set_kernel_pde(dir_index, dir[dir_index] | PTE_USER);
+        } else {
+            dir[dir_index] |= PTE_USER;
+        }
+    }
+
     // Get page table and map page
-    pte_t *pt = (pte_t *)(kernel_page_dir[dir_index] & PAGE_MASK);
+    pte_t *pt = page_table_ptr(dir_index);
+    int replaced = (pt[table_index] & PTE_PRESENT) != 0;
+    uint16_t *used = table_used(dir_index);
+    if (pt[table_index] == 0 && *used != PAGE_TABLE_PINNED) {
+        (*used)++;      // A swap entry being replaced was already counted
+    }
     pt[table_index] = (phys & PAGE_MASK) | flags | PTE_PRESENT;
+    return replaced;
+}
+
+// Clear one PTE, leaving the TLB and the page table alone. Returns 1 if
+// something was mapped there (a page or a swap entry, whose slot the
+// caller has already dealt with). Caller holds interrupts off.
+static int unmap_one(uint32_t virt) {
+    uint32_t dir_index = virt >> 22;
+    uint32_t table_index = (virt >> 12) & 0x3FF;
+    pde_t *dir = current_space->dir;
+
+    if (!(dir[dir_index] & PTE_PRESENT) || (dir[dir_index] & PDE_LARGE)) {
+        return 0;
+    }
+
+    pte_t *pt = page_table_ptr(dir_index);
+    if (pt[table_index] == 0) {
+        return 0;
+    }
+    pt[table_index] = 0;
+
+    uint16_t *used = table_used(dir_index);
+    if (*used != PAGE_TABLE_PINNED) {
+        (*used)--;
+    }
+    return 1;
+}
+
+// Give a page table back once its last mapping is gone. Only called
+// after the TLB no longer holds translations through it.
+static void release_table(uint32_t dir_index) {
+    pde_t *dir = current_space->dir;
+    uint16_t *used = table_used(dir_index);
+
+    if (!(dir[dir_index] & PTE_PRESENT) || (dir[dir_index] & PDE_LARGE)) return;
+    if (*used != 0) return;
+
+    uint32_t pt_phys = dir[dir_index] & PAGE_MASK;
+    if (is_kernel_pde(dir_index)) {
+        set_kernel_pde(dir_index, 0);
+    } else {
+        dir[dir_index] = 0;
+    }
+    tlb_flush_page(PAGE_TABLES_VIRT + dir_index * PAGE_SIZE);
+    pmm_free_page(pt_phys);
+    page_tables_allocated--;
+}
+
+int page_map(uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t irq_flags = irq_save();
+
+    int replaced = map_one(virt, phys, flags);
+    if (replaced > 0) {
+        tlb_flush_page(virt);
+    }
+
+    irq_restore(irq_flags);
+    return replaced < 0 ? -1 : 0;
+}
+
+void page_unmap(uint32_t virt) {
+    uint32_t irq_flags = irq_save();
+
+    if (unmap_one(virt)) {
+        tlb_flush_page(virt);
+        release_table(virt >> 22);
+    }
+
+    irq_restore(irq_flags);
+}
+
+int page_map_range(uint32_t virt, uint32_t phys, uint32_t count, uint32_t flags) {
+    uint32_t irq_flags = irq_save();
+    uint32_t replaced = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        int r = map_one(virt + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags);
+        if (r < 0) {
+            irq_restore(irq_flags);
+            page_unmap_range(virt, i);
+            return -1;
+        }
+        replaced += r;
+    }
+
+    // Fresh mappings can't be cached; only replaced ones need a flush
+    if (replaced > 0) {
+        tlb_flush_range(virt, count);
+    }
+
+    irq_restore(irq_flags);
+    return 0;
+}
+
+void page_unmap_range(uint32_t virt, uint32_t count) {
+    if (count == 0) return;
+
+    uint32_t irq_flags = irq_save();
+    uint32_t cleared = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        cleared += unmap_one(virt + i * PAGE_SIZE);
+    }
+
+    if (cleared > 0) {
+        tlb_flush_range(virt, count);
+
+        uint32_t last = virt + (count - 1) * PAGE_SIZE;
+        for (uint32_t dir_index = virt >> 22; dir_index <= (last >> 22); dir_index++) {
+            release_table(dir_index);
+        }
+    }
+
+    irq_restore(irq_flags);
+}
+
+void paging_get_tlb_stats(uint32_t *page_flushes, uint32_t *full_flushes) {
+    *page_flushes = tlb_page_flushes;
+    *full_flushes = tlb_full_flushes;
+}
+
+uint32_t paging_get_table_count(void) {
+    return page_tables_allocated;
+}
+
+// Kernel pointer to any physical page: through the direct map when it is
+// covered, otherwise through a scratch PTE at slot_virt. Interrupts must
+// be off until temp_unmap().
+static void *temp_map(uint32_t slot_virt, uint32_t phys) {
+    if (!paging_enabled) {
+        return (void *)phys;
+    }
+    if (phys < DIRECT_MAP_SIZE) {
+        return phys_to_virt(phys);
+    }
+    temp_page_table[(slot_virt >> 12) & 0x3FF] = phys | PTE_PRESENT | PTE_WRITE;
+    invlpg(slot_virt);
+    return (void *)slot_virt;
+}
+
+static void temp_unmap(uint32_t slot_virt, void *ptr) {
+    if ((uint32_t)ptr != slot_virt) return;
+    temp_page_table[(slot_virt >> 12) & 0x3FF] = 0;
+    invlpg(slot_virt);
+}
+
+void page_zero(uint32_t phys) {
+    phys &= PAGE_MASK;
+
+    uint32_t flags = irq_save();
+    void *page = temp_map(PAGING_TEMP_VIRT, phys);
+    memset32(page, 0, PAGE_SIZE / 4);
+    temp_unmap(PAGING_TEMP_VIRT, page);
+    irq_restore(flags);
+}
+
+void page_copy(uint32_t dst_phys, const void *src) {
+    uint32_t flags = irq_save();
+    void *page = temp_map(PAGING_TEMP_VIRT, dst_phys & PAGE_MASK);
+    memcpy32(page, src, PAGE_SIZE / 4);
+    temp_unmap(PAGING_TEMP_VIRT, page);
+    irq_restore(flags);
+}
+
+int paging_share_range(address_space_t *dst, uint32_t start, uint32_t end, int copy_on_write) {
+    if (start >= end) return 0;
+
+    uint32_t irq_flags = irq_save();
+    pde_t *dir = current_space->dir;
+    int shared = 0;
+    uint32_t protected = 0;
+
+    for (uint32_t dir_index = start >> 22; dir_index <= ((end - 1) >> 22); dir_index++) {
+        if (!(dir[dir_index] & PTE_PRESENT) || (dir[dir_index] & PDE_LARGE)) continue;
+        if (is_kernel_pde(dir_index)) continue;     // Already shared
+
+        uint32_t lo = dir_index << 22;
+        uint32_t hi = lo + LARGE_PAGE_SIZE;
+        if (lo < start) lo = start;
+        if (hi > end || hi == 0) hi = end;
+
+        pte_t *src_pt = page_table_ptr(dir_index);
+        pte_t *dst_pt = NULL;
+
+        for (uint32_t virt = lo; virt < hi; virt += PAGE_SIZE) {
+            uint32_t table_index = (virt >> 12) & 0x3FF;
+            pte_t pte = src_pt[table_index];
+            if (!(pte & (PTE_PRESENT | PTE_SWAPPED))) continue;
+
+            if (!dst_pt) {
+                // The child's table is only reachable through a scratch PTE
+                if (!(dst->dir[dir_index] & PTE_PRESENT)) {
+                    uint32_t pt_phys = pmm_alloc_zeroed_page();
+                    if (!pt_phys) {
+                        if (protected) tlb_flush_range(start, (end - start) / PAGE_SIZE);
+                        irq_restore(irq_flags);
+                        return -1;
+                    }
+                    dst->dir[dir_index] = pt_phys | PTE_PRESENT | PTE_WRITE |
+                                          (dir[dir_index] & PTE_USER);
+                    dst->table_used[dir_index] = 0;
+                    page_tables_allocated++;
+                }
+                dst_pt = temp_map(PAGING_TEMP_TABLE_VIRT, dst->dir[dir_index] & PAGE_MASK);
+
+                // Allocating the table may have reclaimed or moved this page
+                pte = src_pt[table_index];
+                if (!(pte & (PTE_PRESENT | PTE_SWAPPED))) continue;
+            }
+
+            if (pte & PTE_SWAPPED) {
+                // Both read the slot back into a page of their own
+                swap_dup(pte);
+            } else {
+                // Both sides read-only; the first write fault gets its own copy
+                if (copy_on_write && (pte & PTE_WRITE)) {
+                    pte &= ~PTE_WRITE;
+                    src_pt[table_index] = pte;
+                    protected++;
+                }
+                pmm_page_ref(pte & PAGE_MASK);
+            }
+            if (dst_pt[table_index] == 0) {
+                dst->table_used[dir_index]++;
+            }
+            dst_pt[table_index] = pte;
+            shared++;
+        }
+
+        if (dst_pt) {
+            temp_unmap(PAGING_TEMP_TABLE_VIRT, dst_pt);
+        }
+    }
+
+    // The parent may still have writable translations cached
+    if (protected) {
+        tlb_flush_range(start, (end - start) / PAGE_SIZE);
+    }
+
+    irq_restore(irq_flags);
+    return shared;
 }
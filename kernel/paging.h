@@ -16,15 +16,106 @@
 #define PTE_ACCESSED 0x00000020
 #define PTE_DIRTY   0x00000040
 #define PTE_GLOBAL  0x00000100
+#define PDE_LARGE   0x00000080             // PS bit: PDE maps a 4MB page directly
+#define PTE_SWAPPED 0x00000200             // Not present, bits 12-31 name a swap slot
+#define LARGE_PAGE_SIZE 0x400000
+
+#define IDENTITY_MAP_SIZE 0x400000         // First 4MB is mapped 1:1
+#define PAGING_TEMP_VIRT  0xFFBFF000       // Scratch page for touching other physical pages
+#define PAGING_TEMP_TABLE_VIRT 0xFFBFE000  // Scratch page for another space's page table
+#define KERNEL_VIRT_BASE  0xC0000000       // Low physical memory is aliased here
+#define DIRECT_MAP_SIZE   0x1000000        // Size of that alias (16MB)
+#define PAGE_TABLES_VIRT  0xFFC00000       // Recursive mapping: page table N is at +N*4KB
+
+// Ranges longer than this get one full TLB flush instead of an invlpg per page
+#define TLB_FLUSH_THRESHOLD 32
+
+#define KERNEL_PDE_FIRST  (KERNEL_VIRT_BASE >> 22)
 
 typedef uint32_t pde_t;
 typedef uint32_t pte_t;
 
 extern pde_t kernel_page_dir[PAGE_DIR_SIZE];
 
+// A page directory plus bookkeeping for its user half. All spaces share
+// the kernel PDEs (the identity map and everything above 0xC0000000).
+typedef struct address_space {
+    pde_t *dir;                             // Directory, as seen by the kernel
+    uint32_t dir_phys;                      // What gets loaded into CR3
+    uint16_t table_used[KERNEL_PDE_FIRST];  // Present or swapped PTEs per user page table
+    struct vm_area *vmas;                   // Regions backed on demand (vmm.c), in address order
+    struct vm_area *vma_root;               // Same regions as a search tree
+    uint32_t brk_base;                      // Start of the brk() heap
+    uint32_t brk;                           // Current program break
+    volatile uint32_t cpu_mask;             // CPUs with it loaded in CR3
+    struct address_space *next;
+} address_space_t;
+
+// Kernel address of a physical page inside the direct map, and back
+static inline void *phys_to_virt(uint32_t phys) {
+    return (void *)(phys + KERNEL_VIRT_BASE);
+}
+
+static inline uint32_t direct_virt_to_phys(const void *virt) {
+    return (uint32_t)virt - KERNEL_VIRT_BASE;
+}
+
 void paging_init(void);
+int paging_large_pages(void);   // 1 if the kernel maps use 4MB PDEs
+int paging_global_pages(void);  // 1 if kernel TLB entries survive CR3 loads
+void paging_set_global(int enable);
 void paging_enable(void);
 uint32_t virt_to_phys(uint32_t virt);
-void page_map(uint32_t virt, uint32_t phys, uint32_t flags);
+
+// Raw PTE for virt in the current space, 0 if there is no page table
+pte_t paging_get_pte(uint32_t virt);
+
+// Clear the accessed bit so the next use of the page sets it again
+void paging_clear_accessed(uint32_t virt);
+
+// Make a present page read-only everywhere, so no CPU can change it
+// while it is copied out. A writer faults and waits on the kernel lock.
+void paging_write_protect(uint32_t virt);
+
+// Swap a present PTE for a not-present swap entry (PTE_SWAPPED set).
+// The page table keeps counting the slot as in use.
+void paging_set_swap_entry(uint32_t virt, pte_t entry);
+int page_map(uint32_t virt, uint32_t phys, uint32_t flags);
+void page_unmap(uint32_t virt);
+
+// Map or unmap count consecutive pages with a single TLB flush at the end.
+// If mapping fails part way, the pages mapped so far are unmapped again.
+int page_map_range(uint32_t virt, uint32_t phys, uint32_t count, uint32_t flags);
+void page_unmap_range(uint32_t virt, uint32_t count);
+
+// TLB invalidation. page_map()/page_unmap() already do this for their
+// own changes; these are for code that edits PTEs directly. Other CPUs
+// that may have the entries cached flush too before these return.
+void tlb_flush_page(uint32_t virt);
+void tlb_flush_range(uint32_t virt, uint32_t count);
+void tlb_flush_all(void);
+void tlb_flush_local(void);     // This CPU only, global entries included
+void paging_get_tlb_stats(uint32_t *page_flushes, uint32_t *full_flushes);
+void page_zero(uint32_t phys);
+void page_copy(uint32_t dst_phys, const void *src);
+
+// Map every present page of [start, end) in the current space into dst
+// too, taking a reference on each shared page or swap slot. With copy_on_write the
+// pages become read-only in both; otherwise permissions are kept.
+// Returns pages shared, or -1 if dst ran out of page tables.
+int paging_share_range(address_space_t *dst, uint32_t start, uint32_t end, int copy_on_write);
+
+// Page tables allocated from the PMM (boot tables not included)
+uint32_t paging_get_table_count(void);
+
+// Address spaces; page_map() and page_unmap() act on the current one.
+// Release a space's regions with vmm_release_all() before destroying it.
+address_space_t *paging_space_create(void);
+void paging_space_destroy(address_space_t *as);
+void paging_switch(address_space_t *as);
+void paging_cpu_init(void);     // An AP starts out in the kernel space
+address_space_t *paging_current_space(void);
+address_space_t *paging_kernel_space(void);
+uint32_t paging_get_cr3_loads(void);
 
 #endif
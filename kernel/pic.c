@@ -1,5 +1,6 @@
 #include "pic.h"
 #include "io.h"
+#include "apic.h"
 
 #define PIC_MASTER_CMD  0x20
 #define PIC_MASTER_DATA 0x21
@@ -39,6 +40,11 @@ void pic_enable_irq(int irq) {
     uint16_t port;
     uint8_t mask;
 
+    if (apic_active()) {
+        apic_enable_irq(irq);
+        return;
+    }
+
     if (irq < 8) {
         port = PIC_MASTER_DATA;
     } else {
@@ -55,6 +61,11 @@ void pic_disable_irq(int irq) {
     uint16_t port;
     uint8_t mask;
 
+    if (apic_active()) {
+        apic_disable_irq(irq);
+        return;
+    }
+
     if (irq < 8) {
         port = PIC_MASTER_DATA;
     } else {
@@ -66,3 +77,12 @@ void pic_disable_irq(int irq) {
     mask |= (1 << irq);
     outb(port, mask);
 }
+
+uint16_t pic_get_mask(void) {
+    return inb(PIC_MASTER_DATA) | (inb(PIC_SLAVE_DATA) << 8);
+}
+
+void pic_set_mask(uint16_t mask) {
+    outb(PIC_MASTER_DATA, mask & 0xFF);
+    outb(PIC_SLAVE_DATA, mask >> 8);
+}
@@ -4,7 +4,13 @@
 #include <stdint.h>
 
 void pic_init(void);
+// Unmask or mask an ISA IRQ on whichever controller is in use: the
+// 8259s, or the IOAPIC once apic_init() has taken over
 void pic_enable_irq(int irq);
 void pic_disable_irq(int irq);
 
+// 8259 masks, master in the low byte; a set bit masks the IRQ
+uint16_t pic_get_mask(void);
+void pic_set_mask(uint16_t mask);
+
 #endif
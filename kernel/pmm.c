@@ -1,42 +1,329 @@
 #include "pmm.h"
 #include "vga.h"
 #include "string.h"
+#include "cpu.h"
+#include "paging.h"
+#include <stddef.h>
 
 #define PAGE_SIZE 0x1000
-#define BITMAP_SIZE 1024 * 1024  // 1M bytes = 8M pages = 32GB addressable
+#define PMM_NOT_FOUND 0xFFFFFFFF
+#define PMM_NO_LIMIT 0xFFFFFFFF
+#define PMM_MAX_RESERVED 4
+#define PMM_COMPACT_TRIES 4     // Candidate blocks per compaction
 
-static uint8_t page_bitmap[BITMAP_SIZE];
+// Kernel image bounds from the linker script
+extern char _kernel_start[];
+extern char _kernel_end[];
+
+/*
+ * Binary buddy allocator over per-order bitmaps.
+ *
+ * Free memory is kept as power-of-two blocks of pages. A block of order k
+ * starts on a page index that is a multiple of 2^k, so its buddy is simply
+ * index ^ (1 << k). Allocation splits larger blocks down to the requested
+ * order, freeing merges a block with its buddy for as long as the buddy is
+ * free too.
+ *
+ * Each order has its own bitmap with one bit per block (bit set = block is
+ * free), plus a summary level with one bit per bitmap word (bit set = word
+ * is non-zero). Finding a free block is a bsf over summary words followed by
+ * a bsf on the bitmap word it points at. A next-fit hint per order starts the
+ * search where the last allocation left off, so the low, fully used region
+ * is not rescanned on every call.
+ */
+typedef struct {
+    uint32_t *words;        // One bit per block of this order
+    uint32_t *summary;      // One bit per word of `words`
+    uint32_t nbits;         // Blocks of this order that fit in memory
+    uint32_t nwords;
+    uint32_t nsummary;
+    uint32_t hint;          // Word index the next search starts from
+} pmm_level_t;
+
+typedef struct {
+    uint32_t start;         // First page
+    uint32_t end;           // One past the last page
+} pmm_range_t;
+
+// Placed right after the kernel image and sized to the detected memory
+static uint32_t *page_bitmap;
+static uint16_t *page_refs;         // Mappings per page, for pages shared copy-on-write
+static pmm_range_t reserved[PMM_MAX_RESERVED];
+static int reserved_count = 0;
+static pmm_level_t levels[PMM_MAX_ORDER + 1];
 static uint32_t total_pages = 0;
 static uint32_t free_pages = 0;
+static pmm_stats_t stats;
+
+// Pages already cleared by the idle task, handed out by pmm_alloc_zeroed_page()
+static uint32_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+
+// Free pages per zone; blocks never straddle the zone boundary because
+// it is a multiple of the largest block size
+#define PMM_DMA_PAGES (PMM_DMA_LIMIT / PAGE_SIZE)
+static uint32_t zone_free[PMM_ZONES];
+
+// Compaction empties one block at a time. Pages freed inside it are
+// parked in this bitmap rather than going back on the free lists, so
+// the pages being moved out can't be given straight back to it.
+static uint32_t compact_start = 0;      // Pages; an empty range when idle
+static uint32_t compact_end = 0;
+static uint32_t compact_parked[(1u << PMM_MAX_ORDER) / 32];
+static pmm_migrate_fn migrate_hook = NULL;
+
+// Free-page watermarks and the shrinkers asked when memory runs short,
+// sorted by cost
+#define PMM_RECLAIM_BATCH 16
+static uint32_t watermark_low, watermark_high;
+static shrinker_t *shrinkers = NULL;
+static int reclaiming = 0;          // Shrinkers free pages, they don't reclaim
+static void pmm_pressure_init(void);
+
+static inline int level_test(pmm_level_t *level, uint32_t block) {
+    return (level->words[block >> 5] >> (block & 31)) & 1;
+}
+
+static inline void level_set(pmm_level_t *level, uint32_t block) {
+    uint32_t w = block >> 5;
+    level->words[w] |= 1u << (block & 31);
+    level->summary[w >> 5] |= 1u << (w & 31);
+}
+
+static inline void level_clear(pmm_level_t *level, uint32_t block) {
+    uint32_t w = block >> 5;
+    level->words[w] &= ~(1u << (block & 31));
+    if (level->words[w] == 0) {
+        level->summary[w >> 5] &= ~(1u << (w & 31));
+    }
+}
+
+// Set bits [first, first + count) with whole-word fills for the middle
+static void bitmap_set_run(uint32_t *map, uint32_t first, uint32_t count) {
+    while (count && (first & 31)) {
+        map[first >> 5] |= 1u << (first & 31);
+        first++;
+        count--;
+    }
+    if (count >= 32) {
+        memset32(&map[first >> 5], 0xFFFFFFFF, count >> 5);
+        first += count & ~31u;
+        count &= 31;
+    }
+    while (count) {
+        map[first >> 5] |= 1u << (first & 31);
+        first++;
+        count--;
+    }
+}
+
+static void level_set_run(pmm_level_t *level, uint32_t first, uint32_t count) {
+    uint32_t first_word = first >> 5;
+    uint32_t last_word = (first + count - 1) >> 5;
+    bitmap_set_run(level->words, first, count);
+    bitmap_set_run(level->summary, first_word, last_word - first_word + 1);
+}
+
+// Lowest free block in [first, limit); ignores the next-fit hint
+static uint32_t level_find_range(pmm_level_t *level, uint32_t first, uint32_t limit) {
+    if (limit > level->nbits) limit = level->nbits;
+    if (first >= limit) return PMM_NOT_FOUND;
+
+    uint32_t first_word = first >> 5;
+    uint32_t nwords = (limit + 31) / 32;
+    uint32_t nsummary = (nwords + 31) / 32;
+
+    for (uint32_t s = first_word >> 5; s < nsummary; s++) {
+        uint32_t bits = level->summary[s];
+        if (s == first_word >> 5) {
+            bits &= ~0u << (first_word & 31);
+        }
+        if (s == nsummary - 1 && (nwords & 31)) {
+            bits &= (1u << (nwords & 31)) - 1;
+        }
+        stats.search_steps++;
+
+        while (bits) {
+            uint32_t w = (s << 5) + bit_scan_forward(bits);
+            uint32_t word = level->words[w];
+            if (w == first_word) {
+                word &= ~0u << (first & 31);
+            }
+            if (w == nwords - 1 && (limit & 31)) {
+                word &= (1u << (limit & 31)) - 1;
+            }
+            stats.search_steps++;
+            if (word) {
+                return (w << 5) + bit_scan_forward(word);
+            }
+            bits &= bits - 1;
+        }
+    }
+    return PMM_NOT_FOUND;
+}
+
+// First free block at or after `first`, starting from the hint and
+// wrapping around once
+static uint32_t level_find(pmm_level_t *level, uint32_t first) {
+    uint32_t hint = level->hint << 5;
+    if (hint < first) hint = first;
+
+    uint32_t block = level_find_range(level, hint, level->nbits);
+    if (block == PMM_NOT_FOUND && hint > first) {
+        block = level_find_range(level, first, hint);
+    }
+    if (block != PMM_NOT_FOUND) {
+        level->hint = block >> 5;
+    }
+    return block;
+}
+
+// Pages of [page, page + count) that lie in ZONE_DMA
+static uint32_t dma_part(uint32_t page, uint32_t count) {
+    if (page >= PMM_DMA_PAGES) return 0;
+    uint32_t end = page + count;
+    return (end > PMM_DMA_PAGES ? PMM_DMA_PAGES : end) - page;
+}
+
+// free_pages and the per-zone counts always move together
+static void free_pages_add(uint32_t page, uint32_t count) {
+    uint32_t dma = dma_part(page, count);
+    zone_free[PMM_ZONE_DMA] += dma;
+    zone_free[PMM_ZONE_NORMAL] += count - dma;
+    free_pages += count;
+}
+
+static void free_pages_sub(uint32_t page, uint32_t count) {
+    uint32_t dma = dma_part(page, count);
+    zone_free[PMM_ZONE_DMA] -= dma;
+    zone_free[PMM_ZONE_NORMAL] -= count - dma;
+    free_pages -= count;
+}
+
+static void pmm_mark_free(uint32_t order, uint32_t page) {
+    level_set(&levels[order], page >> order);
+}
+
+// Free the largest aligned block that starts at `start` and fits before `end`
+static uint32_t pmm_free_block(uint32_t start, uint32_t end) {
+    uint32_t order = PMM_MAX_ORDER;
+    while (order > 0 && ((start & ((1u << order) - 1)) || start + (1u << order) > end)) {
+        order--;
+    }
+    pmm_mark_free(order, start);
+    free_pages_add(start, 1u << order);
+    return 1u << order;
+}
+
+// Hand the pages [start, end) to the allocator. Only the ragged ends need
+// individual blocks; the max-order blocks in between are set as one run.
+static void pmm_free_range(uint32_t start, uint32_t end) {
+    uint32_t max_block = 1u << PMM_MAX_ORDER;
+
+    while (start < end && (start & (max_block - 1))) {
+        start += pmm_free_block(start, end);
+    }
+
+    uint32_t count = (end - start) >> PMM_MAX_ORDER;
+    if (start < end && count) {
+        level_set_run(&levels[PMM_MAX_ORDER], start >> PMM_MAX_ORDER, count);
+        free_pages_add(start, count << PMM_MAX_ORDER);
+        start += count << PMM_MAX_ORDER;
+    }
+
+    while (start < end) {
+        start += pmm_free_block(start, end);
+    }
+}
+
+// Remember [start, end) as never allocatable; kept sorted by start page
+static void pmm_reserve(uint32_t start, uint32_t end) {
+    if (reserved_count >= PMM_MAX_RESERVED) return;
+
+    int i = reserved_count++;
+    while (i > 0 && reserved[i - 1].start > start) {
+        reserved[i] = reserved[i - 1];
+        i--;
+    }
+    reserved[i].start = start;
+    reserved[i].end = end;
+}
+
+// Free a usable range minus whatever part of it is reserved
+static void pmm_free_unreserved(uint32_t start, uint32_t end) {
+    for (int i = 0; i < reserved_count && start < end; i++) {
+        if (reserved[i].end <= start || reserved[i].start >= end) continue;
+        if (reserved[i].start > start) {
+            pmm_free_range(start, reserved[i].start);
+        }
+        start = reserved[i].end;
+    }
+    if (start < end) {
+        pmm_free_range(start, end);
+    }
+}
 
-void pmm_init(uint32_t total_memory) {
+void pmm_init(const e820_map_t *map) {
     vga_print("[*] Initializing physical memory manager...\n");
-    
-    // Clear bitmap
-    for (int i = 0; i < BITMAP_SIZE; i++) {
-        page_bitmap[i] = 0xFF;  // Mark all as used initially
-    }
-    
-    total_pages = total_memory / PAGE_SIZE;
-    
-    // Mark usable pages as free
-    for (uint32_t i = 0; i < total_pages; i++) {
-        uint32_t byte = i / 8;
-        uint32_t bit = i % 8;
-        if (byte < BITMAP_SIZE) {
-            page_bitmap[byte] &= ~(1 << bit);
-            free_pages++;
-        }
-    }
-    
-    // Mark kernel space (0x0 - 0x100000) as used
-    for (uint32_t i = 0; i < (0x100000 / PAGE_SIZE); i++) {
-        uint32_t byte = i / 8;
-        uint32_t bit = i % 8;
-        page_bitmap[byte] |= (1 << bit);
-        free_pages--;
-    }
-    
+
+    uint64_t start_tsc = rdtsc();
+
+    // The bitmaps only need to reach the end of the highest usable range
+    total_pages = 0;
+    for (uint32_t i = 0; i < map->count; i++) {
+        const e820_entry_t *entry = &map->entries[i];
+        if (entry->type != E820_USABLE) continue;
+        uint32_t end = (uint32_t)((entry->base + entry->length) >> 12);
+        if (end > total_pages) total_pages = end;
+    }
+
+    // Lay out the per-order bitmaps and their summaries after the kernel
+    uint32_t kernel_end = ((uint32_t)_kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    page_bitmap = (uint32_t *)kernel_end;
+    uint32_t *next = page_bitmap;
+    for (int k = 0; k <= PMM_MAX_ORDER; k++) {
+        pmm_level_t *level = &levels[k];
+        level->nbits = total_pages >> k;
+        level->nwords = (level->nbits + 31) / 32;
+        if (level->nwords == 0) level->nwords = 1;
+        level->nsummary = (level->nwords + 31) / 32;
+        level->hint = 0;
+        level->words = next;
+        next += level->nwords;
+        level->summary = next;
+        next += level->nsummary;
+    }
+    page_refs = (uint16_t *)next;
+    next += (total_pages * sizeof(uint16_t) + 3) / 4;
+    memset32(page_bitmap, 0, next - page_bitmap);
+    uint32_t bitmap_end = ((uint32_t)next + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    // Low memory (BIOS, VGA) and the kernel image plus its bitmaps and
+    // reference counts stay used
+    reserved_count = 0;
+    pmm_reserve(0, 0x100000 / PAGE_SIZE);
+    pmm_reserve((uint32_t)_kernel_start / PAGE_SIZE, bitmap_end / PAGE_SIZE);
+
+    // Free the page-aligned interior of every usable range; holes and
+    // reserved ranges stay allocated
+    free_pages = 0;
+    zone_free[PMM_ZONE_DMA] = 0;
+    zone_free[PMM_ZONE_NORMAL] = 0;
+    for (uint32_t i = 0; i < map->count; i++) {
+        const e820_entry_t *entry = &map->entries[i];
+        if (entry->type != E820_USABLE) continue;
+        uint32_t start = (uint32_t)((entry->base + PAGE_SIZE - 1) >> 12);
+        uint32_t end = (uint32_t)((entry->base + entry->length) >> 12);
+        if (start < end) {
+            pmm_free_unreserved(start, end);
+        }
+    }
+
+    pmm_pressure_init();
+
+    uint64_t cycles = rdtsc() - start_tsc;
+    stats.init_cycles = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+
     char buf[16];
     vga_print("[+] PMM initialized: ");
     itoa(free_pages, buf, 10);
@@ -45,35 +332,578 @@ void pmm_init(uint32_t total_memory) {
     itoa(free_pages * PAGE_SIZE / 1024 / 1024, buf, 10);
     vga_print(buf);
     vga_print("MB)\n");
+    vga_print("    Bitmaps: ");
+    itoa((bitmap_end - kernel_end) / 1024, buf, 10);
+    vga_print(buf);
+    vga_print("KB at 0x");
+    utoa(kernel_end, buf, 16);
+    vga_print(buf);
+    vga_print(", init took ");
+    utoa(stats.init_cycles, buf, 10);
+    vga_print(buf);
+    vga_print(" cycles\n");
+}
+
+// Take a block of `order` pages starting at or above page `first_page`
+// and ending at or below page `limit_page`. Without a limit the next-fit
+// hints are used, otherwise the lowest block that fits.
+static uint32_t pmm_take_block(uint32_t order, uint32_t first_page, uint32_t limit_page) {
+    // Smallest order with a free block
+    uint32_t k = order;
+    uint32_t block = PMM_NOT_FOUND;
+    while (k <= PMM_MAX_ORDER) {
+        uint32_t first = (first_page + (1u << k) - 1) >> k;
+        if (limit_page == PMM_NO_LIMIT) {
+            block = level_find(&levels[k], first);
+        } else {
+            block = level_find_range(&levels[k], first, limit_page >> k);
+        }
+        if (block != PMM_NOT_FOUND) break;
+        k++;
+    }
+    if (block == PMM_NOT_FOUND) {
+        return 0;
+    }
+
+    level_clear(&levels[k], block);
+    uint32_t page = block << k;
+
+    // Split down to the requested order, returning the upper halves
+    while (k > order) {
+        k--;
+        pmm_mark_free(k, page + (1u << k));
+    }
+
+    free_pages_sub(page, 1u << order);
+    page_refs[page] = 1;
+    return page * PAGE_SIZE;
+}
+
+// Allocations that can live anywhere leave ZONE_DMA alone until
+// ZONE_NORMAL runs out. Callers may be preempted, so the bitmaps,
+// hints and counts are only touched inside an irq_save() section.
+static uint32_t pmm_take_zoned(uint32_t order, uint32_t limit_page) {
+    uint32_t flags = irq_save();
+    uint32_t phys = 0;
+    if (limit_page == PMM_NO_LIMIT) {
+        phys = pmm_take_block(order, PMM_DMA_PAGES, PMM_NO_LIMIT);
+    }
+    if (!phys) {
+        phys = pmm_take_block(order, 0, limit_page);
+    }
+    irq_restore(flags);
+    return phys;
+}
+
+// quiet: a failure is expected to be retried (pmm_alloc_contig()), so
+// neither warn nor count it
+static uint32_t pmm_alloc_block(uint32_t order, uint32_t limit_page, int quiet) {
+    if (order > PMM_MAX_ORDER) return 0;
+
+    stats.allocs++;
+
+    uint32_t phys = pmm_take_zoned(order, limit_page);
+    if (!phys && !reclaiming) {
+        // Nothing free: have the shrinkers give some back and try once more
+        uint32_t target = 1u << order;
+        if (target < PMM_RECLAIM_BATCH) target = PMM_RECLAIM_BATCH;
+        if (pmm_reclaim(target) > 0) {
+            stats.direct_reclaims++;
+            phys = pmm_take_zoned(order, limit_page);
+        }
+    }
+    if (!phys && !quiet) {
+        stats.failures++;
+        vga_print("WARNING: No free pages\n");
+    }
+    return phys;
+}
+
+uint32_t pmm_alloc_pages(uint32_t order) {
+    return pmm_alloc_block(order, PMM_NO_LIMIT, 0);
+}
+
+uint32_t pmm_alloc_pages_below(uint32_t order, uint32_t max_phys) {
+    return pmm_alloc_block(order, max_phys / PAGE_SIZE, 0);
+}
+
+// The checks and the merge run as one irq_save() section, like the
+// allocation side (pmm_take_zoned())
+static void pmm_free_block_locked(uint32_t page, uint32_t order) {
+    // Double free: the block, or a larger free block around it, is free
+    for (uint32_t k = order; k <= PMM_MAX_ORDER; k++) {
+        if ((page >> k) < levels[k].nbits && level_test(&levels[k], page >> k)) return;
+    }
+
+    page_refs[page] = 0;
+
+    // Inside a block being compacted: hold on to it until that is done
+    if (page >= compact_start && page < compact_end) {
+        for (uint32_t i = 0; i < (1u << order); i++) {
+            uint32_t bit = page + i - compact_start;
+            compact_parked[bit >> 5] |= 1u << (bit & 31);
+        }
+        return;
+    }
+
+    free_pages_add(page, 1u << order);
+
+    // Coalesce with the buddy while it is a free block of the same order
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = (page ^ (1u << order)) >> order;
+        if (buddy >= levels[order].nbits || !level_test(&levels[order], buddy)) {
+            break;
+        }
+        level_clear(&levels[order], buddy);
+        page &= ~(1u << order);
+        order++;
+    }
+
+    pmm_mark_free(order, page);
+}
+
+void pmm_free_pages(uint32_t phys, uint32_t order) {
+    uint32_t page = phys / PAGE_SIZE;
+
+    if (order > PMM_MAX_ORDER || page + (1u << order) > total_pages) return;
+    if (page & ((1u << order) - 1)) return;                 // Not a block of this order
+
+    uint32_t flags = irq_save();
+    pmm_free_block_locked(page, order);
+    irq_restore(flags);
 }
 
 uint32_t pmm_alloc_page(void) {
-    for (uint32_t i = 0; i < total_pages; i++) {
-        uint32_t byte = i / 8;
-        uint32_t bit = i % 8;
-        if (byte >= BITMAP_SIZE) break;
-        
-        if (!(page_bitmap[byte] & (1 << bit))) {
-            page_bitmap[byte] |= (1 << bit);
-            free_pages--;
-            return i * PAGE_SIZE;
-        }
-    }
-    vga_print("WARNING: No free pages\n");
-    return 0;
+    return pmm_alloc_pages(0);
 }
 
 void pmm_free_page(uint32_t phys) {
+    pmm_free_pages(phys, 0);
+}
+
+/* ====== Contiguous allocations ====== */
+
+// Free [page, page + count) as the largest aligned blocks that fit
+static void pmm_free_run(uint32_t page, uint32_t count) {
+    uint32_t end = page + count;
+    while (page < end) {
+        uint32_t order = PMM_MAX_ORDER;
+        while (order > 0 && ((page & ((1u << order) - 1)) || page + (1u << order) > end)) {
+            order--;
+        }
+        pmm_free_pages(page * PAGE_SIZE, order);
+        page += 1u << order;
+    }
+}
+
+// Order of the block containing free page `page`, or -1 if it is in use
+static int page_free_order(uint32_t page) {
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        if ((page >> k) < levels[k].nbits && level_test(&levels[k], page >> k)) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// Free pages inside [start, start + count); -1 if it lies inside a
+// bigger free block (nothing to compact there)
+static int32_t count_free(uint32_t start, uint32_t count, uint32_t order) {
+    int32_t free = 0;
+    for (uint32_t page = start; page < start + count; ) {
+        int k = page_free_order(page);
+        if (k > (int)order) return -1;
+        if (k < 0) {
+            page++;
+            continue;
+        }
+        free += 1u << k;
+        page += 1u << k;
+    }
+    return free;
+}
+
+// Empty the block at `best` by moving the movable pages in it elsewhere.
+// Returns 1 if it came out free.
+static int pmm_compact_block(uint32_t best, uint32_t size) {
+    uint32_t flags = irq_save();
+    stats.compactions++;
+
+    // Park what is free in it already, then move the rest out
+    memset32(compact_parked, 0, size > 32 ? size / 32 : 1);
+    compact_start = best;
+    compact_end = best + size;
+    for (uint32_t page = best; page < best + size; ) {
+        int k = page_free_order(page);
+        if (k < 0) {
+            page++;
+            continue;
+        }
+        level_clear(&levels[k], page >> k);
+        free_pages_sub(page, 1u << k);
+        for (uint32_t i = 0; i < (1u << k); i++) {
+            uint32_t bit = page + i - best;
+            compact_parked[bit >> 5] |= 1u << (bit & 31);
+        }
+        page += 1u << k;
+    }
+
+    stats.pages_migrated += migrate_hook(best, best + size);
+
+    // Return every parked page; if all of them are, they merge back into
+    // one block of the order we wanted
+    compact_start = compact_end = 0;
+    uint32_t parked = 0;
+    for (uint32_t bit = 0; bit < size; bit++) {
+        if (compact_parked[bit >> 5] & (1u << (bit & 31))) {
+            pmm_free_pages((best + bit) * PAGE_SIZE, 0);
+            parked++;
+        }
+    }
+
+    irq_restore(flags);
+    return parked == size;
+}
+
+// Empty a block of `order` below limit_page, trying the most nearly free
+// ones first. A block holding a page that can't move (slab, page table,
+// kernel) stays partly used, so the next best gets a turn.
+static int pmm_compact(uint32_t order, uint32_t limit_page) {
+    if (!migrate_hook) return 0;
+
+    uint32_t size = 1u << order;
+    uint32_t end = limit_page < total_pages ? limit_page : total_pages;
+    uint32_t first = (0x100000 / PAGE_SIZE + size - 1) & ~(size - 1);
+    uint32_t tried[PMM_COMPACT_TRIES];
+
+    for (int n = 0; n < PMM_COMPACT_TRIES; n++) {
+        // Candidate: most free pages already, skipping low memory and
+        // the blocks already tried
+        uint32_t best = PMM_NOT_FOUND;
+        int32_t best_free = 0;
+        for (uint32_t start = first; start + size <= end; start += size) {
+            int32_t free = count_free(start, size, order);
+            if (free <= best_free) continue;
+
+            int seen = 0;
+            for (int i = 0; i < n; i++) {
+                if (tried[i] == start) seen = 1;
+            }
+            if (!seen) {
+                best_free = free;
+                best = start;
+            }
+        }
+        if (best == PMM_NOT_FOUND) return 0;
+
+        if (pmm_compact_block(best, size)) return 1;
+        tried[n] = best;
+    }
+    return 0;
+}
+
+uint32_t pmm_alloc_contig(uint32_t npages, uint32_t align, uint32_t max_phys) {
+    if (npages == 0 || (align & (align - 1))) return 0;
+
+    // One buddy block big enough and aligned enough, trimmed afterwards
+    uint32_t order = 0;
+    while ((1u << order) < npages || ((uint32_t)PAGE_SIZE << order) < align) {
+        order++;
+    }
+    if (order > PMM_MAX_ORDER) return 0;
+
+    uint32_t limit_page = max_phys ? max_phys / PAGE_SIZE : PMM_NO_LIMIT;
+    uint32_t phys = pmm_alloc_block(order, limit_page, 1);
+    if (!phys && order > 0 && pmm_compact(order, limit_page)) {
+        stats.compact_success++;
+        phys = pmm_alloc_block(order, limit_page, 1);
+    }
+    if (!phys) {
+        stats.failures++;
+        vga_print("WARNING: No free pages\n");
+        return 0;
+    }
+
+    // Give back the part past npages
+    uint32_t page = phys / PAGE_SIZE;
+    pmm_free_run(page + npages, (1u << order) - npages);
+    return phys;
+}
+
+void pmm_free_contig(uint32_t phys, uint32_t npages) {
+    pmm_free_run(phys / PAGE_SIZE, npages);
+}
+
+void pmm_set_migrate_hook(pmm_migrate_fn fn) {
+    migrate_hook = fn;
+}
+
+uint32_t pmm_zone_free_pages(int zone) {
+    return (zone >= 0 && zone < PMM_ZONES) ? zone_free[zone] : 0;
+}
+
+void pmm_page_ref(uint32_t phys) {
+    uint32_t page = phys / PAGE_SIZE;
+    if (page >= total_pages) return;
+
+    uint32_t flags = irq_save();
+    if (page_refs[page] != PMM_REF_PINNED) {
+        page_refs[page]++;
+    }
+    irq_restore(flags);
+}
+
+void pmm_page_unref(uint32_t phys) {
+    uint32_t page = phys / PAGE_SIZE;
+    if (page >= total_pages) return;
+
+    uint32_t flags = irq_save();
+    if (page_refs[page] == PMM_REF_PINNED) {
+        irq_restore(flags);
+        return;
+    }
+    if (page_refs[page] > 1) {
+        page_refs[page]--;
+        irq_restore(flags);
+        return;
+    }
+    irq_restore(flags);
+
+    // Last mapping gone
+    pmm_free_page(phys & ~(PAGE_SIZE - 1));
+}
+
+void pmm_page_pin(uint32_t phys) {
     uint32_t page = phys / PAGE_SIZE;
-    uint32_t byte = page / 8;
-    uint32_t bit = page % 8;
-    
-    if (byte < BITMAP_SIZE) {
-        page_bitmap[byte] &= ~(1 << bit);
-        free_pages++;
+    if (page < total_pages) {
+        page_refs[page] = PMM_REF_PINNED;
     }
 }
 
+uint32_t pmm_page_refcount(uint32_t phys) {
+    uint32_t page = phys / PAGE_SIZE;
+    return page < total_pages ? page_refs[page] : 0;
+}
+
 uint32_t pmm_get_free_pages(void) {
     return free_pages;
 }
+
+void pmm_get_stats(pmm_stats_t *out) {
+    *out = stats;
+}
+
+uint32_t pmm_alloc_zeroed_page(void) {
+    uint32_t flags = irq_save();
+    if (zero_pool_count > 0) {
+        uint32_t phys = zero_pool[--zero_pool_count];
+        stats.zero_hits++;
+        irq_restore(flags);
+        return phys;
+    }
+    stats.zero_misses++;
+    irq_restore(flags);
+
+    // Pool empty: clear on the allocation path as before
+    uint32_t phys = pmm_alloc_page();
+    if (phys) {
+        page_zero(phys);
+    }
+    return phys;
+}
+
+uint32_t pmm_zero_pool_refill(uint32_t max) {
+    uint32_t added = 0;
+
+    while (added < max && zero_pool_count < PMM_ZERO_POOL_SIZE) {
+        // Only grow into memory nobody else is short of
+        if (pmm_under_pressure()) break;
+
+        uint32_t phys = pmm_alloc_page();
+        if (!phys) break;
+        page_zero(phys);
+
+        uint32_t flags = irq_save();
+        zero_pool[zero_pool_count++] = phys;
+        irq_restore(flags);
+        added++;
+    }
+    return added;
+}
+
+uint32_t pmm_zero_pool_count(void) {
+    return zero_pool_count;
+}
+
+static uint32_t zero_pool_shrink_count(void) {
+    return zero_pool_count;
+}
+
+static uint32_t zero_pool_shrink(uint32_t target) {
+    uint32_t freed = 0;
+    uint32_t flags = irq_save();
+    while (freed < target && zero_pool_count > 0) {
+        pmm_free_page(zero_pool[--zero_pool_count]);
+        freed++;
+    }
+    irq_restore(flags);
+    return freed;
+}
+
+static shrinker_t zero_pool_shrinker = {
+    .name = "zero-pool",
+    .cost = SHRINK_COST_FREE,
+    .count = zero_pool_shrink_count,
+    .scan = zero_pool_shrink,
+};
+
+/* ====== Memory pressure ====== */
+
+// Pressure starts with under 1/128 of memory free (and never below 64
+// pages); balancing stops half as much again above that
+static void pmm_pressure_init(void) {
+    watermark_low = free_pages / 128;
+    if (watermark_low < 64) watermark_low = 64;
+    watermark_high = watermark_low + watermark_low / 2;
+
+    pmm_register_shrinker(&zero_pool_shrinker);
+}
+
+void pmm_register_shrinker(shrinker_t *shrinker) {
+    uint32_t flags = irq_save();
+
+    shrinker_t **link = &shrinkers;
+    while (*link && (*link)->cost <= shrinker->cost) {
+        link = &(*link)->next;
+    }
+    shrinker->next = *link;
+    *link = shrinker;
+
+    irq_restore(flags);
+}
+
+uint32_t pmm_reclaim(uint32_t target) {
+    uint32_t flags = irq_save();
+    if (reclaiming || target == 0) {
+        irq_restore(flags);
+        return 0;
+    }
+    reclaiming = 1;
+    irq_restore(flags);
+
+    uint32_t freed = 0;
+    for (shrinker_t *s = shrinkers; s && freed < target; s = s->next) {
+        if (s->count() == 0) continue;
+        uint32_t got = s->scan(target - freed);
+        s->reclaimed += got;
+        freed += got;
+    }
+
+    reclaiming = 0;
+    return freed;
+}
+
+void pmm_balance(void) {
+    if (!pmm_under_pressure()) return;
+
+    stats.balance_runs++;
+    pmm_reclaim(watermark_high - free_pages);
+}
+
+int pmm_under_pressure(void) {
+    return free_pages < watermark_low;
+}
+
+void pmm_get_watermarks(uint32_t *low, uint32_t *high) {
+    *low = watermark_low;
+    *high = watermark_high;
+}
+
+void pmm_print_shrinkers(void) {
+    char buf[16];
+    vga_print("Watermarks (free pages): low ");
+    utoa(watermark_low, buf, 10);
+    vga_print(buf);
+    vga_print(", high ");
+    utoa(watermark_high, buf, 10);
+    vga_print(buf);
+    vga_print("; free now ");
+    utoa(free_pages, buf, 10);
+    vga_print(buf);
+    vga_print("\n  name          cost  reclaimable  reclaimed\n");
+
+    for (shrinker_t *s = shrinkers; s; s = s->next) {
+        vga_print("  ");
+        vga_print(s->name);
+        int len = 0;
+        while (s->name[len]) len++;
+        for (int i = len; i < 14; i++) {
+            vga_putc(' ');
+        }
+        utoa(s->cost, buf, 10);
+        vga_print(buf);
+        vga_print("     ");
+        utoa(s->count(), buf, 10);
+        vga_print(buf);
+        vga_print("  ");
+        utoa(s->reclaimed, buf, 10);
+        vga_print(buf);
+        vga_print("\n");
+    }
+}
+
+static void print_contig(const char *label, uint32_t phys, uint32_t npages,
+                         uint32_t align, uint32_t max_phys) {
+    char buf[16];
+    vga_print(label);
+    if (!phys) {
+        vga_print("FAILED\n");
+        return;
+    }
+    vga_print("0x");
+    utoa(phys, buf, 16);
+    vga_print(buf);
+    vga_print("-0x");
+    utoa(phys + npages * PAGE_SIZE, buf, 16);
+    vga_print(buf);
+
+    int ok = (phys & (align - 1)) == 0 &&
+             (!max_phys || phys + npages * PAGE_SIZE <= max_phys);
+    vga_print(ok ? " ok\n" : " OUT OF BOUNDS\n");
+}
+
+// The kinds of buffers a driver asks for: an ISA DMA buffer, a
+// descriptor table that must not cross 64KB, and an odd-sized run
+void pmm_contig_demo(void) {
+    char buf[16];
+    pmm_stats_t before = stats;
+
+    uint32_t isa = pmm_alloc_contig(16, 0x10000, PMM_DMA_LIMIT);
+    uint32_t prd = pmm_alloc_contig(1, 0x10000, 0);
+    uint32_t odd = pmm_alloc_contig(5, 0, 0);
+
+    print_contig("  64KB ISA buffer: ", isa, 16, 0x10000, PMM_DMA_LIMIT);
+    print_contig("  PRD table:       ", prd, 1, 0x10000, 0);
+    print_contig("  5 pages:         ", odd, 5, PAGE_SIZE, 0);
+
+    vga_print("  Free pages: ");
+    utoa(zone_free[PMM_ZONE_DMA], buf, 10);
+    vga_print(buf);
+    vga_print(" DMA, ");
+    utoa(zone_free[PMM_ZONE_NORMAL], buf, 10);
+    vga_print(buf);
+    vga_print(" normal\n  Compactions: ");
+    utoa(stats.compactions - before.compactions, buf, 10);
+    vga_print(buf);
+    vga_print(" (");
+    utoa(stats.compact_success - before.compact_success, buf, 10);
+    vga_print(buf);
+    vga_print(" succeeded, ");
+    utoa(stats.pages_migrated - before.pages_migrated, buf, 10);
+    vga_print(buf);
+    vga_print(" pages moved)\n");
+
+    if (isa) pmm_free_contig(isa, 16);
+    if (prd) pmm_free_contig(prd, 1);
+    if (odd) pmm_free_contig(odd, 5);
+}
@@ -2,10 +2,111 @@
 #define PMM_H
 
 #include <stdint.h>
+#include "memory.h"
 
-void pmm_init(uint32_t total_memory);
+// Largest buddy block: 2^10 pages = 4MB
+#define PMM_MAX_ORDER 10
+
+// Zones. ZONE_DMA is what ISA DMA and the kernel's direct map can reach;
+// ZONE_NORMAL is the rest, all of it below 4GB on this kernel. Allocations
+// with no address limit take from ZONE_NORMAL first so ZONE_DMA lasts.
+#define PMM_ZONE_DMA     0
+#define PMM_ZONE_NORMAL  1
+#define PMM_ZONES        2
+#define PMM_DMA_LIMIT    0x1000000
+
+// Pre-zeroed pages kept ready for pmm_alloc_zeroed_page()
+#define PMM_ZERO_POOL_SIZE 64
+
+typedef struct {
+    uint32_t allocs;        // Calls to pmm_alloc_pages()
+    uint32_t failures;      // Allocations that found no free block
+    uint32_t search_steps;  // Bitmap/summary words examined by all allocations
+    uint32_t init_cycles;   // TSC cycles spent in pmm_init()
+    uint32_t zero_hits;     // Zeroed allocations served from the pool
+    uint32_t zero_misses;   // Zeroed allocations that had to clear a page
+    uint32_t direct_reclaims;   // Allocations that had to reclaim before succeeding
+    uint32_t balance_runs;      // pmm_balance() calls that found the PMM under pressure
+    uint32_t compactions;       // Blocks pmm_alloc_contig() tried to empty
+    uint32_t compact_success;   // ...and got back whole
+    uint32_t pages_migrated;    // Pages moved out of the way for them
+} pmm_stats_t;
+
+void pmm_init(const e820_map_t *map);
 uint32_t pmm_alloc_page(void);
 void pmm_free_page(uint32_t phys);
+uint32_t pmm_alloc_pages(uint32_t order);
+void pmm_free_pages(uint32_t phys, uint32_t order);
+// Block that lies entirely below physical address `max_phys`
+uint32_t pmm_alloc_pages_below(uint32_t order, uint32_t max_phys);
+// Physically contiguous run of npages for DMA: starts on a multiple of
+// align bytes (a power of two; 0 or PAGE_SIZE for none), ends at or below
+// max_phys (0: anywhere) and never crosses a boundary of its size rounded
+// up to a power of two. Compacts memory once if fragmentation is in the way.
+uint32_t pmm_alloc_contig(uint32_t npages, uint32_t align, uint32_t max_phys);
+void pmm_free_contig(uint32_t phys, uint32_t npages);
+
+// Compaction asks the owner of movable pages to move every page it maps
+// from a frame in [start_page, end_page) elsewhere; returns pages moved
+typedef uint32_t (*pmm_migrate_fn)(uint32_t start_page, uint32_t end_page);
+void pmm_set_migrate_hook(pmm_migrate_fn fn);
+
+uint32_t pmm_zone_free_pages(int zone);
+void pmm_contig_demo(void);
+
+// Reference counts for pages mapped in more than one place (copy-on-write).
+// Allocation starts a page at 1; unref frees it when the count drops to 0.
+// A pinned page ignores both and is never freed (the shared zero page).
+#define PMM_REF_PINNED 0xFFFF
+void pmm_page_ref(uint32_t phys);
+void pmm_page_unref(uint32_t phys);
+void pmm_page_pin(uint32_t phys);
+uint32_t pmm_page_refcount(uint32_t phys);
+
 uint32_t pmm_get_free_pages(void);
+void pmm_get_stats(pmm_stats_t *out);
+
+/*
+ * Memory pressure
+ *
+ * Caches that hold pages they could give back register a shrinker.
+ * Below the low watermark the PMM is under pressure: caches stop
+ * growing and pmm_balance() (run from the idle task) asks the shrinkers
+ * for pages until the high watermark is reached again. An allocation
+ * that finds nothing free reclaims directly before it gives up.
+ * Shrinkers are asked cheapest first.
+ */
+#define SHRINK_COST_FREE    0       // Idle pages, nothing to write back
+#define SHRINK_COST_CACHE   1       // Cached data that can be re-read
+#define SHRINK_COST_IO      2       // Pages that have to be written out first
+
+typedef struct shrinker {
+    const char *name;
+    uint32_t cost;                      // SHRINK_COST_*
+    uint32_t (*count)(void);            // Pages it could free right now
+    uint32_t (*scan)(uint32_t target);  // Free up to target pages; returns pages freed
+    uint32_t reclaimed;                 // Pages given back so far
+    struct shrinker *next;
+} shrinker_t;
+
+void pmm_register_shrinker(shrinker_t *shrinker);
+
+// Ask the shrinkers for target pages; returns how many were freed
+uint32_t pmm_reclaim(uint32_t target);
+
+// Reclaim up to the high watermark if below the low one
+void pmm_balance(void);
+
+// Below the low watermark: caches should shrink rather than grow
+int pmm_under_pressure(void);
+
+void pmm_get_watermarks(uint32_t *low, uint32_t *high);
+void pmm_print_shrinkers(void);
+
+// Zeroed page, from the pre-zeroed pool when possible
+uint32_t pmm_alloc_zeroed_page(void);
+// Clear up to `max` pages into the pool (idle task); returns pages added
+uint32_t pmm_zero_pool_refill(uint32_t max);
+uint32_t pmm_zero_pool_count(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,272 @@
+/*
+ * Application processor bring-up, the kernel lock, and the IPIs the
+ * scheduler and the paging code send between CPUs.
+ */
+
+#include "smp.h"
+#include "apic.h"
+#include "idt.h"
+#include "paging.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "clock.h"
+#include "tasks_demo.h"
+#include "vga.h"
+#include "string.h"
+#include <stddef.h>
+
+#define SMP_BOOT_TIMEOUT_MS 100
+
+// CPU 0 is whoever ran kernel_main; entry.asm points the boot stack here
+cpu_t cpus[SMP_MAX_CPUS] = { [0] = { .online = 1 } };
+
+static uint32_t cpu_count = 1;
+static volatile uint32_t online_mask = 1;
+static int started = 0;
+static spinlock_t kernel_spinlock = SPINLOCK_INIT;
+static uint32_t shootdowns = 0;
+
+// The trampoline, and what the AP picks up once out of real mode
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint32_t smp_boot_cr0, smp_boot_cr3, smp_boot_cr4, smp_boot_stack;
+extern cpu_t *smp_boot_cpu;
+
+extern void irq_reschedule(void);
+extern void irq_tlb_flush(void);
+
+/* ====== Kernel lock ====== */
+
+// Carry out every flush asked of this CPU so far
+static void tlb_service(cpu_t *cpu) {
+    uint32_t requested = cpu->tlb_requested;
+    if (requested != cpu->tlb_done) {
+        tlb_flush_local();
+        cpu->tlb_done = requested;
+    }
+}
+
+// Spins with interrupts off. The holder may be waiting on this CPU to
+// flush its TLB (smp_tlb_shootdown()), so keep answering meanwhile.
+static void kernel_lock_acquire(cpu_t *cpu) {
+    while (!spin_trylock(&kernel_spinlock)) {
+        while (spin_is_locked(&kernel_spinlock)) {
+            tlb_service(cpu);
+            cpu_relax();
+        }
+    }
+}
+
+// Depth is counted from boot, so a task switched out inside a section
+// before the APs came up still takes the lock when it resumes
+void kernel_lock(void) {
+    cpu_t *cpu = this_cpu();
+    if (cpu->lock_depth++ == 0 && started) {
+        kernel_lock_acquire(cpu);
+    }
+}
+
+void kernel_unlock(void) {
+    cpu_t *cpu = this_cpu();
+    if (--cpu->lock_depth == 0 && started) {
+        spin_unlock(&kernel_spinlock);
+    }
+}
+
+void kernel_lock_switch(uint32_t prev_depth, uint32_t next_depth) {
+    if (!started) return;
+    if (prev_depth && !next_depth) {
+        spin_unlock(&kernel_spinlock);
+    } else if (!prev_depth && next_depth) {
+        kernel_lock_acquire(this_cpu());
+    }
+}
+
+/* ====== IPIs ====== */
+
+void smp_send_reschedule(uint32_t cpu) {
+    if (cpu < SMP_MAX_CPUS && cpus[cpu].online && &cpus[cpu] != this_cpu()) {
+        apic_send_ipi(cpus[cpu].apic_id, SMP_RESCHEDULE_VECTOR);
+    }
+}
+
+// From irq_reschedule, after the EOI: the sender set need_switch if it
+// wanted a switch, or just wanted the CPU out of hlt
+interrupt_frame_t *smp_reschedule_interrupt(interrupt_frame_t *frame) {
+    this_cpu()->ipis++;
+    return task_schedule(frame);
+}
+
+// Each target flushes its whole TLB (global entries too) and records
+// the request number it has caught up with. A target spinning on the
+// kernel lock or in its own shootdown answers from the spin loop.
+void smp_tlb_shootdown(uint32_t mask) {
+    cpu_t *self = this_cpu();
+    mask &= online_mask & ~(1u << self->id);
+    if (mask == 0) return;
+
+    uint32_t wanted[SMP_MAX_CPUS];
+    for (uint32_t m = mask; m; m &= m - 1) {
+        uint32_t i = bit_scan_forward(m);
+        wanted[i] = __sync_add_and_fetch(&cpus[i].tlb_requested, 1);
+        apic_send_ipi(cpus[i].apic_id, SMP_TLB_VECTOR);
+    }
+    for (uint32_t m = mask; m; m &= m - 1) {
+        uint32_t i = bit_scan_forward(m);
+        while ((int32_t)(cpus[i].tlb_done - wanted[i]) < 0) {
+            tlb_service(self);
+            cpu_relax();
+        }
+    }
+    shootdowns++;
+}
+
+// From irq_tlb_flush
+void smp_tlb_interrupt(void) {
+    tlb_service(this_cpu());
+}
+
+uint32_t smp_online_mask(void) {
+    return online_mask;
+}
+
+/* ====== Bring-up ====== */
+
+static void delay_us(uint32_t us) {
+    uint64_t end = ktime_ns() + (uint64_t)us * NSEC_PER_USEC;
+    while (ktime_ns() < end) {
+        cpu_relax();
+    }
+}
+
+// First C code on an application processor: paging is on, in the
+// kernel's address space, on the stack start_cpu() gave it
+void ap_main(cpu_t *cpu) {
+    paging_cpu_init();
+    __sync_fetch_and_or(&online_mask, 1u << cpu->id);
+    tlb_flush_local();      // Anything changed before we were in the mask
+
+    idt_load();
+    apic_cpu_init();
+
+    if (task_init_cpu() == NULL) {
+        for (;;) {
+            asm volatile("cli; hlt");
+        }
+    }
+    cpu->online = 1;
+
+    asm volatile("sti");
+    task_idle();
+}
+
+// INIT, then startup IPIs for the trampoline page, as the MP spec has it.
+// The AP's stack is an ordinary kernel stack, with its cpu_t at the
+// bottom for this_cpu().
+static int start_cpu(cpu_t *cpu) {
+    uint32_t stack_phys = pmm_alloc_pages_below(TASK_STACK_ORDER, DIRECT_MAP_SIZE);
+    if (!stack_phys) return -1;
+    uint32_t stack = (uint32_t)phys_to_virt(stack_phys);
+    smp_set_stack_cpu(stack, cpu);
+    smp_boot_stack = stack + TASK_STACK_SIZE;
+    smp_boot_cpu = cpu;
+
+    apic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    delay_us(10000);
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        apic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+        delay_us(200);
+    }
+
+    uint64_t deadline = ktime_ns() + (uint64_t)SMP_BOOT_TIMEOUT_MS * NSEC_PER_MSEC;
+    while (!cpu->online && ktime_ns() < deadline) {
+        cpu_relax();
+    }
+    // A late AP may still be using the stack, so it is not freed
+    return cpu->online ? 0 : -1;
+}
+
+void smp_init(void) {
+    cpus[0].apic_id = lapic_id();
+    if (!apic_active() || apic_cpu_count() < 2) {
+        vga_print("[*] SMP: one CPU\n");
+        return;
+    }
+
+    vga_print("[*] Starting application processors...\n");
+    idt_set_entry(SMP_RESCHEDULE_VECTOR, (uint32_t)irq_reschedule, 0x08, 0x8E);
+    idt_set_entry(SMP_TLB_VECTOR, (uint32_t)irq_tlb_flush, 0x08, 0x8E);
+
+    // The first megabyte is reserved from the PMM and inside the direct map
+    memcpy(phys_to_virt(SMP_TRAMPOLINE), smp_trampoline_start,
+           smp_trampoline_end - smp_trampoline_start);
+    smp_boot_cr0 = read_cr0();
+    smp_boot_cr3 = paging_kernel_space()->dir_phys;
+    smp_boot_cr4 = read_cr4();
+
+    // From here on irq_save() sections exclude the other CPUs too
+    started = 1;
+
+    char buf[16];
+    for (uint32_t i = 0; i < apic_cpu_count() && cpu_count < SMP_MAX_CPUS; i++) {
+        uint32_t apic_id = apic_cpu_apic_id(i);
+        if (apic_id == cpus[0].apic_id) continue;
+
+        cpu_t *cpu = &cpus[cpu_count];
+        cpu->id = cpu_count;
+        cpu->apic_id = apic_id;
+        if (start_cpu(cpu) != 0) {
+            vga_print("[!] CPU with APIC id ");
+            utoa(apic_id, buf, 10);
+            vga_print(buf);
+            vga_print(" did not start\n");
+            break;
+        }
+        cpu_count++;
+    }
+
+    if (cpu_count == 1) {
+        started = 0;
+    }
+
+    vga_print("[+] SMP: ");
+    utoa(cpu_count, buf, 10);
+    vga_print(buf);
+    vga_print(" CPU(s) online\n");
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+int smp_active(void) {
+    return started;
+}
+
+/* ====== Info ====== */
+
+static void print_dec(const char *label, uint32_t value) {
+    char buf[16];
+    vga_print(label);
+    utoa(value, buf, 10);
+    vga_print(buf);
+}
+
+void smp_print_info(void) {
+    print_dec("CPUs online: ", cpu_count);
+    vga_print("\n");
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        cpu_t *cpu = &cpus[i];
+        print_dec("  CPU ", cpu->id);
+        print_dec(": APIC id ", cpu->apic_id);
+        print_dec(", task ", cpu->current ? cpu->current->id : 0);
+        print_dec(", queued ", cpu->rq.stealable);
+        print_dec(", switches ", cpu->switches);
+        print_dec(", steals ", cpu->steals);
+        print_dec(", IPIs ", cpu->ipis);
+        vga_print("\n");
+    }
+    print_dec("  TLB shootdowns: ", shootdowns);
+    vga_print("\n");
+}
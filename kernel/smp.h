@@ -0,0 +1,87 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "task.h"
+#include "apic.h"
+#include "spinlock.h"
+
+/*
+ * Symmetric multiprocessing
+ *
+ * The application processors listed by the firmware are started with
+ * INIT and two startup IPIs into a real-mode trampoline at
+ * SMP_TRAMPOLINE (smp_boot.asm). Each CPU has a cpu_t: the task it is
+ * running, its own run queues and idle task, and its local APIC id. A
+ * task runs where it was created or woken until an idle CPU steals it.
+ *
+ * The rest of the kernel was written for one CPU and keeps its data
+ * consistent with irq_save() sections. Those now also take one kernel
+ * lock, so they stay exclusive across CPUs; tasks run in parallel
+ * outside them. A task switched out inside one hands the lock on with
+ * the CPU, and takes it back when it is resumed (task_finish_switch()).
+ */
+
+#define SMP_MAX_CPUS          APIC_MAX_CPUS
+#define SMP_TRAMPOLINE        0x8000    // Physical; below 1MB for the startup IPI
+#define SMP_RESCHEDULE_VECTOR 0xFD
+#define SMP_TLB_VECTOR        0xFC
+
+typedef struct cpu {
+    uint32_t id;                    // Index into cpus[], 0 for the boot CPU
+    uint32_t apic_id;
+    volatile int online;
+    task_t *current;
+    task_t *prev;                   // Switched away from, until it is off our stack
+    struct address_space *space;    // Loaded in CR3 (paging.c)
+    run_queue_t rq;
+    volatile int need_switch;
+    uint32_t lock_depth;            // kernel_lock() nesting of the running task
+    volatile uint32_t tlb_requested;    // Flushes asked for by other CPUs
+    volatile uint32_t tlb_done;         // ...and the last one carried out
+    uint32_t switches;
+    uint32_t steals;                // Tasks pulled over from other CPUs
+    uint32_t ipis;                  // Reschedule IPIs received
+} cpu_t;
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+
+// Every stack a CPU runs on (the boot stack, task stacks, AP boot
+// stacks) is TASK_STACK_SIZE aligned, and its lowest word names the CPU
+// running on it: the scheduler writes it each time it resumes a task.
+static inline cpu_t *this_cpu(void) {
+    uint32_t esp;
+    asm volatile("mov %%esp, %0" : "=r"(esp));
+    return *(cpu_t **)(esp & ~(TASK_STACK_SIZE - 1));
+}
+
+static inline uint32_t smp_cpu_id(void) {
+    return this_cpu()->id;
+}
+
+static inline void smp_set_stack_cpu(uint32_t stack_ptr, cpu_t *cpu) {
+    *(cpu_t **)(stack_ptr & ~(TASK_STACK_SIZE - 1)) = cpu;
+}
+
+// Start the other CPUs; after apic_init(), task_init() and the boot
+// CPU's idle task, with interrupts on
+void smp_init(void);
+uint32_t smp_cpu_count(void);       // Online, the boot CPU included
+int smp_active(void);               // Other CPUs have been started
+
+// Have another CPU run task_schedule(); set its need_switch first to
+// force a switch, otherwise it only leaves hlt
+void smp_send_reschedule(uint32_t cpu);
+
+// Make the CPUs in mask drop their cached translations, and wait until
+// they have. Called by paging.c whenever it flushes its own.
+void smp_tlb_shootdown(uint32_t mask);
+uint32_t smp_online_mask(void);
+
+// Move the kernel lock with the CPU on a task switch: release it if only
+// prev held it, take it if only next did
+void kernel_lock_switch(uint32_t prev_depth, uint32_t next_depth);
+
+void smp_print_info(void);
+
+#endif
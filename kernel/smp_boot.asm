@@ -0,0 +1,80 @@
+; Application processor startup
+;
+; smp_init() copies the trampoline to SMP_TRAMPOLINE (0x8000) and sends
+; each AP a startup IPI for that page. The AP starts there in real mode
+; at 0800:0000, loads smp_gdt (same selectors as the boot CPU: 0x08
+; code, 0x10 data) and jumps straight into the kernel image, which sits
+; at its physical address. There it turns paging on with the boot CPU's
+; CR0/CR3/CR4 and calls ap_main(cpu) on the stack smp_init() set up.
+
+SMP_TRAMPOLINE equ 0x8000
+
+[EXTERN ap_main]
+[GLOBAL smp_trampoline_start]
+[GLOBAL smp_trampoline_end]
+[GLOBAL smp_boot_cr0]
+[GLOBAL smp_boot_cr3]
+[GLOBAL smp_boot_cr4]
+[GLOBAL smp_boot_stack]
+[GLOBAL smp_boot_cpu]
+
+SECTION .text
+
+; Copied to SMP_TRAMPOLINE; addresses inside it are taken relative to there
+BITS 16
+smp_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [SMP_TRAMPOLINE + (trampoline_gdt_ptr - smp_trampoline_start)]
+    mov eax, cr0
+    or eax, 1                ; PE
+    mov cr0, eax
+    jmp dword 0x08:ap_start32
+
+align 4
+trampoline_gdt_ptr:
+    dw smp_gdt_end - smp_gdt - 1
+    dd smp_gdt
+smp_trampoline_end:
+
+BITS 32
+ap_start32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [smp_boot_cr4]  ; PSE before the 4MB kernel PDEs are used
+    mov cr4, eax
+    mov eax, [smp_boot_cr3]
+    mov cr3, eax
+    mov eax, [smp_boot_cr0]  ; PG, plus whatever else the boot CPU set
+    mov cr0, eax
+
+    mov esp, [smp_boot_stack]
+    push dword [smp_boot_cpu]
+    call ap_main             ; void ap_main(cpu_t *cpu), never returns
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+SECTION .data
+align 8
+smp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF    ; 0x08: code, base 0, 4GB, 32-bit
+    dq 0x00CF92000000FFFF    ; 0x10: data, base 0, 4GB
+smp_gdt_end:
+
+; Filled in by smp_init() before each startup IPI
+smp_boot_cr0:   dd 0
+smp_boot_cr3:   dd 0
+smp_boot_cr4:   dd 0
+smp_boot_stack: dd 0
+smp_boot_cpu:   dd 0
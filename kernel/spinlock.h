@@ -0,0 +1,42 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+// Test-and-test-and-set lock. Taken with interrupts off: an interrupt
+// handler spinning on a lock its own CPU holds would never get it.
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void cpu_relax(void) {
+    asm volatile("pause" : : : "memory");
+}
+
+static inline int spin_trylock(spinlock_t *lock) {
+    uint32_t old = 1;
+    asm volatile("xchg %0, %1" : "+r"(old), "+m"(lock->locked) : : "memory");
+    return old == 0;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    while (!spin_trylock(lock)) {
+        while (lock->locked) {
+            cpu_relax();
+        }
+    }
+}
+
+// Plain store: x86 never moves it ahead of the stores it follows
+static inline void spin_unlock(spinlock_t *lock) {
+    asm volatile("" : : : "memory");
+    lock->locked = 0;
+}
+
+static inline int spin_is_locked(spinlock_t *lock) {
+    return lock->locked != 0;
+}
+
+#endif
@@ -47,4 +47,59 @@ void itoa(int num, char* str, int base) {
         start++;
         end--;
     }
+}
+
+void utoa(uint32_t num, char* str, int base) {
+    int i = 0;
+
+    do {
+        uint32_t digit = num % base;
+        str[i++] = (digit < 10) ? ('0' + digit) : ('a' + digit - 10);
+        num /= base;
+    } while (num > 0);
+
+    str[i] = 0;
+
+    // Reverse the string
+    int start = 0;
+    int end = i - 1;
+    while (start < end) {
+        char temp = str[start];
+        str[start] = str[end];
+        str[end] = temp;
+        start++;
+        end--;
+    }
+}
+
+void memset32(void* dest, uint32_t value, uint32_t count) {
+    asm volatile("rep stosl"
+                 : "+D"(dest), "+c"(count)
+                 : "a"(value)
+                 : "memory");
+}
+
+// Copy `count` dwords (page copies)
+void memcpy32(void* dest, const void* src, uint32_t count) {
+    asm volatile("rep movsl"
+                 : "+D"(dest), "+S"(src), "+c"(count)
+                 :
+                 : "memory");
+}
+
+void* memset(void* dest, int value, uint32_t count) {
+    uint8_t *d = (uint8_t *)dest;
+    for (uint32_t i = 0; i < count; i++) {
+        d[i] = (uint8_t)value;
+    }
+    return dest;
+}
+
+void* memcpy(void* dest, const void* src, uint32_t count) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+    for (uint32_t i = 0; i < count; i++) {
+        d[i] = s[i];
+    }
+    return dest;
 }
\ No newline at end of file
@@ -1,7 +1,14 @@
 #ifndef STRING_H
 #define STRING_H
 
+#include <stdint.h>
+
 int strcmp(const char*a, const char* b);
 void itoa(int num, char* str, int base);
+void utoa(uint32_t num, char* str, int base);
+void memset32(void* dest, uint32_t value, uint32_t count);
+void* memset(void* dest, int value, uint32_t count);
+void* memcpy(void* dest, const void* src, uint32_t count);
+void memcpy32(void* dest, const void* src, uint32_t count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,341 @@
+/*
+ * Swapping anonymous pages to the ATA disk
+ *
+ * Reclaim is a CLOCK scan over virtual addresses: the hand walks every
+ * region of every address space in turn. A page the CPU has marked
+ * accessed since the last visit gets its bit cleared and a second
+ * chance; one that is still clear is written to a free slot and freed.
+ * Pages shared with a fork (or the zero page) are left alone, as are
+ * shared mappings, which have no single PTE to point at the slot.
+ *
+ * Slots go straight to ata_write_sector() rather than through the block
+ * cache; four evicted pages would be enough to push out everything else
+ * it holds.
+ */
+
+#include "swap.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "ata.h"
+#include "vga.h"
+#include "string.h"
+#include "cpu.h"
+#include "task.h"
+#include <stddef.h>
+
+#define SWAP_NO_SLOT 0xFFFFFFFF
+
+static uint16_t slot_refs[SWAP_SLOTS];  // Mappings per slot, 0 = free
+static uint32_t slot_count;             // Slots that fit on the disk
+static uint32_t slots_used;
+static uint32_t slot_hint;              // Where the next free-slot search starts
+static swap_stats_t stats;
+
+// The clock hand: the space being scanned and the address it got to
+static address_space_t *hand_space;
+static uint32_t hand_addr;
+
+// Pages the clock could still write out: bounded by the free slots
+static uint32_t swap_shrink_count(void) {
+    return slot_count - slots_used;
+}
+
+static shrinker_t swap_shrinker = {
+    .name = "swap",
+    .cost = SHRINK_COST_IO,
+    .count = swap_shrink_count,
+    .scan = swap_reclaim,
+};
+
+void swap_init(void) {
+    vga_print("[*] Initializing swap...\n");
+
+    uint32_t sectors = ata_get_sector_count();
+    if (sectors > SWAP_START_LBA) {
+        slot_count = (sectors - SWAP_START_LBA) / SWAP_SECTORS_PER_PAGE;
+        if (slot_count > SWAP_SLOTS) slot_count = SWAP_SLOTS;
+    }
+    if (slot_count == 0) {
+        vga_print("[!] No disk for swap, pages stay resident\n");
+        return;
+    }
+
+    pmm_register_shrinker(&swap_shrinker);
+
+    char buf[16];
+    vga_print("[+] Swap: ");
+    utoa(slot_count * (PAGE_SIZE / 1024), buf, 10);
+    vga_print(buf);
+    vga_print("KB at LBA ");
+    utoa(SWAP_START_LBA, buf, 10);
+    vga_print(buf);
+    vga_print("\n");
+}
+
+int swap_enabled(void) {
+    return slot_count != 0;
+}
+
+/* ====== Slots ====== */
+
+static uint32_t slot_alloc(void) {
+    for (uint32_t i = 0; i < slot_count; i++) {
+        uint32_t slot = (slot_hint + i) % slot_count;
+        if (slot_refs[slot] == 0) {
+            slot_refs[slot] = 1;
+            slots_used++;
+            slot_hint = slot + 1;
+            return slot;
+        }
+    }
+    return SWAP_NO_SLOT;
+}
+
+void swap_dup(pte_t entry) {
+    slot_refs[SWAP_SLOT(entry)]++;
+}
+
+void swap_put(pte_t entry) {
+    uint32_t slot = SWAP_SLOT(entry);
+    if (slot >= slot_count || slot_refs[slot] == 0) return;
+
+    if (--slot_refs[slot] == 0) {
+        slots_used--;
+    }
+}
+
+/* ====== Disk I/O ====== */
+
+static int slot_write(uint32_t slot, const uint8_t *buf) {
+    uint32_t lba = SWAP_START_LBA + slot * SWAP_SECTORS_PER_PAGE;
+    for (uint32_t i = 0; i < SWAP_SECTORS_PER_PAGE; i++) {
+        if (ata_write_sector(lba + i, buf + i * ATA_SECTOR_SIZE) != 0) return -1;
+    }
+    return 0;
+}
+
+static int slot_read(uint32_t slot, uint8_t *buf) {
+    uint32_t lba = SWAP_START_LBA + slot * SWAP_SECTORS_PER_PAGE;
+    for (uint32_t i = 0; i < SWAP_SECTORS_PER_PAGE; i++) {
+        if (ata_read_sector(lba + i, buf + i * ATA_SECTOR_SIZE) != 0) return -1;
+    }
+    return 0;
+}
+
+int swap_read_page(pte_t entry, void *virt) {
+    if (slot_read(SWAP_SLOT(entry), virt) != 0) {
+        stats.read_errors++;
+        return -1;
+    }
+    swap_put(entry);
+    stats.swap_ins++;
+    return 0;
+}
+
+/* ====== Reclaim ====== */
+
+// Write one resident page of the current space out and free it. The
+// page is read-only while it is written, or a write from another CPU
+// could land after the copy on disk was taken.
+static int swap_out_page(uint32_t virt, pte_t pte) {
+    uint32_t slot = slot_alloc();
+    if (slot == SWAP_NO_SLOT) return -1;
+
+    paging_write_protect(virt);
+    if (slot_write(slot, (const uint8_t *)virt) != 0) {
+        stats.write_errors++;
+        swap_put(SWAP_ENTRY(slot));
+        page_map(virt, pte & PAGE_MASK, pte & (PTE_WRITE | PTE_USER));
+        return -1;
+    }
+    paging_set_swap_entry(virt, SWAP_ENTRY(slot));
+    pmm_page_unref(pte & PAGE_MASK);
+    stats.swap_outs++;
+    return 0;
+}
+
+// Advance the hand through as, evicting up to target pages. Leaves
+// hand_addr where to resume, or 0 once the whole space has been seen.
+static uint32_t clock_scan(address_space_t *as, uint32_t target) {
+    uint32_t freed = 0;
+    paging_switch(as);
+
+    for (vm_area_t *vma = as->vmas; vma; vma = vma->next) {
+        if (vma->end <= hand_addr || (vma->flags & VM_SHARED)) continue;
+
+        uint32_t addr = vma->start > hand_addr ? vma->start : hand_addr;
+        for (; addr < vma->end; addr += PAGE_SIZE) {
+            pte_t pte = paging_get_pte(addr);
+            if (!(pte & PTE_PRESENT)) continue;
+            stats.scanned++;
+
+            // Used since the last pass: clear the bit, look again next time
+            if (pte & PTE_ACCESSED) {
+                stats.referenced++;
+                paging_clear_accessed(addr);
+                continue;
+            }
+            if (pmm_page_refcount(pte & PAGE_MASK) != 1) continue;
+
+            if (swap_out_page(addr, pte) == 0 && ++freed == target) {
+                hand_addr = addr + PAGE_SIZE;
+                return freed;
+            }
+        }
+    }
+
+    hand_addr = 0;
+    return freed;
+}
+
+uint32_t swap_reclaim(uint32_t target) {
+    if (!slot_count || target == 0) return 0;
+
+    // The scan holds page table and VMA pointers across the writes, so
+    // it must not sleep waiting for another task's disk command
+    uint32_t irq_flags = irq_save();
+    if (!ata_idle()) {
+        irq_restore(irq_flags);
+        return 0;
+    }
+    address_space_t *prev = paging_current_space();
+    address_space_t *first = paging_kernel_space()->next;
+
+    // Pick the hand up where it was, if that space still exists
+    uint32_t spaces = 0;
+    address_space_t *as = NULL;
+    for (address_space_t *s = first; s; s = s->next) {
+        if (s == hand_space) as = s;
+        spaces++;
+    }
+    if (!as) hand_addr = 0;
+
+    // Up to two trips round: the first may only clear accessed bits
+    uint32_t freed = 0;
+    for (uint32_t visits = 0; visits <= 2 * spaces && freed < target; visits++) {
+        if (!as) {
+            as = first;
+            if (!as) break;
+        }
+        freed += clock_scan(as, target - freed);
+        if (hand_addr == 0) {
+            as = as->next;
+        }
+    }
+    hand_space = as;
+
+    paging_switch(prev);
+    irq_restore(irq_flags);
+    return freed;
+}
+
+/* ====== Info ====== */
+
+void swap_get_stats(swap_stats_t *out) {
+    *out = stats;
+}
+
+uint32_t swap_slots_used(void) {
+    return slots_used;
+}
+
+uint32_t swap_slots_total(void) {
+    return slot_count;
+}
+
+static void print_stat(const char *label, uint32_t value) {
+    char buf[16];
+    vga_print(label);
+    utoa(value, buf, 10);
+    vga_print(buf);
+    vga_print("\n");
+}
+
+void swap_print_info(void) {
+    if (!slot_count) {
+        vga_print("Swap: disabled (no disk)\n");
+        return;
+    }
+    vga_print("Swap Information:\n");
+    print_stat("  Slots used:     ", slots_used);
+    print_stat("  Slots total:    ", slot_count);
+    print_stat("  Swap-outs:      ", stats.swap_outs);
+    print_stat("  Swap-ins:       ", stats.swap_ins);
+    print_stat("  Pages scanned:  ", stats.scanned);
+    print_stat("  Second chances: ", stats.referenced);
+    if (stats.write_errors || stats.read_errors) {
+        print_stat("  Write errors:   ", stats.write_errors);
+        print_stat("  Read errors:    ", stats.read_errors);
+    }
+}
+
+// Fill a scratch region, push it out to disk with the clock, then read
+// it back through major faults and check nothing was lost
+void swap_demo(void) {
+    const uint32_t base = TASK_HEAP_BASE;
+    const uint32_t pages = 32;
+    char buf[16];
+
+    if (!slot_count) {
+        vga_print("Swap is disabled (no disk)\n");
+        return;
+    }
+
+    address_space_t *as = paging_space_create();
+    if (!as || vmm_reserve(as, base, pages * PAGE_SIZE, VM_READ | VM_WRITE) != 0) {
+        vga_print("ERROR: could not set up a scratch address space\n");
+        if (as) paging_space_destroy(as);
+        return;
+    }
+
+    // Same rule as swap_reclaim(): the scan and the faults below run in
+    // another space and must not sleep for the disk. Checked once, the
+    // drive stays ours until irq_restore().
+    uint32_t flags = irq_save();
+    if (!ata_idle()) {
+        irq_restore(flags);
+        vga_print("Disk busy, try again\n");
+        vmm_release_all(as);
+        paging_space_destroy(as);
+        return;
+    }
+    address_space_t *prev = paging_current_space();
+    swap_stats_t before = stats;
+
+    paging_switch(as);
+    for (uint32_t i = 0; i < pages; i++) {
+        *(volatile uint32_t *)(base + i * PAGE_SIZE) = 0xC0DE0000 | i;
+    }
+    uint32_t free_before = pmm_get_free_pages();
+
+    // Only this space: first pass clears the accessed bits, second evicts
+    hand_addr = 0;
+    uint32_t evicted = clock_scan(as, pages);
+    hand_addr = 0;
+    evicted += clock_scan(as, pages);
+    uint32_t freed = pmm_get_free_pages() - free_before;
+
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (*(volatile uint32_t *)(base + i * PAGE_SIZE) != (0xC0DE0000 | i)) bad++;
+    }
+    paging_switch(prev);
+    irq_restore(flags);
+
+    vga_print("Wrote ");
+    utoa(pages, buf, 10);
+    vga_print(buf);
+    vga_print(" pages, evicted ");
+    utoa(evicted, buf, 10);
+    vga_print(buf);
+    vga_print(" (");
+    utoa(freed, buf, 10);
+    vga_print(buf);
+    vga_print(" pages freed), read back ");
+    utoa(stats.swap_ins - before.swap_ins, buf, 10);
+    vga_print(buf);
+    vga_print(bad ? ": DATA MISMATCH\n" : ": contents intact\n");
+
+    vmm_release_all(as);
+    paging_space_destroy(as);
+}
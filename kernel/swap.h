@@ -0,0 +1,54 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+#include "paging.h"
+
+/*
+ * Swap area
+ *
+ * A fixed range of the ATA disk holds evicted anonymous pages, one page
+ * per slot. An evicted page leaves a not-present PTE with PTE_SWAPPED
+ * set and the slot number in bits 12-31; the next access faults it back.
+ */
+
+#define SWAP_START_LBA      2048        // Leave the first 1MB of the disk alone
+#define SWAP_SLOTS          1024        // 4MB of swap
+#define SWAP_SECTORS_PER_PAGE (PAGE_SIZE / 512)
+
+#define SWAP_ENTRY(slot)    (((slot) << 12) | PTE_SWAPPED)
+#define SWAP_SLOT(entry)    ((entry) >> 12)
+
+typedef struct {
+    uint32_t swap_outs;         // Pages written to disk and freed
+    uint32_t swap_ins;          // Pages read back on a fault
+    uint32_t scanned;           // Resident pages looked at by the clock hand
+    uint32_t referenced;        // ...that had been used since the last pass
+    uint32_t write_errors;
+    uint32_t read_errors;
+} swap_stats_t;
+
+// Needs the ATA driver up (after block_init)
+void swap_init(void);
+int swap_enabled(void);
+
+// Evict up to target cold anonymous pages; returns how many were freed
+uint32_t swap_reclaim(uint32_t target);
+
+// Read the page named by entry into virt (mapped writable), then drop
+// this mapping's reference on the slot. 0 on success.
+int swap_read_page(pte_t entry, void *virt);
+
+// Reference counting for entries copied or dropped with a mapping
+void swap_dup(pte_t entry);
+void swap_put(pte_t entry);
+
+void swap_get_stats(swap_stats_t *out);
+uint32_t swap_slots_used(void);
+uint32_t swap_slots_total(void);
+
+// Shell command and demo
+void swap_print_info(void);
+void swap_demo(void);
+
+#endif
@@ -5,6 +5,9 @@
 #include "string.h"
 #include "fd.h"
 #include "block.h"
+#include "vmm.h"
+#include "timer.h"
+#include "clock.h"
 #include <stddef.h>
 
 extern uint32_t syscall_write(const char *msg, uint32_t len);
@@ -33,8 +36,9 @@ uint32_t syscall_write(const char *msg, uint32_t len) {
     return fd_write(table, STDOUT_FILENO, msg, len);
 }
 
+// Parked on the timer wheel, off the run queue, until the time is up
 uint32_t syscall_sleep(uint32_t milliseconds) {
-    (void)milliseconds;
+    timer_sleep(milliseconds);
     return 0;
 }
 
@@ -44,17 +48,9 @@ uint32_t syscall_yield(void) {
 }
 
 uint32_t syscall_exit(uint32_t exit_code) {
-    task_t *current = task_get_current();
-    if (current) {
-        /* Close all file descriptors */
-        if (current->fd_table) {
-            fd_table_close_all(current->fd_table);
-        }
-        current->state = TASK_DEAD;
+    if (task_get_current()) {
+        task_exit((int)exit_code);      // Closes its descriptors, never returns
     }
-    
-    (void)exit_code;
-    
     return 0;
 }
 
@@ -74,13 +70,13 @@ uint32_t syscall_getppid(void) {
     return 0;
 }
 
-uint32_t syscall_fork(void) {
-    task_t *child = task_fork();
-    if (child == NULL)
+uint32_t syscall_fork(uint32_t entry) {
+    int child_id = task_fork((void (*)(void))entry);
+    if (child_id < 0)
     {
         return 0xFFFFFFFF;
     }
-    return child->id;
+    return child_id;
 }
 
 
@@ -155,6 +151,39 @@ uint32_t syscall_block_flush(void) {
     block_flush();
     return 0;
 }
+
+/* Memory */
+uint32_t syscall_mmap(uint32_t addr, uint32_t len, uint32_t prot_flags) {
+    // Exactly one of private and shared
+    if (!(prot_flags & MAP_SHARED) == !(prot_flags & MAP_PRIVATE)) {
+        return (uint32_t)MAP_FAILED;
+    }
+
+    uint32_t flags = VM_USER;
+    if (prot_flags & PROT_READ) flags |= VM_READ;
+    if (prot_flags & PROT_WRITE) flags |= VM_WRITE;
+    if (prot_flags & MAP_SHARED) flags |= VM_SHARED;
+
+    uint32_t result = vmm_mmap(paging_current_space(), addr, len, flags,
+                               (prot_flags & MAP_FIXED) != 0);
+    return result ? result : (uint32_t)MAP_FAILED;
+}
+
+uint32_t syscall_munmap(uint32_t addr, uint32_t len) {
+    return vmm_unmap(paging_current_space(), addr, len);
+}
+
+uint32_t syscall_brk(uint32_t addr) {
+    return vmm_brk(paging_current_space(), addr);
+}
+
+/* Time */
+uint32_t syscall_clock_gettime(uint32_t clock_id, timespec_t *ts) {
+    if (clock_id != CLOCK_MONOTONIC || !ts) return -1;
+    ktime_to_timespec(ktime_ns(), ts);
+    return 0;
+}
+
 uint32_t syscall_dispatch(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
     switch (syscall_num) {
         /* Day 8: Basic syscalls */
@@ -175,7 +204,7 @@ uint32_t syscall_dispatch(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, ui
         
         /* Day 9: Process management */
         case SYSCALL_FORK:
-            return syscall_fork();
+            return syscall_fork(arg1);
 
         case SYSCALL_EXEC:
             return syscall_exec((const char *)arg1, arg2);
@@ -224,13 +253,34 @@ uint32_t syscall_dispatch(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, ui
         case SYSCALL_BLOCK_FLUSH:
             return syscall_block_flush();
         
+        /* Memory */
+        case SYSCALL_MMAP:
+            return syscall_mmap(arg1, arg2, arg3);
+
+        case SYSCALL_MUNMAP:
+            return syscall_munmap(arg1, arg2);
+
+        case SYSCALL_BRK:
+            return syscall_brk(arg1);
+
+        /* Time */
+        case SYSCALL_CLOCK_GETTIME:
+            return syscall_clock_gettime(arg1, (timespec_t *)arg2);
+
         default:
             return syscall_invalid();
     }
 }
 
-uint32_t int_80_handler(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
-    return syscall_dispatch(syscall_num, arg1, arg2, arg3);
+// Returns the frame to resume: the caller's, unless the call gave up the CPU
+interrupt_frame_t *int_80_handler(interrupt_frame_t *frame) {
+    if (task_get_current()) {
+        task_save_frame(frame);
+    }
+    uint32_t flags = irq_save();
+    frame->eax = syscall_dispatch(frame->eax, frame->ebx, frame->ecx, frame->edx);
+    irq_restore(flags);
+    return task_schedule(frame);
 }
 extern void int_80_wrapper(void);
 
@@ -2,6 +2,7 @@
 #define SYSCALL_H
 
 #include <stdint.h>
+#include "clock.h"
 
 /* Day 8: Basic syscalls */
 #define SYSCALL_WRITE   0
@@ -32,7 +33,23 @@
 #define SYSCALL_BLOCK_WRITE  19
 #define SYSCALL_BLOCK_FLUSH  20
 
-#define SYSCALL_MAX     21
+/* Memory */
+#define SYSCALL_MMAP         21
+#define SYSCALL_MUNMAP       22
+#define SYSCALL_BRK          23
+
+/* Time */
+#define SYSCALL_CLOCK_GETTIME 24
+
+#define SYSCALL_MAX     25
+
+/* mmap() protection and flags, OR'd into its third argument */
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define MAP_SHARED    0x100
+#define MAP_PRIVATE   0x200
+#define MAP_FIXED     0x400     /* Use addr exactly, replacing any mapping */
+#define MAP_FAILED    ((void *)0xFFFFFFFF)
 
 void syscall_init(void);
 
@@ -72,6 +89,8 @@ static inline void sys_yield(void) {
     asm volatile(
         "int $0x80"
         : "+r"(eax)
+        :
+        : "memory"
     );
 }
 
@@ -99,10 +118,11 @@ static inline uint32_t sys_getpid(void) {
     return eax;
 }
 
-static inline int sys_fork(void) {
+static inline int sys_fork(void (*entry)(void)) {
     register uint32_t eax asm("eax") = SYSCALL_FORK;
+    register uint32_t ebx asm("ebx") = (uint32_t)entry;
 
-    asm volatile("int $0x80" : "+r"(eax));
+    asm volatile("int $0x80" : "+r"(eax) : "r"(ebx));
 
     return (int)eax;
 }
@@ -259,4 +279,47 @@ static inline void sys_block_flush(void) {
     asm volatile("int $0x80" : "+r"(eax));
 }
 
+/* Memory: anonymous mappings only, so no fd/offset arguments */
+static inline void *sys_mmap(void *addr, uint32_t len, uint32_t prot_flags) {
+    register uint32_t eax asm("eax") = SYSCALL_MMAP;
+    register uint32_t ebx asm("ebx") = (uint32_t)addr;
+    register uint32_t ecx asm("ecx") = len;
+    register uint32_t edx asm("edx") = prot_flags;
+
+    asm volatile("int $0x80" : "+r"(eax) : "r"(ebx), "r"(ecx), "r"(edx) : "memory");
+
+    return (void *)eax;
+}
+
+static inline int sys_munmap(void *addr, uint32_t len) {
+    register uint32_t eax asm("eax") = SYSCALL_MUNMAP;
+    register uint32_t ebx asm("ebx") = (uint32_t)addr;
+    register uint32_t ecx asm("ecx") = len;
+
+    asm volatile("int $0x80" : "+r"(eax) : "r"(ebx), "r"(ecx) : "memory");
+
+    return (int)eax;
+}
+
+/* Returns the new break; brk(0) just reports the current one */
+static inline void *sys_brk(void *addr) {
+    register uint32_t eax asm("eax") = SYSCALL_BRK;
+    register uint32_t ebx asm("ebx") = (uint32_t)addr;
+
+    asm volatile("int $0x80" : "+r"(eax) : "r"(ebx) : "memory");
+
+    return (void *)eax;
+}
+
+/* Monotonic time since boot, nanosecond resolution; 0 on success */
+static inline int sys_clock_gettime(uint32_t clock_id, timespec_t *ts) {
+    register uint32_t eax asm("eax") = SYSCALL_CLOCK_GETTIME;
+    register uint32_t ebx asm("ebx") = clock_id;
+    register uint32_t ecx asm("ecx") = (uint32_t)ts;
+
+    asm volatile("int $0x80" : "+r"(eax) : "r"(ebx), "r"(ecx) : "memory");
+
+    return (int)eax;
+}
+
 #endif
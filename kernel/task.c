@@ -4,36 +4,276 @@
 #include "pmm.h"
 #include "paging.h"
 #include "fd.h"
+#include "kmalloc.h"
+#include "vmm.h"
+#include "syscall.h"
+#include "cpu.h"
+#include "timer.h"
+#include "wait.h"
 #include <stddef.h>
 
-// Global task array
-task_t tasks[TASK_MAX];
+// Tasks are allocated on demand and kept on a circular list in creation order
+static kmem_cache_t *task_cache;
+static task_t *task_list = NULL;
 static int task_count = 0;
 static int current_task_id = 0;
-task_t *current_task = NULL;
 
-/* Per-task file descriptor tables (static allocation for simplicity) */
-static fd_table_t task_fd_tables[TASK_MAX];
+static void task_list_add(task_t *task);
 
 void task_init(void) {
     vga_print("[*] Initializing task manager...\n");
     
-    for (int i = 0; i < TASK_MAX; i++) {
-        tasks[i].id = 0;
-        tasks[i].state = TASK_DEAD;
-        tasks[i].next = NULL;
-        tasks[i].prev = NULL;
-        tasks[i].fd_table = NULL;
+    task_cache = kmem_cache_create("task", sizeof(task_t), 0);
+
+    // Whatever is running now is a task too, on the boot stack and in the
+    // kernel's address space; its frame is saved the first time it is
+    // switched away from
+    task_t *boot = kmem_cache_zalloc(task_cache);
+    if (boot) {
+        boot->id = ++current_task_id;
+        boot->state = TASK_RUNNING;
+        boot->base_prio = boot->prio = TASK_PRIO_DEFAULT;
+        boot->slice = TASK_SLICE_TICKS;
+        boot->on_cpu = 1;
+        boot->space = paging_current_space();
+        boot->context.cr3 = boot->space->dir_phys;
+        task_list_add(boot);
+        task_count++;
+        current_task = boot;
     }
     
     vga_print("[+] Task manager initialized\n");
 }
 
+task_t *task_init_cpu(void) {
+    cpu_t *cpu = this_cpu();
+    task_t *idle = kmem_cache_zalloc(task_cache);
+    if (idle == NULL) return NULL;
+
+    // An empty user half of its own, so flushes of the shell's mappings
+    // in the kernel space need not reach this CPU
+    idle->space = paging_space_create();
+    if (idle->space == NULL) {
+        idle->space = paging_kernel_space();
+    }
+    idle->state = TASK_RUNNING;
+    idle->base_prio = idle->prio = TASK_PRIO_IDLE;
+    idle->slice = TASK_SLICE_TICKS;
+    idle->cpu = cpu->id;
+    idle->on_cpu = cpu->id + 1;
+    idle->context.cr3 = idle->space->dir_phys;
+
+    uint32_t flags = irq_save();
+    idle->id = ++current_task_id;
+    task_list_add(idle);
+    task_count++;
+    irq_restore(flags);
+
+    cpu->current = idle;
+    paging_switch(idle->space);
+    return idle;
+}
+
+// Heap and stack regions cost nothing until the task touches them. The
+// heap is the start of the brk() area, so the task can grow or shrink it.
+static int task_reserve_regions(task_t *task) {
+    address_space_t *as = task->space;
+    as->brk_base = as->brk = TASK_HEAP_BASE;
+    if (vmm_brk(as, TASK_HEAP_BASE + TASK_HEAP_SIZE) != TASK_HEAP_BASE + TASK_HEAP_SIZE) {
+        return -1;
+    }
+    return vmm_reserve(task->space, TASK_USTACK_TOP - TASK_USTACK_SIZE, TASK_USTACK_SIZE,
+                       VM_READ | VM_WRITE);
+}
+
+// The kernel stack has to be resident: a fault on it would have nowhere
+// to push the exception frame
+static uint32_t task_alloc_stack(void) {
+    uint32_t phys = pmm_alloc_pages_below(TASK_STACK_ORDER, DIRECT_MAP_SIZE);
+    return phys ? (uint32_t)phys_to_virt(phys) : 0;
+}
+
+// Release whatever a task owns, then the task itself
+static void task_free(task_t *task) {
+    if (task->space) {
+        vmm_release_all(task->space);
+        paging_space_destroy(task->space);
+    }
+    if (task->stack_base) {
+        pmm_free_pages(direct_virt_to_phys((void *)task->stack_base), TASK_STACK_ORDER);
+    }
+    if (task->fd_table) {
+        fd_table_destroy(task->fd_table);
+    }
+    kmem_cache_free(task_cache, task);
+}
+
+/* ====== Run queues ====== */
+
+// All of these run with interrupts off and the queue's lock held
+
+static void rq_add(run_queue_t *rq, task_t *task) {
+    task_t **head = &rq->queue[task->prio];
+    if (task->prio != TASK_PRIO_IDLE) rq->stealable++;
+    if (*head == NULL) {
+        task->rq_next = task->rq_prev = task;
+        *head = task;
+        rq->bitmap |= 1u << task->prio;
+        return;
+    }
+    task_t *tail = (*head)->rq_prev;
+    tail->rq_next = task;
+    task->rq_prev = tail;
+    task->rq_next = *head;
+    (*head)->rq_prev = task;
+}
+
+static void rq_remove(run_queue_t *rq, task_t *task) {
+    task_t **head = &rq->queue[task->prio];
+    if (task->prio != TASK_PRIO_IDLE) rq->stealable--;
+    if (task->rq_next == task) {
+        *head = NULL;
+        rq->bitmap &= ~(1u << task->prio);
+    } else {
+        task->rq_prev->rq_next = task->rq_next;
+        task->rq_next->rq_prev = task->rq_prev;
+        if (*head == task) *head = task->rq_next;
+    }
+    task->rq_next = task->rq_prev = NULL;
+}
+
+static task_t *rq_pick(run_queue_t *rq) {
+    if (rq->bitmap == 0) return NULL;
+    task_t *task = rq->queue[bit_scan_forward(rq->bitmap)];
+    rq_remove(rq, task);
+    return task;
+}
+
+// For another CPU: the task that would wait longest among the best
+// queued, the tail of the highest-priority queue. Idle tasks stay put,
+// and so does one its old CPU has not finished switching away from.
+static task_t *rq_steal(run_queue_t *rq) {
+    uint32_t bits = rq->bitmap & ~(1u << TASK_PRIO_IDLE);
+    while (bits) {
+        task_t *tail = rq->queue[bit_scan_forward(bits)]->rq_prev;
+        task_t *task = tail;
+        do {
+            if (!task->on_cpu) {
+                rq_remove(rq, task);
+                return task;
+            }
+            task = task->rq_prev;
+        } while (task != tail);
+        bits &= bits - 1;
+    }
+    return NULL;
+}
+
+static run_queue_t *task_rq(task_t *task) {
+    return &cpus[task->cpu].rq;
+}
+
+// Wake a CPU sitting in its idle task so it steals work
+static void kick_idle_cpu(void) {
+    cpu_t *self = this_cpu();
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (cpu == self || !cpu->online || cpu->current == NULL) continue;
+        if (cpu->current->prio == TASK_PRIO_IDLE && cpu->rq.stealable == 0) {
+            smp_send_reschedule(i);
+            return;
+        }
+    }
+}
+
+// Put a task that became READY on the queue of the CPU it last ran on,
+// preempting the task running there if it is now outranked. If it has
+// to wait behind that one, an idle CPU is woken to take it instead.
+static void task_make_ready(task_t *task) {
+    cpu_t *cpu = &cpus[task->cpu];
+    spin_lock(&cpu->rq.lock);
+    task->state = TASK_READY;
+    rq_add(&cpu->rq, task);
+    spin_unlock(&cpu->rq.lock);
+
+    task_t *running = cpu->current;
+    if (running && task->prio < running->prio) {
+        cpu->need_switch = 1;
+        if (cpu != this_cpu()) smp_send_reschedule(cpu->id);
+    } else if (smp_active()) {
+        kick_idle_cpu();
+    }
+}
+
+static void prio_adjust(task_t *task, int delta) {
+    if (task->base_prio == TASK_PRIO_IDLE) return;
+
+    int prio = (int)task->prio + delta;
+    int lo = (int)task->base_prio - TASK_PRIO_BONUS;
+    int hi = (int)task->base_prio + TASK_PRIO_BONUS;
+    if (lo < 0) lo = 0;
+    if (hi > TASK_PRIO_IDLE - 1) hi = TASK_PRIO_IDLE - 1;
+    if (prio < lo) prio = lo;
+    if (prio > hi) prio = hi;
+    task->prio = (uint32_t)prio;
+}
+
+void task_set_priority(task_t *task, uint32_t prio) {
+    if (prio >= TASK_PRIO_LEVELS) prio = TASK_PRIO_LEVELS - 1;
+
+    uint32_t flags = irq_save();
+    run_queue_t *rq = task_rq(task);
+    spin_lock(&rq->lock);
+    int queued = task->state == TASK_READY;
+    if (queued) rq_remove(rq, task);
+    task->base_prio = task->prio = prio;
+    if (queued) rq_add(rq, task);
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+// A task that returns from its entry function lands here
+static void task_entry_return(void) {
+    task_exit(0);
+}
+
+// Lay out the frame a new task is first resumed from at the top of its
+// stack, as if it had been interrupted just before its first instruction
+static void task_build_frame(task_t *task, void (*entry)(void)) {
+    uint32_t *top = (uint32_t *)(task->stack_base + TASK_STACK_SIZE);
+    *--top = (uint32_t)task_entry_return;   // Return address for entry
+
+    interrupt_frame_t *frame = (interrupt_frame_t *)top - 1;
+    memset(frame, 0, sizeof(*frame));
+    frame->ds = 0x10;
+    frame->eip = (uint32_t)entry;
+    frame->cs = 0x08;
+    frame->eflags = 0x202;                  // Interrupts on
+
+    task->context.esp = (uint32_t)frame;
+}
+
+// Append to the tail of the circular task list
+static void task_list_add(task_t *task) {
+    if (task_list == NULL) {
+        task->next = task;
+        task->prev = task;
+        task_list = task;
+        return;
+    }
+    task_t *tail = task_list->prev;
+    tail->next = task;
+    task->prev = tail;
+    task->next = task_list;
+    task_list->prev = task;
+}
+
 task_t *task_create(void (*entry)(void)) {
     vga_print("[DEBUG] task_create called\n");
     
-    if (task_count >= TASK_MAX) {
-        vga_print("ERROR: Task limit reached\n");
+    task_t *task = kmem_cache_zalloc(task_cache);
+    if (task == NULL) {
+        vga_print("ERROR: Out of memory for task\n");
         return NULL;
     }
     
@@ -43,54 +283,56 @@ task_t *task_create(void (*entry)(void)) {
     vga_print(buf);
     vga_print(", creating task\n");
     
-    task_t *task = &tasks[task_count];
-    task->id = ++current_task_id;
     task->state = TASK_READY;
+    task->base_prio = task->prio = TASK_PRIO_DEFAULT;
+    task->slice = TASK_SLICE_TICKS;
     task->ppid = 0;
     task->exit_code = 0;
     task->parent = NULL;
     task->child_first = NULL;
     
-    /* Day 10: Initialize file descriptor table */
-    task->fd_table = &task_fd_tables[task_count];
-    fd_table_init(task->fd_table);
+    // Own page directory, sharing the kernel mappings
+    task->space = paging_space_create();
+    uint32_t stack_virt = task_alloc_stack();
+    task->stack_base = stack_virt;
+    if (task->space == NULL || stack_virt == 0 || task_reserve_regions(task) != 0) {
+        task_free(task);
+        vga_print("ERROR: Out of memory for task\n");
+        return NULL;
+    }
     
-    // For now, skip physical memory allocation - just use a simple virtual address
-    // In production, would use pmm_alloc_page() and page_map()
-    uint32_t stack_virt = 0x10000 + (task_count * TASK_STACK_SIZE);
+    /* Day 10: Initialize file descriptor table */
+    task->fd_table = fd_table_create();
+    if (task->fd_table == NULL) {
+        task_free(task);
+        vga_print("ERROR: Out of memory for task\n");
+        return NULL;
+    }
     
     task->stack = (uint32_t *)stack_virt;
     task->stack_base = stack_virt;
     
     // Initialize context
-    task->context.esp = stack_virt + TASK_STACK_SIZE - 4;
-    task->context.ebp = task->context.esp;
+    task_build_frame(task, entry);
     task->context.eip = (uint32_t)entry;
     task->context.eflags = 0x202;
     task->context.cs = 0x08;
+    task->context.cr3 = task->space->dir_phys;
     
-    // Initialize other registers
-    task->context.edi = 0;
-    task->context.esi = 0;
-    task->context.ebx = 0;
-    task->context.edx = 0;
-    task->context.ecx = 0;
-    task->context.eax = 0;
-    
-    // Link task into ready queue
-    if (task_count > 0) {
-        tasks[task_count - 1].next = task;
-        task->prev = &tasks[task_count - 1];
-    }
-    task->next = &tasks[0];
-    
+    // Link task into ready queue; the timer can switch to it from here on
+    uint32_t flags = irq_save();
+    task->id = ++current_task_id;
+    task->cpu = smp_cpu_id();
+    task_list_add(task);
     task_count++;
+    task_make_ready(task);
+    irq_restore(flags);
     
     vga_print("[+] Task created: ID=");
     itoa(task->id, buf, 10);
     vga_print(buf);
     vga_print(" Stack=0x");
-    itoa(stack_virt, buf, 16);
+    utoa(stack_virt, buf, 16);
     vga_print(buf);
     vga_print("\n");
     
@@ -98,34 +340,258 @@ task_t *task_create(void (*entry)(void)) {
 }
 
 void task_yield(void) {
-    // Trigger scheduler on next timer interrupt
-    // (This will be called from tasks)
+    sys_yield();
 }
 
 void task_switch(void) {
-    if (task_count == 0) return;
-    if (task_count == 1) return;  // Only one task, don't switch
-    
-    // Move to next task in round-robin
-    if (current_task == NULL) {
-        current_task = &tasks[0];
+    this_cpu()->need_switch = 1;
+}
+
+uint32_t task_get_switch_count(void) {
+    return this_cpu()->switches;
+}
+
+void task_save_frame(interrupt_frame_t *frame) {
+    task_context_t *ctx = &current_task->context;
+    ctx->eax = frame->eax;
+    ctx->ebx = frame->ebx;
+    ctx->ecx = frame->ecx;
+    ctx->edx = frame->edx;
+    ctx->esi = frame->esi;
+    ctx->edi = frame->edi;
+    ctx->ebp = frame->ebp;
+    ctx->esp = (uint32_t)frame;
+    ctx->eip = frame->eip;
+    ctx->eflags = frame->eflags;
+    ctx->cs = frame->cs;
+}
+
+void task_tick(void) {
+    cpu_t *cpu = this_cpu();
+    task_t *task = cpu->current;
+    if (task == NULL) return;
+
+    // Used a whole slice: CPU-bound, so it drifts down a level
+    if (task->slice > 0 && --task->slice == 0) {
+        task->slice = TASK_SLICE_TICKS;
+        prio_adjust(task, 1);
+        cpu->need_switch = 1;
+    }
+    // Something better became ready without asking for a switch
+    if (cpu->rq.bitmap & ((1u << task->prio) - 1)) {
+        cpu->need_switch = 1;
+    }
+}
+
+void task_block(void) {
+    // Nothing to switch to (no idle task yet): wait for an interrupt here
+    if (current_task == NULL || this_cpu()->rq.bitmap == 0) {
+        asm volatile("sti; hlt; cli" : : : "memory");
+        return;
+    }
+
+    // Gave up the CPU to wait: I/O-bound, so it drifts up a level
+    current_task->state = TASK_BLOCKED;
+    current_task->slice = TASK_SLICE_TICKS;
+    prio_adjust(current_task, -1);
+    task_yield();
+}
+
+int task_any_ready(void) {
+    return this_cpu()->rq.bitmap != 0;
+}
+
+int task_steal(void) {
+    cpu_t *self = this_cpu();
+    task_t *task = NULL;
+    uint32_t flags = irq_save();
+
+    // The CPU with the most waiting behind what it is running. One still
+    // in its idle task is about to run its queue itself.
+    cpu_t *victim = NULL;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        cpu_t *cpu = &cpus[i];
+        if (cpu == self || !cpu->online || cpu->rq.stealable == 0) continue;
+        if (cpu->current == NULL || cpu->current->prio == TASK_PRIO_IDLE) continue;
+        if (victim == NULL || cpu->rq.stealable > victim->rq.stealable) victim = cpu;
+    }
+
+    if (victim) {
+        spin_lock(&victim->rq.lock);
+        task = rq_steal(&victim->rq);
+        spin_unlock(&victim->rq.lock);
+    }
+    if (task) {
+        task->cpu = self->id;
+        spin_lock(&self->rq.lock);
+        rq_add(&self->rq, task);
+        spin_unlock(&self->rq.lock);
+        self->steals++;
+    }
+
+    irq_restore(flags);
+    return task != NULL;
+}
+
+void task_wake(task_t *task) {
+    uint32_t flags = irq_save();
+    if (task->state == TASK_BLOCKED) {
+        task_make_ready(task);
+    }
+    irq_restore(flags);
+}
+
+// Runs with interrupts off, on the interrupted task's stack. Only this
+// CPU's run queue is touched, under its lock; the kernel lock, if the
+// task switched away from holds it, goes with the CPU until
+// task_finish_switch().
+interrupt_frame_t *task_schedule(interrupt_frame_t *frame) {
+    // Whatever woke the CPU, the periodic tick comes back on
+    timer_idle_exit();
+
+    cpu_t *cpu = this_cpu();
+    if (!cpu->need_switch || cpu->current == NULL) return frame;
+    cpu->need_switch = 0;
+
+    task_t *prev = cpu->current;
+    task_save_frame(frame);
+
+    spin_lock(&cpu->rq.lock);
+
+    // Still runnable: back of its queue, behind others of its priority
+    int preempted = prev->state == TASK_RUNNING;
+    if (preempted) {
+        prev->state = TASK_READY;
+        rq_add(&cpu->rq, prev);
+    }
+
+    // The idle task is always on a queue, so something is there
+    task_t *next = rq_pick(&cpu->rq);
+    if (next) next->state = TASK_RUNNING;
+    spin_unlock(&cpu->rq.lock);
+    if (next == NULL) return frame;
+
+    if (next != prev) {
+        cpu->switches++;
+        if (preempted) {
+            prev->nivcsw++;
+        } else {
+            prev->nvcsw++;
+        }
+        prev->lock_depth = cpu->lock_depth;
+        cpu->lock_depth = next->lock_depth;
+        cpu->prev = prev;
+        cpu->current = next;
+        next->on_cpu = cpu->id + 1;
+        smp_set_stack_cpu(next->context.esp, cpu);
+        paging_switch(next->space);
+    }
+    return (interrupt_frame_t *)next->context.esp;
+}
+
+void task_finish_switch(void) {
+    cpu_t *cpu = this_cpu();
+    task_t *prev = cpu->prev;
+    if (prev == NULL) return;
+    cpu->prev = NULL;
+
+    // Read before letting go: once off, another CPU may resume prev
+    uint32_t prev_depth = prev->lock_depth;
+    asm volatile("" : : : "memory");
+    prev->on_cpu = 0;
+    kernel_lock_switch(prev_depth, cpu->lock_depth);
+}
+
+// Parents in task_wait(), woken whenever a task exits
+static wait_queue_t child_exits = WAIT_QUEUE_INIT;
+
+void task_exit(int code) {
+    uint32_t flags = irq_save();
+    if (current_task->fd_table) {
+        fd_table_close_all(current_task->fd_table);
+    }
+
+    // Nobody will wait for our children now: the idle task frees them
+    task_t *t = task_list;
+    for (int i = 0; i < task_count; i++, t = t->next) {
+        if (t->parent == current_task) {
+            t->parent = NULL;
+        }
+    }
+
+    current_task->exit_code = code;
+    current_task->state = TASK_DEAD;
+    wait_wake_all(&child_exits);
+    irq_restore(flags);
+
+    // Never picked again; the idle task or the parent frees it
+    for (;;) {
+        task_yield();
+    }
+}
+
+// Unlink a finished task and free it. Not for a task on any CPU.
+void task_destroy(task_t *task) {
+    if (task == NULL || task->on_cpu) return;
+
+    uint32_t flags = irq_save();
+    if (task->state == TASK_READY) {
+        run_queue_t *rq = task_rq(task);
+        spin_lock(&rq->lock);
+        rq_remove(rq, task);
+        spin_unlock(&rq->lock);
+    }
+
+    if (task->next == task) {
+        task_list = NULL;
     } else {
-        current_task = current_task->next;
-        if (current_task == NULL) {
-            current_task = &tasks[0];
+        task->prev->next = task->next;
+        task->next->prev = task->prev;
+        if (task_list == task) {
+            task_list = task->next;
         }
     }
-    
-    current_task->state = TASK_RUNNING;
+    task_count--;
+    irq_restore(flags);
+
+    task_free(task);
+}
+
+void task_reap(void) {
+    uint32_t flags = irq_save();
+    task_t *t = task_list;
+    for (int i = 0; i < task_count; ) {
+        task_t *next = t->next;
+        if (t->state == TASK_DEAD && t->parent == NULL && !t->on_cpu) {
+            task_destroy(t);
+        } else {
+            i++;
+        }
+        t = next;
+    }
+    irq_restore(flags);
 }
 
 task_t *task_get_current(void) {
     return current_task;
 }
 
+task_t *task_find(uint32_t id) {
+    task_t *t = task_list;
+    for (int i = 0; i < task_count; i++, t = t->next) {
+        if (t->id == id) return t;
+    }
+    return NULL;
+}
+
 task_t *get_task_ptr(int id) {
-    if (id < 0 || id >= TASK_MAX) return NULL;
-    return &tasks[id];
+    if (id < 0 || id >= task_count) return NULL;
+
+    task_t *task = task_list;
+    while (id-- > 0) {
+        task = task->next;
+    }
+    return task;
 }
 
 void task_print_info(void) {
@@ -140,16 +606,17 @@ void task_print_info(void) {
     
     // Also print how many tasks have non-zero IDs
     int real_count = 0;
-    for (int i = 0; i < TASK_MAX; i++) {
-        if (tasks[i].id != 0) real_count++;
+    task_t *t = task_list;
+    for (int i = 0; i < task_count; i++, t = t->next) {
+        if (t->id != 0) real_count++;
     }
     vga_print("  Real tasks found: ");
     itoa(real_count, buf, 10);
     vga_print(buf);
     vga_print("\n\n");
     
-    for (int i = 0; i < task_count && i < TASK_MAX; i++) {
-        task_t *t = &tasks[i];
+    t = task_list;
+    for (int i = 0; i < task_count; i++, t = t->next) {
         if (t->id == 0) break;  // Stop at empty slot
         
         vga_print("  Task ");
@@ -168,93 +635,99 @@ void task_print_info(void) {
             default: vga_print("UNKNOWN"); break;
         }
         
+        vga_print(" Prio=");
+        utoa(t->prio, buf, 10);
+        vga_print(buf);
+        vga_print(" CPU=");
+        utoa(t->cpu, buf, 10);
+        vga_print(buf);
         vga_print(" Stack=0x");
-        itoa(t->stack_base, buf, 16);
+        utoa(t->stack_base, buf, 16);
         vga_print(buf);
         vga_print(" EIP=0x");
         itoa(t->context.eip, buf, 16);
         vga_print(buf);
+        vga_print(" Faults=");
+        utoa(t->min_flt, buf, 10);
+        vga_print(buf);
+        vga_print("/");
+        utoa(t->maj_flt, buf, 10);
+        vga_print(buf);
+        vga_print(" Switches=");
+        utoa(t->nvcsw, buf, 10);
+        vga_print(buf);
+        vga_print("/");
+        utoa(t->nivcsw, buf, 10);
+        vga_print(buf);
         vga_print("\n");
     }
 }
 
 
-task_t *get_next_task(void) {
-    if (task_count == 0) return NULL;
-    if (task_count == 1) return current_task;
-
-    if(current_task == NULL) {
-        current_task = &tasks[0];
-    } else {
-        if(current_task->next != NULL) {
-            current_task =current_task->next;
-        } else {
-            current_task = &tasks[0];
-        }
-    }
-    if(current_task != NULL) {
-        current_task->state = TASK_RUNNING;
-    }
+// The child starts at entry on a fresh stack, the way task_create()
+// starts a task, rather than resuming the parent's call chain: a copy of
+// the parent's stack would hold pointers into the parent's stack.
+int task_fork(void (*entry)(void)) {
+    task_t *parent = current_task;
+    if(parent == NULL || entry == NULL) return -1;
 
-    return current_task;
-}
+    task_t *child = kmem_cache_zalloc(task_cache);
+    if (child == NULL) return -1;
 
-int task_fork(void) {
-    if (task_count >= TASK_MAX) {
+    // Same regions as the parent, pages shared copy-on-write
+    child->space = paging_space_create();
+    uint32_t stack_virt = task_alloc_stack();
+    child->stack_base = stack_virt;
+    if (child->space == NULL || stack_virt == 0 ||
+        vmm_fork(child->space, parent->space) != 0) {
+        task_free(child);
         return -1;
     }
 
-    task_t *parent = current_task;
-    if(parent == NULL) return -1;
-
-    task_t *child = &tasks[task_count];
-    child->id = ++current_task_id;
     child->state = TASK_READY;
+    child->base_prio = child->prio = parent->base_prio;
+    child->slice = TASK_SLICE_TICKS;
     child->ppid = parent->id;
+    child->cpu = smp_cpu_id();
     child->exit_code = 0;
     child->parent = parent;
     child->child_first = NULL;
 
-    child->context = parent->context;
-
-    child->stack_base = 0x10000 + (task_count * TASK_STACK_SIZE);
-    child->stack = (uint32_t *)child->stack_base;
-    child->context.esp = child->stack_base + TASK_STACK_SIZE - 4;
+    child->stack = (uint32_t *)stack_virt;
+    task_build_frame(child, entry);
+    child->context.eip = (uint32_t)entry;
+    child->context.eflags = 0x202;
+    child->context.cs = 0x08;
+    child->context.cr3 = child->space->dir_phys;
 
     /* Day 10: Copy parent's file descriptor table to child */
-    child->fd_table = &task_fd_tables[task_count];
-    if (parent->fd_table) {
-        fd_table_copy(child->fd_table, parent->fd_table);
-    } else {
-        fd_table_init(child->fd_table);
-    }
-
-    if(task_count>0) {
-        tasks[task_count - 1].next = child;
-        child->prev = &tasks[task_count- 1];
+    child->fd_table = fd_table_clone(parent->fd_table);
+    if (child->fd_table == NULL) {
+        task_free(child);
+        return -1;
     }
-    child->next = &tasks[0];
 
+    uint32_t flags = irq_save();
+    int child_id = child->id = ++current_task_id;
+    task_list_add(child);
     task_count++;
+    task_make_ready(child);
+    irq_restore(flags);
 
-    return child->id;
+    return child_id;
 }
 
 int task_exec(const char *program, uint32_t size) {
     if (current_task == NULL) return -1;
     
     (void)program;
-    (void)size;
-    
-    current_task->context.esp = current_task->stack_base + TASK_STACK_SIZE - 4;
-    current_task->context.ebp = current_task->context.esp;
-    
-    current_task->context.eax = 0;
-    current_task->context.ebx = 0;
-    current_task->context.ecx = 0;
-    current_task->context.edx = 0;
-    current_task->context.esi = 0;
-    current_task->context.edi = 0;
+
+    // Replace the program image region; its pages appear as they are touched
+    vmm_release(current_task->space, TASK_IMAGE_BASE);
+    if (size > 0 &&
+        vmm_reserve(current_task->space, TASK_IMAGE_BASE, size, VM_READ | VM_WRITE) != 0) {
+        return -1;
+    }
     
     return 0;
 }
@@ -263,25 +736,39 @@ int task_exec(const char *program, uint32_t size) {
 void task_exec_program(const char *program, uint32_t size) {
     task_exec(program, size);
 }
+// A child of parent's that has exited, counting all its children
+static task_t *dead_child(task_t *parent, int *children) {
+    *children = 0;
+    task_t *t = task_list;
+    for (int i = 0; i < task_count; i++, t = t->next) {
+        if (t->parent != parent) continue;
+        (*children)++;
+        if (t->state == TASK_DEAD) return t;
+    }
+    return NULL;
+}
+
+// Block until a child exits, then free it; -1 if there are no children
 int task_wait(int *status) {
     if(current_task == NULL) return -1;
 
-    task_t *child = NULL;
-    for(int i=0; i<task_count; i++) {
-        if (tasks[i].ppid == current_task->id && tasks[i].state != TASK_DEAD) {
-            child = &tasks[i];
-            break;
-        }
-    }
+    task_t *child;
+    int children;
+    wait_event(child_exits,
+               (child = dead_child(current_task, &children)) != NULL || children == 0);
+    if (child == NULL) return -1;
 
-    if(child == NULL) return -1;
+    // It woke us on its way out; its CPU lets go of it straight after
+    while (child->on_cpu) {
+        cpu_relax();
+    }
 
+    int id = child->id;
     if (status != NULL) {
         *status = child->exit_code;
     }
-
-    return child->id;  
-
+    task_destroy(child);
+    return id;
 }
 
 int task_get_parent_id(void) {
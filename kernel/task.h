@@ -2,9 +2,29 @@
 #define TASK_H
 
 #include <stdint.h>
+#include "idt.h"
+#include "spinlock.h"
 
-#define TASK_MAX 16
-#define TASK_STACK_SIZE 4096
+// Kernel stack: tasks run on it, with interrupt frames nested on top
+#define TASK_STACK_ORDER 1
+#define TASK_STACK_SIZE (4096 << TASK_STACK_ORDER)
+
+// Per-task regions, backed on first touch by the page-fault handler
+#define TASK_IMAGE_BASE   0x08048000
+#define TASK_HEAP_BASE    0x40000000
+#define TASK_HEAP_SIZE    0x00400000      // Initial brk() heap, 4MB
+#define TASK_USTACK_TOP   0xBFFFF000      // One unmapped guard page below 3GB
+#define TASK_USTACK_SIZE  0x00100000      // 1MB reserved
+
+// Priorities: 0 runs first. A task's dynamic priority drifts up to
+// TASK_PRIO_BONUS levels either side of its base: down (better) each
+// time it blocks, up each time it uses a whole time slice. TASK_PRIO_IDLE
+// is only for the idle task and never drifts.
+#define TASK_PRIO_LEVELS   32
+#define TASK_PRIO_DEFAULT  16
+#define TASK_PRIO_IDLE     (TASK_PRIO_LEVELS - 1)
+#define TASK_PRIO_BONUS    4
+#define TASK_SLICE_TICKS   5        // 50ms at 100Hz
 
 /* Forward declaration for fd_table_t */
 typedef struct fd_table fd_table_t;
@@ -16,6 +36,9 @@ typedef enum {
     TASK_DEAD
 } task_state_t;
 
+// Registers as of the last time the task was interrupted. esp is the
+// task's kernel stack pointer at that point: the interrupt_frame_t it
+// is resumed from. The rest is a copy of that frame, for taskinfo.
 typedef struct {
     uint32_t eax, ebx, ecx, edx;
     uint32_t esi, edi, ebp, esp;
@@ -33,30 +56,101 @@ typedef struct task_t {
     task_context_t context;
     uint32_t *stack;
     uint32_t stack_base;
-    struct task *parent;
-    struct task *child_first;
-    struct task *sibling_next;
+    struct task_t *parent;
+    struct task_t *child_first;
+    struct task_t *sibling_next;
     struct task_t *next;
     struct task_t *prev;
     fd_table_t *fd_table;       /* Day 10: Per-process file descriptor table */
+    struct address_space *space;    /* Page directory, loaded on switch */
+    uint32_t min_flt;           // Page faults resolved without I/O
+    uint32_t maj_flt;           // Page faults that had to read from disk
+    uint32_t base_prio;         // Set with task_set_priority()
+    uint32_t prio;              // Run queue it is on, base_prio +/- bonus
+    uint32_t slice;             // Ticks left before it is preempted
+    struct task_t *rq_next;     // Run queue links, while READY
+    struct task_t *rq_prev;
+    uint32_t wake_tick;         // Timer deadline, while timer_armed
+    struct task_t *timer_next;  // Timer wheel slot links, while armed
+    struct task_t **timer_pprev;
+    uint32_t timer_armed;
+    uint32_t nvcsw;             // Switched out because it blocked or exited
+    uint32_t nivcsw;            // ...because it was preempted or yielded
+    uint32_t cpu;               // Run queue it goes on: where it last ran
+    volatile uint32_t on_cpu;   // 1 + CPU whose stack it is on, 0 if none
+    uint32_t lock_depth;        // kernel_lock() nesting, while switched out
 } task_t;
 
-// Global current task pointer
-extern task_t *current_task;
+// One circular FIFO of READY tasks per priority, and a bit per non-empty
+// queue, so the next task is the head of queue bsf(bitmap). Each CPU has
+// one (smp.h).
+typedef struct {
+    spinlock_t lock;
+    task_t *queue[TASK_PRIO_LEVELS];
+    volatile uint32_t bitmap;
+    volatile uint32_t stealable;    // Queued tasks above idle priority
+} run_queue_t;
+
+// The task running on this CPU
+#define current_task (this_cpu()->current)
 
 // Function declarations
+// The code running when this is called (kernel_main, then the shell)
+// becomes the first task
 void task_init(void);
+// The same on an application processor: its boot code becomes its idle
+// task. NULL if out of memory.
+task_t *task_init_cpu(void);
 task_t *task_create(void (*entry)(void));
+// Give up the CPU now (through int 0x80)
 void task_yield(void);
+// Ask for a switch at the end of the current interrupt
 void task_switch(void);
+// Timer tick: charge the running task and preempt it when its slice
+// runs out
+void task_tick(void);
+// Called at the end of irq_0, irq_1 and int 0x80 with the interrupted
+// task's frame. If a switch was asked for, saves the frame, takes the
+// first task off this CPU's highest-priority non-empty run queue and
+// returns the frame to resume it from.
+interrupt_frame_t *task_schedule(interrupt_frame_t *frame);
+// Called by the same stubs once on the resumed task's stack: the task
+// switched away from may now run elsewhere
+void task_finish_switch(void);
+// Record the frame of a syscall in progress, for taskinfo
+void task_save_frame(interrupt_frame_t *frame);
+// Switches made by the calling CPU
+uint32_t task_get_switch_count(void);
+void task_set_priority(task_t *task, uint32_t prio);
+
+// Block the running task until task_wake(); call with interrupts off,
+// after arranging for someone to wake it. Before there is another task
+// to run it halts until the next interrupt instead, so callers must
+// re-check what they were waiting for either way (see wait.h).
+void task_block(void);
+// Make a blocked task ready again; safe from interrupt handlers
+void task_wake(task_t *task);
+// Anything on this CPU's run queue (besides the running task)?
+int task_any_ready(void);
+// Idle CPUs: take a task off the busiest other CPU's run queue.
+// Returns 1 if one was moved here (yield to run it).
+int task_steal(void);
+void task_destroy(task_t *task);
+// Free finished tasks nobody will wait for (idle task)
+void task_reap(void);
 task_t *task_get_current(void);
+task_t *task_find(uint32_t id);
 task_t *get_task_ptr(int id);
 void task_print_info(void);
 
-int task_fork(void);
+// Child shares the parent's memory copy-on-write and a copy of its
+// descriptors, and starts at entry
+int task_fork(void (*entry)(void));
 int task_exec(const char *program, uint32_t size);
 int task_wait(int *status);
 task_t *task_find_child(task_t *parent);
 void task_exit(int code);
 
+#include "smp.h"
+
 #endif // TASK_H
\ No newline at end of file
@@ -1,13 +1,35 @@
 #include "tasks_demo.h"
 #include "syscall.h"
 #include <stddef.h>
+// Day 10 task: Child started by task_parent's fork
+static void task_child(void) {
+    const char *child_msg = "[CHILD] Starting, parent PID=";
+    sys_write(child_msg, 29);
+    
+    int ppid = sys_getppid();
+    char buf[16];
+    itoa(ppid, buf, 10);
+    sys_write(buf, 1);
+    sys_write("\n", 1);
+    
+    const char *child_work = "[CHILD] Doing work...\n";
+    sys_write(child_work, 22);
+    
+    sys_yield();
+    
+    const char *child_exit = "[CHILD] Exiting\n";
+    sys_write(child_exit, 16);
+    
+    sys_exit(0);
+}
+
 // Day 10 task: Parent that forks a child
 void task_parent(void) {
     const char *msg = "[PARENT] Starting\n";
     sys_write(msg, 19);
     
     // Fork a child process
-    int child_pid = sys_fork();
+    int child_pid = sys_fork(task_child);
     
     if (child_pid > 0) {
         // Parent process
@@ -28,41 +50,23 @@ void task_parent(void) {
         
         const char *done_msg = "[PARENT] Child completed\n";
         sys_write(done_msg, 25);
-    } else {
-        // Child process
-        const char *child_msg = "[CHILD] Starting, parent PID=";
-        sys_write(child_msg, 29);
-        
-        int ppid = sys_getppid();
-        char buf[16];
-        itoa(ppid, buf, 10);
-        sys_write(buf, 1);
-        sys_write("\n", 1);
-        
-        const char *child_work = "[CHILD] Doing work...\n";
-        sys_write(child_work, 22);
-        
-        sys_yield();
-        
-        const char *child_exit = "[CHILD] Exiting\n";
-        sys_write(child_exit, 16);
-        
-        sys_exit(0);
     }
 }
 
+static void task_simple_child(void) {
+    sys_write("[SIMPLE] I am child\n", 20);
+    sys_exit(0);
+}
+
 // Simpler parent task
 void task_simple_parent(void) {
     const char *msg = "[SIMPLE] Hello from parent\n";
     sys_write(msg, 27);
     
-    int child = sys_fork();
+    int child = sys_fork(task_simple_child);
     if (child > 0) {
         sys_write("[SIMPLE] I am parent\n", 21);
         sys_wait(NULL);
         sys_write("[SIMPLE] Child done\n", 20);
-    } else {
-        sys_write("[SIMPLE] I am child\n", 20);
-        sys_exit(0);
     }
 }
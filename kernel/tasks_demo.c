@@ -1,20 +1,44 @@
 #include "tasks_demo.h"
 #include "syscall.h"
+#include "pmm.h"
+#include "task.h"
+#include "timer.h"
+#include "vga.h"
+#include "string.h"
+#include "cpu.h"
+
+// Pages cleared per idle wakeup; small so a wakeup never runs long
+#define IDLE_ZERO_BATCH 4
 
 void task_idle(void) {
-    for(int i=0; i<3; i++) {
-        const char *msg = "  [IDLE] Running iteration...\n";
-        sys_write(msg, 26);
-        char buf[2];
-        buf[0] = '0' + i;
-        buf[1] = 0;
-        sys_write(buf, 1);
-        sys_write("\n", 1);
-        sys_yield();
-    }
+    const char *msg = "  [IDLE] Running\n";
+    sys_write(msg, 17);
+
+    while (1) {
+        // Get back above the high watermark if memory ran low, then keep
+        // the pre-zeroed page pool topped up while nothing else runs.
+        // Once is enough: the boot CPU's idle task does it for all.
+        if (smp_cpu_id() == 0) {
+            pmm_balance();
+            pmm_zero_pool_refill(IDLE_ZERO_BATCH);
+            task_reap();
+        }
 
-    const char *msg = "  [IDLE] Done\n";
-    sys_write(msg, 14);
+        // Take over work queued behind a busy CPU before sleeping
+        if (task_steal()) {
+            task_yield();
+            continue;
+        }
+
+        // Only scheduled when nothing else is ready; anything that
+        // becomes ready preempts it. Stop the tick till the next timer
+        // is due; sti holds interrupts off until hlt, so no wakeup slips between.
+        asm volatile("cli");
+        if (!task_any_ready()) {
+            timer_idle_enter();
+        }
+        asm volatile("sti; hlt");
+    }
 }
 
 void task_worker(void) {
@@ -34,3 +58,63 @@ void task_worker(void) {
     const char *msg = "    [WORKER] Finished\n";
     sys_write(msg, 22);
 }
+
+/* ====== Sleeping on the timer wheel ====== */
+
+#define SLEEP_DEMO_TASKS   64
+#define SLEEP_DEMO_ROUNDS  5
+
+static volatile uint32_t sleep_demo_wakeups;
+static volatile uint32_t sleep_demo_done;
+
+// Sleeps SLEEP_DEMO_ROUNDS times, 10 to 100ms depending on its id
+static void task_sleeper(void) {
+    uint32_t period = 10 * (1 + task_get_current()->id % 10);
+    for (int i = 0; i < SLEEP_DEMO_ROUNDS; i++) {
+        sys_sleep(period);
+        sleep_demo_wakeups++;
+    }
+    sleep_demo_done++;
+}
+
+static void print_count(const char *label, uint32_t value) {
+    char buf[16];
+    vga_print(label);
+    utoa(value, buf, 10);
+    vga_print(buf);
+    vga_print("\n");
+}
+
+void task_sleep_demo(void) {
+    sleep_demo_wakeups = 0;
+    sleep_demo_done = 0;
+
+    timer_stats_t before;
+    timer_get_stats(&before);
+    uint32_t switches = task_get_switch_count();
+    uint32_t start = timer_get_ticks();
+
+    uint32_t created = 0;
+    for (; created < SLEEP_DEMO_TASKS; created++) {
+        if (!task_create(task_sleeper)) break;
+    }
+
+    // Sleep too; the longest sleeper needs about half a second
+    uint32_t deadline = start + 10 * TIMER_HZ;
+    while (sleep_demo_done < created && (int32_t)(timer_get_ticks() - deadline) < 0) {
+        timer_sleep(TIMER_MS_PER_TICK * 10);
+    }
+    uint32_t elapsed = timer_get_ticks() - start;
+
+    timer_stats_t after;
+    timer_get_stats(&after);
+
+    vga_print("Sleep demo:\n");
+    print_count("  Tasks:            ", created);
+    print_count("  Finished:         ", sleep_demo_done);
+    print_count("  Wakeups:          ", sleep_demo_wakeups);
+    print_count("  Elapsed (ms):     ", elapsed * TIMER_MS_PER_TICK);
+    print_count("  Timers fired:     ", after.fired - before.fired);
+    print_count("  Wheel cascades:   ", after.cascaded - before.cascaded);
+    print_count("  Context switches: ", task_get_switch_count() - switches);
+}
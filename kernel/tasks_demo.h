@@ -4,5 +4,7 @@
 void task_idle(void);
 void task_worker(void);
 void task_block_test(void);
+// Shell command: many tasks sleeping on the timer wheel at once
+void task_sleep_demo(void);
 
 #endif
\ No newline at end of file
@@ -2,39 +2,339 @@
 #include "pic.h"
 #include "io.h"
 #include "task.h"
+#include "cpu.h"
+#include <stddef.h>
 
 #define PIT_CHANNEL_0 0x40
 #define PIT_CONTROL   0x43
 #define PIT_FREQUENCY 1193182
 
+// Control words: channel 0, low then high byte, binary
+#define PIT_MODE_PERIODIC 0x34    // Mode 2, rate generator
+#define PIT_MODE_ONESHOT  0x30    // Mode 0, interrupt on terminal count
+#define PIT_READBACK      0xC2    // Latch status and count of channel 0
+#define PIT_STATUS_OUT    0x80    // Output high: a mode 0 count has run out
+
 static volatile uint32_t ticks = 0;
 
-void timer_init(uint32_t frequency) {
-    uint32_t divisor = PIT_FREQUENCY / frequency;
+/*
+ * Dynamic tick: while the idle task sleeps, the tick source is switched
+ * to a one-shot count that runs out at the next wheel deadline, so the
+ * CPU is not woken every tick for nothing. The ticks it stood in for
+ * are added when it fires, or worked out from the counter when some
+ * other interrupt ends the sleep first. The PIT's 16 bits at 1.19MHz
+ * limit one shot to about 55ms; the LAPIC timer goes much further.
+ */
+static uint32_t residue;                // Source cycles short of a whole tick
+static uint32_t oneshot_ticks = 0;      // Non-zero while a one-shot is set
+static int nohz_enabled = 1;
+
+static void pit_set_periodic(void);
+static void pit_set_oneshot(uint32_t cycles);
+static uint32_t pit_read(int *expired);
+
+// Ticks come from PIT channel 0 until something better takes over
+static timer_source_t pit_source = {
+    .name = "PIT",
+    .max_cycles = 0xFFFF,
+    .set_periodic = pit_set_periodic,
+    .set_oneshot = pit_set_oneshot,
+    .read = pit_read,
+};
+static const timer_source_t *source = &pit_source;
+
+/*
+ * Sleeping tasks hang off a hierarchical timing wheel. The root has a
+ * slot per tick for the next 256 ticks; each of the four levels above
+ * has 64 slots, every one covering a whole turn of the level below. A
+ * task goes in the slot its deadline falls in at the coarsest level it
+ * needs; when the root wraps, the next slot up is emptied and re-filed
+ * (cascaded) into the finer levels. Arming, disarming and each expiry
+ * are O(1), and a tick only looks at one root slot.
+ */
+#define WHEEL_ROOT_BITS   8
+#define WHEEL_LEVEL_BITS  6
+#define WHEEL_LEVELS      4
+#define WHEEL_ROOT_SIZE   (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE  (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_ROOT_MASK   (WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_MASK  (WHEEL_LEVEL_SIZE - 1)
+
+// Deadline bits below the ones that pick a slot at this level
+#define WHEEL_SHIFT(level) (WHEEL_ROOT_BITS + (level) * WHEEL_LEVEL_BITS)
+
+static task_t *wheel_root[WHEEL_ROOT_SIZE];
+static task_t *wheel_levels[WHEEL_LEVELS][WHEEL_LEVEL_SIZE];
+static uint32_t wheel_tick = 0;        // Next tick whose root slot is due
+static timer_stats_t stats;
+
+static void pit_program(uint8_t mode, uint32_t count) {
+    outb(PIT_CONTROL, mode);
 
-    // Send control byte to PIT
-    // 0x36 = channel 0, both bytes, mode 2 (rate generator), binary
-    outb(PIT_CONTROL, 0x36);
+    // Send count (low byte first, then high byte)
+    outb(PIT_CHANNEL_0, count & 0xFF);
+    outb(PIT_CHANNEL_0, (count >> 8) & 0xFF);
+}
+
+static void pit_set_periodic(void) {
+    pit_program(PIT_MODE_PERIODIC, pit_source.cycles_per_tick);
+}
+
+static void pit_set_oneshot(uint32_t cycles) {
+    pit_program(PIT_MODE_ONESHOT, cycles);
+}
+
+static uint32_t pit_read(int *expired) {
+    outb(PIT_CONTROL, PIT_READBACK);
+    uint8_t status = inb(PIT_CHANNEL_0);
+    uint32_t left = inb(PIT_CHANNEL_0);
+    left |= inb(PIT_CHANNEL_0) << 8;
+    if (expired) {
+        *expired = (status & PIT_STATUS_OUT) != 0;
+    }
+    return left;
+}
 
-    // Send divisor (low byte first, then high byte)
-    outb(PIT_CHANNEL_0, divisor & 0xFF);
-    outb(PIT_CHANNEL_0, (divisor >> 8) & 0xFF);
+void timer_init(uint32_t frequency) {
+    pit_source.cycles_per_tick = PIT_FREQUENCY / frequency;
+    pit_set_periodic();
 
     // Enable IRQ 0 on the PIC
     pic_enable_irq(0);
 }
 
-void timer_interrupt_handler(void) {
-    ticks++;
+// Deadline already reached? Wraps with the tick counter.
+static int tick_reached(uint32_t deadline) {
+    return (int32_t)(ticks - deadline) >= 0;
+}
+
+static void wheel_add(task_t *task) {
+    uint32_t expires = task->wake_tick;
+    uint32_t delta = expires - wheel_tick;
+    task_t **slot;
+
+    if ((int32_t)delta < 0) {
+        slot = &wheel_root[wheel_tick & WHEEL_ROOT_MASK];   // Overdue: next tick
+    } else if (delta < WHEEL_ROOT_SIZE) {
+        slot = &wheel_root[expires & WHEEL_ROOT_MASK];
+    } else {
+        uint32_t level = 0;
+        while (level < WHEEL_LEVELS - 1 &&
+               delta >= 1u << WHEEL_SHIFT(level + 1)) {
+            level++;
+        }
+        slot = &wheel_levels[level][(expires >> WHEEL_SHIFT(level)) & WHEEL_LEVEL_MASK];
+    }
+
+    task->timer_next = *slot;
+    task->timer_pprev = slot;
+    if (*slot) {
+        (*slot)->timer_pprev = &task->timer_next;
+    }
+    *slot = task;
+}
+
+static void wheel_del(task_t *task) {
+    *task->timer_pprev = task->timer_next;
+    if (task->timer_next) {
+        task->timer_next->timer_pprev = task->timer_pprev;
+    }
+    task->timer_next = NULL;
+    task->timer_pprev = NULL;
+}
+
+// Re-file everything in one slot of a level; it all lands lower down
+static void wheel_cascade(uint32_t level, uint32_t index) {
+    task_t *task = wheel_levels[level][index];
+    wheel_levels[level][index] = NULL;
+    while (task) {
+        task_t *next = task->timer_next;
+        wheel_add(task);
+        stats.cascaded++;
+        task = next;
+    }
+}
+
+// Catch the wheel up with ticks, waking everything that fell due
+static void wheel_run(void) {
+    while (tick_reached(wheel_tick)) {
+        uint32_t index = wheel_tick & WHEEL_ROOT_MASK;
+
+        // Root wrapped: pull the next slot of each level that also wrapped
+        if (index == 0) {
+            for (uint32_t level = 0; level < WHEEL_LEVELS; level++) {
+                uint32_t i = (wheel_tick >> WHEEL_SHIFT(level)) & WHEEL_LEVEL_MASK;
+                wheel_cascade(level, i);
+                if (i != 0) break;
+            }
+        }
+
+        while (wheel_root[index]) {
+            task_t *task = wheel_root[index];
+            wheel_del(task);
+            task->timer_armed = 0;
+            stats.fired++;
+            task_wake(task);
+        }
+        wheel_tick++;
+    }
+}
+
+// Ticks from now until the wheel next has work, at most max: a due root
+// slot, or the root wrapping round, which cascades
+static uint32_t wheel_ticks_to_next(uint32_t max) {
+    uint32_t ahead = wheel_tick - ticks;        // 1 once a tick is handled
+    if ((int32_t)ahead <= 0) return 0;          // Ticks counted, wheel not run yet
+    for (uint32_t d = 0; ahead + d < max; d++) {
+        uint32_t index = (wheel_tick + d) & WHEEL_ROOT_MASK;
+        if (index == 0 || wheel_root[index]) return ahead + d;
+    }
+    return max;
+}
+
+// Add source cycles that passed outside the periodic count
+static void add_residue(uint32_t cycles) {
+    uint32_t per_tick = source->cycles_per_tick;
+    residue += cycles;
+    uint32_t whole = residue / per_tick;
+    residue -= whole * per_tick;
+    ticks += whole;
+    stats.skipped += whole;
+}
+
+void timer_arm(task_t *task, uint32_t deadline) {
+    uint32_t flags = irq_save();
+    if (task->timer_armed) {
+        wheel_del(task);
+    }
+    task->wake_tick = deadline;
+    task->timer_armed = 1;
+    wheel_add(task);
+    stats.armed++;
+
+    // The boot CPU runs the wheel; if it is idle with a one-shot set for
+    // some later deadline, get it to work the one-shot out again
+    if (oneshot_ticks && smp_cpu_id() != 0) {
+        smp_send_reschedule(0);
+    }
+    irq_restore(flags);
+}
+
+void timer_disarm(task_t *task) {
+    uint32_t flags = irq_save();
+    if (task->timer_armed) {
+        wheel_del(task);
+        task->timer_armed = 0;
+    }
+    irq_restore(flags);
+}
+
+void timer_block_until(uint32_t deadline) {
+    uint32_t flags = irq_save();
+    if (!tick_reached(deadline) && current_task) {
+        timer_arm(current_task, deadline);
+        task_block();
+        timer_disarm(current_task);
+    }
+    irq_restore(flags);
+}
+
+// Both only act on the boot CPU: the others' timers just preempt
+void timer_idle_enter(void) {
+    if (!nohz_enabled || oneshot_ticks || smp_cpu_id() != 0) return;
+
+    uint32_t flags = irq_save();
+    uint32_t per_tick = source->cycles_per_tick;
+    uint32_t count = wheel_ticks_to_next(source->max_cycles / per_tick);
+    if (count >= 2) {
+        // Keep the part of the current period already gone
+        uint32_t left = source->read(NULL);
+        if (left <= per_tick) {
+            add_residue(per_tick - left);
+        }
+
+        oneshot_ticks = count;
+        source->set_oneshot(count * per_tick);
+    }
+    irq_restore(flags);
+}
+
+void timer_idle_exit(void) {
+    if (!oneshot_ticks || smp_cpu_id() != 0) return;
+
+    int expired;
+    uint32_t left = source->read(&expired);
+
+    // Ran out already: the tick is pending and accounts for all of it
+    if (expired) return;
 
-    task_switch();
+    uint32_t total = oneshot_ticks * source->cycles_per_tick;
+    oneshot_ticks = 0;
+    add_residue(left < total ? total - left : 0);
+    source->set_periodic();
+}
+
+void timer_set_nohz(int enabled) {
+    nohz_enabled = enabled;
+}
+
+void timer_set_source(const timer_source_t *new_source) {
+    uint32_t flags = irq_save();
+    oneshot_ticks = 0;
+    residue = 0;
+    source = new_source;
+    source->set_periodic();
+    irq_restore(flags);
+}
+
+const char *timer_source_name(void) {
+    return source->name;
+}
+
+// Every CPU's tick lands here; only the boot CPU's counts time
+interrupt_frame_t *timer_interrupt_handler(interrupt_frame_t *frame) {
+    if (smp_cpu_id() == 0) {
+        uint32_t flags = irq_save();
+        stats.interrupts++;
+        if (oneshot_ticks) {
+            // The one-shot ran out: every tick it stood in for has passed
+            ticks += oneshot_ticks;
+            stats.skipped += oneshot_ticks - 1;
+            oneshot_ticks = 0;
+            source->set_periodic();
+        } else {
+            ticks++;
+        }
+
+        wheel_run();
+        irq_restore(flags);
+    }
+
+    task_tick();
+    return task_schedule(frame);
 }
 
 uint32_t timer_get_ticks(void) {
     return ticks;
 }
 
+uint32_t timer_ms_to_ticks(uint32_t milliseconds) {
+    // Round up to whole ticks
+    return (milliseconds + TIMER_MS_PER_TICK - 1) / TIMER_MS_PER_TICK;
+}
+
+void timer_get_stats(timer_stats_t *out) {
+    *out = stats;
+}
+
 void timer_sleep(uint32_t milliseconds) {
-    uint32_t target = ticks + (milliseconds / 10);  // 10ms per tick at 100Hz
-    while (ticks < target);
+    // One more: the current tick may be nearly over already, and a
+    // sleep should never be shorter than asked
+    uint32_t target = ticks + timer_ms_to_ticks(milliseconds);
+    if (milliseconds) target++;
+
+    // Early wakeups (or no tasks yet) come back round the loop
+    while (!tick_reached(target)) {
+        timer_block_until(target);
+    }
 }
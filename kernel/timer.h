@@ -2,10 +2,62 @@
 #define TIMER_H
 
 #include <stdint.h>
+#include "idt.h"
+#include "task.h"
 
+#define TIMER_HZ          100
+#define TIMER_MS_PER_TICK (1000 / TIMER_HZ)
+
+typedef struct {
+    uint32_t armed;             // timer_arm() calls
+    uint32_t fired;             // Timers that expired and woke their task
+    uint32_t cascaded;          // Moves down a level of the wheel
+    uint32_t interrupts;        // irq_0s taken
+    uint32_t skipped;           // Ticks counted without an interrupt (idle)
+} timer_stats_t;
+
+// Something that can raise the tick on vector 32: periodically, or once
+// after a count of its own cycles (for the dynamic tick)
+typedef struct {
+    const char *name;
+    uint32_t cycles_per_tick;
+    uint32_t max_cycles;                    // Longest one-shot count
+    void (*set_periodic)(void);
+    void (*set_oneshot)(uint32_t cycles);
+    // Cycles left in the current period or one-shot; *expired (if asked
+    // for) is set once a one-shot has run out
+    uint32_t (*read)(int *expired);
+} timer_source_t;
+
+// Starts the tick on PIT channel 0
 void timer_init(uint32_t frequency);
-void timer_interrupt_handler(void);
+// Move the tick to another source, e.g. the LAPIC timer. The caller
+// stops the old one raising interrupts.
+void timer_set_source(const timer_source_t *source);
+const char *timer_source_name(void);
+// Called by irq_0; returns the frame to resume (see task_schedule)
+interrupt_frame_t *timer_interrupt_handler(interrupt_frame_t *frame);
 uint32_t timer_get_ticks(void);
+uint32_t timer_ms_to_ticks(uint32_t milliseconds);
+// Blocks the calling task; other tasks run meanwhile
 void timer_sleep(uint32_t milliseconds);
 
+// Wake a blocked task with task_wake() when ticks reaches deadline.
+// Arming an armed task moves its deadline. The timer is disarmed when it
+// fires; disarm it yourself if the task was woken some other way.
+void timer_arm(task_t *task, uint32_t deadline);
+void timer_disarm(task_t *task);
+// Block the current task until deadline (or an earlier task_wake())
+void timer_block_until(uint32_t deadline);
+void timer_get_stats(timer_stats_t *out);
+
+// Dynamic tick, for the idle task with interrupts off just before it
+// halts: stop the periodic tick until the next timer is due. Any
+// interrupt that ends the sleep early calls timer_idle_exit() (through
+// task_schedule) to put the tick back and count the ticks that passed.
+void timer_idle_enter(void);
+void timer_idle_exit(void);
+// On by default; off keeps the PIT periodic even when idle
+void timer_set_nohz(int enabled);
+
 #endif
@@ -1,4 +1,5 @@
 #include "vga.h"
+#include "cpu.h"
 
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
@@ -37,7 +38,7 @@ void vga_clear(void) {
     cursor_y = 0;
 }
 
-void vga_putc(char c) {
+static void vga_put(char c) {
     if (c == '\n') {
         cursor_x = 0;
         cursor_y++;
@@ -67,10 +68,19 @@ void vga_putc(char c) {
     }
 }
 
+// Whole strings at a time, so lines from different CPUs don't interleave
+void vga_putc(char c) {
+    uint32_t flags = irq_save();
+    vga_put(c);
+    irq_restore(flags);
+}
+
 void vga_print(const char* str) {
+    uint32_t flags = irq_save();
     for (int i = 0; str[i]; i++) {
-        vga_putc(str[i]);
+        vga_put(str[i]);
     }
+    irq_restore(flags);
 }
 
 
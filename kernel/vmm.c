@@ -0,0 +1,816 @@
+/*
+ * Demand-paged virtual memory regions
+ *
+ * Each address space keeps a sorted list of regions. Nothing is mapped
+ * when a region is reserved; a not-present fault inside it maps a zeroed
+ * page with the region's permissions and the access is retried.
+ *
+ * fork() shares the parent's pages read-only. A write fault on a present
+ * page in a writable region is a copy-on-write break: the writer gets a
+ * private copy, or the page itself once nobody else maps it.
+ *
+ * A first touch that only reads maps the shared zero page instead, so
+ * sparse or read-mostly regions cost no memory until written.
+ *
+ * Regions are created by mmap() and brk(); neighbours with equal flags
+ * are merged so the region count stays small.
+ *
+ * Under memory pressure cold private pages are evicted to swap (swap.c);
+ * touching one again is a major fault that reads it back.
+ */
+
+#include "vmm.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "swap.h"
+#include "task.h"
+#include "vga.h"
+#include "string.h"
+#include "cpu.h"
+#include <stddef.h>
+
+static kmem_cache_t *vma_cache;
+static vmm_stats_t stats;
+static uint32_t zero_page;          // Read-only stand-in for untouched anonymous pages
+
+static uint32_t vmm_migrate(uint32_t start_page, uint32_t end_page);
+
+void vmm_init(void) {
+    vma_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0);
+    pmm_set_migrate_hook(vmm_migrate);
+
+    zero_page = pmm_alloc_zeroed_page();
+    if (zero_page) {
+        pmm_page_pin(zero_page);
+    }
+}
+
+static uint32_t vma_pte_flags(uint32_t flags) {
+    uint32_t pte = 0;
+    if (flags & VM_WRITE) pte |= PTE_WRITE;
+    if (flags & VM_USER) pte |= PTE_USER;
+    return pte;
+}
+
+/* ====== Region tree ====== */
+
+// Regions are kept twice: on a list in address order, for neighbours, and
+// in an AVL tree keyed by start address, so the fault handler finds one in
+// O(log n). Every tree node also records the largest hole in front of any
+// region in its subtree, which lets mmap() skip subtrees with no room.
+
+static uint32_t vma_height(vm_area_t *node) {
+    return node ? node->height : 0;
+}
+
+// Unmapped space between this region and the one before it
+static uint32_t vma_gap(vm_area_t *vma) {
+    return vma->start - (vma->prev ? vma->prev->end : VMM_USER_BASE);
+}
+
+static void vma_update(vm_area_t *node) {
+    uint32_t left = vma_height(node->left);
+    uint32_t right = vma_height(node->right);
+    node->height = (left > right ? left : right) + 1;
+
+    uint32_t gap = vma_gap(node);
+    if (node->left && node->left->max_gap > gap) gap = node->left->max_gap;
+    if (node->right && node->right->max_gap > gap) gap = node->right->max_gap;
+    node->max_gap = gap;
+}
+
+static vm_area_t *rotate_right(vm_area_t *node) {
+    vm_area_t *top = node->left;
+    node->left = top->right;
+    top->right = node;
+    vma_update(node);
+    vma_update(top);
+    return top;
+}
+
+static vm_area_t *rotate_left(vm_area_t *node) {
+    vm_area_t *top = node->right;
+    node->right = top->left;
+    top->left = node;
+    vma_update(node);
+    vma_update(top);
+    return top;
+}
+
+static vm_area_t *tree_balance(vm_area_t *node) {
+    vma_update(node);
+    uint32_t left = vma_height(node->left);
+    uint32_t right = vma_height(node->right);
+
+    if (left > right + 1) {
+        if (vma_height(node->left->left) < vma_height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (right > left + 1) {
+        if (vma_height(node->right->right) < vma_height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static vm_area_t *tree_insert(vm_area_t *node, vm_area_t *vma) {
+    if (!node) {
+        vma->left = vma->right = NULL;
+        vma_update(vma);
+        return vma;
+    }
+    if (vma->start < node->start) {
+        node->left = tree_insert(node->left, vma);
+    } else {
+        node->right = tree_insert(node->right, vma);
+    }
+    return tree_balance(node);
+}
+
+static vm_area_t *tree_remove_min(vm_area_t *node, vm_area_t **min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    node->left = tree_remove_min(node->left, min);
+    return tree_balance(node);
+}
+
+static vm_area_t *tree_remove(vm_area_t *node, vm_area_t *vma) {
+    if (!node) return NULL;
+
+    if (vma->start < node->start) {
+        node->left = tree_remove(node->left, vma);
+    } else if (vma->start > node->start) {
+        node->right = tree_remove(node->right, vma);
+    } else {
+        if (!node->left) return node->right;
+        if (!node->right) return node->left;
+
+        // Replace with the in-order successor
+        vm_area_t *min;
+        vm_area_t *right = tree_remove_min(node->right, &min);
+        min->left = node->left;
+        min->right = right;
+        node = min;
+    }
+    return tree_balance(node);
+}
+
+// Recompute the gaps on the path to vma after its bounds or its
+// predecessor's end moved
+static void tree_refresh(vm_area_t *node, vm_area_t *vma) {
+    if (!node) return;
+    if (vma->start < node->start) {
+        tree_refresh(node->left, vma);
+    } else if (vma->start > node->start) {
+        tree_refresh(node->right, vma);
+    }
+    vma_update(node);
+}
+
+// Insert vma after prev (NULL: at the front)
+static void vma_link(address_space_t *as, vm_area_t *vma, vm_area_t *prev) {
+    vma->prev = prev;
+    vma->next = prev ? prev->next : as->vmas;
+    if (vma->next) vma->next->prev = vma;
+    if (prev) {
+        prev->next = vma;
+    } else {
+        as->vmas = vma;
+    }
+
+    as->vma_root = tree_insert(as->vma_root, vma);
+    if (vma->next) tree_refresh(as->vma_root, vma->next);
+}
+
+static void vma_unlink(address_space_t *as, vm_area_t *vma) {
+    if (vma->prev) {
+        vma->prev->next = vma->next;
+    } else {
+        as->vmas = vma->next;
+    }
+    if (vma->next) vma->next->prev = vma->prev;
+
+    as->vma_root = tree_remove(as->vma_root, vma);
+    if (vma->next) tree_refresh(as->vma_root, vma->next);
+}
+
+// Last region starting below addr
+static vm_area_t *vma_find_prev(address_space_t *as, uint32_t addr) {
+    vm_area_t *best = NULL;
+    for (vm_area_t *node = as->vma_root; node; ) {
+        if (node->start < addr) {
+            best = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return best;
+}
+
+// Fold vma into neighbours it touches that have the same flags, so
+// repeated brk() and mmap() calls don't fragment the list
+static void vma_merge(address_space_t *as, vm_area_t *vma) {
+    vm_area_t *prev = vma->prev;
+    if (prev && prev->end == vma->start && prev->flags == vma->flags) {
+        vma_unlink(as, vma);
+        prev->end = vma->end;
+        if (prev->next) tree_refresh(as->vma_root, prev->next);
+        kmem_cache_free(vma_cache, vma);
+        vma = prev;
+    }
+
+    vm_area_t *next = vma->next;
+    if (next && vma->end == next->start && next->flags == vma->flags) {
+        vma_unlink(as, next);
+        vma->end = next->end;
+        if (vma->next) tree_refresh(as->vma_root, vma->next);
+        kmem_cache_free(vma_cache, next);
+    }
+}
+
+// Lowest hole of at least size bytes at or above low, within node's subtree
+static uint32_t find_free(vm_area_t *node, uint32_t low, uint32_t size) {
+    if (!node || node->max_gap < size) return 0;
+
+    // Holes in the left subtree all end before this region starts
+    if (node->start > low) {
+        uint32_t addr = find_free(node->left, low, size);
+        if (addr) return addr;
+    }
+
+    uint32_t hole = node->prev ? node->prev->end : VMM_USER_BASE;
+    if (hole < low) hole = low;
+    if (node->start > hole && node->start - hole >= size) {
+        return hole;
+    }
+    return find_free(node->right, low, size);
+}
+
+static int range_free(address_space_t *as, uint32_t start, uint32_t end) {
+    vm_area_t *prev = vma_find_prev(as, end);
+    return !prev || prev->end <= start;
+}
+
+/* ====== Regions ====== */
+
+int vmm_reserve(address_space_t *as, uint32_t start, uint32_t size, uint32_t flags) {
+    uint32_t end = (start + size + PAGE_SIZE - 1) & PAGE_MASK;
+    start &= PAGE_MASK;
+
+    // Only the per-task half can hold regions; the rest is shared kernel space
+    if (size == 0 || end <= start || start < VMM_USER_BASE || end > VMM_USER_END) {
+        return -1;
+    }
+
+    uint32_t irq_flags = irq_save();
+
+    if (!range_free(as, start, end)) {
+        irq_restore(irq_flags);
+        return -1;
+    }
+
+    vm_area_t *vma = kmem_cache_alloc(vma_cache);
+    if (!vma) {
+        irq_restore(irq_flags);
+        return -1;
+    }
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma_link(as, vma, vma_find_prev(as, start));
+    vma_merge(as, vma);
+
+    irq_restore(irq_flags);
+    return 0;
+}
+
+vm_area_t *vmm_find(address_space_t *as, uint32_t addr) {
+    vm_area_t *node = as->vma_root;
+    while (node) {
+        if (addr < node->start) {
+            node = node->left;
+        } else if (addr >= node->end) {
+            node = node->right;
+        } else {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Unmap and free every backed page of [start, end). Page tables are only
+// reachable in the current space, so switch to as for the duration.
+static void vma_free_pages(address_space_t *as, uint32_t start, uint32_t end) {
+    address_space_t *prev = paging_current_space();
+    paging_switch(as);
+
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        pte_t pte = paging_get_pte(addr);
+        if (pte & PTE_PRESENT) {
+            pmm_page_unref(pte & PAGE_MASK);   // May still be shared with a fork
+        } else if (pte & PTE_SWAPPED) {
+            swap_put(pte);
+        }
+    }
+    page_unmap_range(start, (end - start) / PAGE_SIZE);
+
+    paging_switch(prev);
+}
+
+// Compaction: copy every page mapped exactly once from a frame in
+// [start_page, end_page) to a new frame and remap it. Shared and kernel
+// pages stay where they are.
+static uint32_t vmm_migrate(uint32_t start_page, uint32_t end_page) {
+    uint32_t moved = 0;
+    uint32_t irq_flags = irq_save();
+    address_space_t *prev = paging_current_space();
+
+    for (address_space_t *as = paging_kernel_space()->next; as; as = as->next) {
+        paging_switch(as);
+        for (vm_area_t *vma = as->vmas; vma; vma = vma->next) {
+            for (uint32_t addr = vma->start; addr < vma->end; addr += PAGE_SIZE) {
+                pte_t pte = paging_get_pte(addr);
+                uint32_t page = pte / PAGE_SIZE;
+                if (!(pte & PTE_PRESENT) || page < start_page || page >= end_page) continue;
+                if (pmm_page_refcount(pte & PAGE_MASK) != 1) continue;
+
+                uint32_t copy = pmm_alloc_page();
+                if (!copy) goto out;
+
+                // The allocation may have reclaimed this very page
+                if (paging_get_pte(addr) != pte) {
+                    pmm_free_page(copy);
+                    continue;
+                }
+                // Read-only until the new frame is in, so a write from
+                // another CPU can't land in the old one after the copy
+                paging_write_protect(addr);
+                page_copy(copy, (const void *)addr);
+                if (page_map(addr, copy, pte & (PTE_WRITE | PTE_USER)) != 0) {
+                    page_map(addr, pte & PAGE_MASK, pte & (PTE_WRITE | PTE_USER));
+                    pmm_free_page(copy);
+                    continue;
+                }
+                pmm_page_unref(pte & PAGE_MASK);
+                moved++;
+            }
+        }
+    }
+out:
+    paging_switch(prev);
+    irq_restore(irq_flags);
+    return moved;
+}
+
+int vmm_release(address_space_t *as, uint32_t addr) {
+    uint32_t irq_flags = irq_save();
+
+    vm_area_t *vma = vmm_find(as, addr);
+    if (!vma) {
+        irq_restore(irq_flags);
+        return -1;
+    }
+    vma_unlink(as, vma);
+
+    vma_free_pages(as, vma->start, vma->end);
+    kmem_cache_free(vma_cache, vma);
+
+    irq_restore(irq_flags);
+    return 0;
+}
+
+void vmm_release_all(address_space_t *as) {
+    while (as->vmas) {
+        vmm_release(as, as->vmas->start);
+    }
+}
+
+int vmm_unmap(address_space_t *as, uint32_t start, uint32_t size) {
+    uint32_t end = (start + size + PAGE_SIZE - 1) & PAGE_MASK;
+    if ((start & ~PAGE_MASK) || size == 0 || end <= start ||
+        start < VMM_USER_BASE || end > VMM_USER_END) {
+        return -1;
+    }
+
+    uint32_t irq_flags = irq_save();
+
+    // Walk down from the last region that overlaps
+    vm_area_t *vma = vma_find_prev(as, end);
+    while (vma && vma->end > start) {
+        vm_area_t *prev = vma->prev;
+        uint32_t lo = vma->start > start ? vma->start : start;
+        uint32_t hi = vma->end < end ? vma->end : end;
+
+        if (lo > vma->start && hi < vma->end) {
+            // Punching a hole: the part above it becomes its own region
+            vm_area_t *tail = kmem_cache_alloc(vma_cache);
+            if (!tail) {
+                irq_restore(irq_flags);
+                return -1;
+            }
+            tail->start = hi;
+            tail->end = vma->end;
+            tail->flags = vma->flags;
+            vma->end = lo;
+            vma_link(as, tail, vma);
+        } else if (lo > vma->start) {
+            vma->end = lo;
+            if (vma->next) tree_refresh(as->vma_root, vma->next);
+        } else if (hi < vma->end) {
+            vma->start = hi;
+            tree_refresh(as->vma_root, vma);
+        } else {
+            vma_unlink(as, vma);
+            kmem_cache_free(vma_cache, vma);
+        }
+        vma_free_pages(as, lo, hi);
+
+        vma = prev;
+    }
+
+    irq_restore(irq_flags);
+    return 0;
+}
+
+uint32_t vmm_get_unmapped_area(address_space_t *as, uint32_t size) {
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (size == 0) return 0;
+
+    uint32_t addr = find_free(as->vma_root, VMM_MMAP_BASE, size);
+    if (addr) return addr;
+
+    // Nothing between regions: try above the last one
+    vm_area_t *last = as->vma_root;
+    while (last && last->right) {
+        last = last->right;
+    }
+    addr = (last && last->end > VMM_MMAP_BASE) ? last->end : VMM_MMAP_BASE;
+    return (VMM_USER_END - addr >= size) ? addr : 0;
+}
+
+// Shared mappings are backed up front: a page first touched after fork()
+// would otherwise be faulted in separately on each side
+static int vma_populate(address_space_t *as, uint32_t start, uint32_t end, uint32_t flags) {
+    address_space_t *prev = paging_current_space();
+    paging_switch(as);
+
+    int result = 0;
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint32_t phys = pmm_alloc_zeroed_page();
+        if (!phys) {
+            result = -1;
+            break;
+        }
+        if (page_map(addr, phys, vma_pte_flags(flags)) != 0) {
+            pmm_free_page(phys);
+            result = -1;
+            break;
+        }
+    }
+
+    paging_switch(prev);
+    return result;
+}
+
+uint32_t vmm_mmap(address_space_t *as, uint32_t addr, uint32_t size, uint32_t flags, int fixed) {
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (size == 0) return 0;
+
+    uint32_t irq_flags = irq_save();
+
+    if (fixed) {
+        // Replaces whatever was there
+        if ((addr & ~PAGE_MASK) || vmm_unmap(as, addr, size) != 0) {
+            irq_restore(irq_flags);
+            return 0;
+        }
+    } else if (addr == 0 || (addr & ~PAGE_MASK) || addr < VMM_USER_BASE ||
+               addr + size > VMM_USER_END || addr + size < addr ||
+               !range_free(as, addr, addr + size)) {
+        // The hint is only a hint
+        addr = vmm_get_unmapped_area(as, size);
+    }
+
+    if (addr == 0 || vmm_reserve(as, addr, size, flags) != 0) {
+        irq_restore(irq_flags);
+        return 0;
+    }
+    if ((flags & VM_SHARED) && vma_populate(as, addr, addr + size, flags) != 0) {
+        vmm_unmap(as, addr, size);
+        addr = 0;
+    }
+
+    irq_restore(irq_flags);
+    return addr;
+}
+
+uint32_t vmm_brk(address_space_t *as, uint32_t new_brk) {
+    if (as->brk_base == 0 || new_brk < as->brk_base) return as->brk;
+
+    uint32_t old_top = (as->brk + PAGE_SIZE - 1) & PAGE_MASK;
+    uint32_t new_top = (new_brk + PAGE_SIZE - 1) & PAGE_MASK;
+
+    // Growing merges into the heap region below; shrinking frees the tail
+    if (new_top > old_top) {
+        if (vmm_reserve(as, old_top, new_top - old_top, VM_READ | VM_WRITE) != 0) {
+            return as->brk;
+        }
+    } else if (new_top < old_top) {
+        vmm_unmap(as, new_top, old_top - new_top);
+    }
+
+    as->brk = new_brk;
+    return new_brk;
+}
+
+int vmm_fork(address_space_t *dst, address_space_t *src) {
+    for (vm_area_t *vma = src->vmas; vma; vma = vma->next) {
+        if (vmm_reserve(dst, vma->start, vma->end - vma->start, vma->flags) != 0) {
+            return -1;
+        }
+    }
+    dst->brk_base = src->brk_base;
+    dst->brk = src->brk;
+
+    // Share the backed pages; paging_share_range() reads the source tables
+    // through the recursive mapping, so run it from inside src
+    uint32_t flags = irq_save();
+    address_space_t *prev = paging_current_space();
+    paging_switch(src);
+
+    int result = 0;
+    for (vm_area_t *vma = src->vmas; vma; vma = vma->next) {
+        int cow = !(vma->flags & VM_SHARED);
+        if (paging_share_range(dst, vma->start, vma->end, cow) < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    paging_switch(prev);
+    irq_restore(flags);
+    return result;
+}
+
+// Bring a swapped-out page back from disk. The read can sleep on the
+// disk, so fill the frame through the direct map and only map it once
+// the data is in: a present PTE would let reclaim on another CPU evict
+// the page before it was filled.
+static int vmm_swap_in(vm_area_t *vma, uint32_t page, pte_t entry) {
+    uint32_t phys = pmm_alloc_pages_below(0, DIRECT_MAP_SIZE);
+    if (!phys) return -1;
+
+    if (swap_read_page(entry, phys_to_virt(phys)) != 0) {
+        pmm_free_page(phys);
+        return -1;
+    }
+    // The swap entry is still in place; give back the reference the
+    // read dropped for it
+    if (page_map(page, phys, vma_pte_flags(vma->flags)) != 0) {
+        swap_dup(entry);
+        pmm_free_page(phys);
+        return -1;
+    }
+    return 0;
+}
+
+// Write to a read-only page of a writable region: give the writer its own copy
+static int vmm_break_cow(vm_area_t *vma, uint32_t page) {
+    uint32_t old = virt_to_phys(page) & PAGE_MASK;
+    uint32_t pte_flags = vma_pte_flags(vma->flags);
+
+    // Last one holding it: just make it writable again
+    if (pmm_page_refcount(old) == 1) {
+        stats.cow_reused++;
+        return page_map(page, old, pte_flags);
+    }
+
+    // Nothing to copy out of the zero page
+    uint32_t copy = (old == zero_page) ? pmm_alloc_zeroed_page() : pmm_alloc_page();
+    if (!copy) return -1;
+    if (old != zero_page) {
+        page_copy(copy, (const void *)page);
+    }
+    if (page_map(page, copy, pte_flags) != 0) {
+        pmm_free_page(copy);
+        return -1;
+    }
+    pmm_page_unref(old);
+    stats.cow_copies++;
+    return 0;
+}
+
+// Runs with interrupts off (interrupt gate)
+int vmm_handle_fault(uint32_t addr, uint32_t err_code) {
+    address_space_t *as = paging_current_space();
+    vm_area_t *vma = vmm_find(as, addr);
+    uint32_t page = addr & PAGE_MASK;
+    int major = 0;
+
+    // Outside every region, or not an access the region allows
+    if (!vma ||
+        ((err_code & PF_WRITE) && !(vma->flags & VM_WRITE)) ||
+        ((err_code & PF_USER) && !(vma->flags & VM_USER))) {
+        stats.bad_faults++;
+        return -1;
+    }
+
+    // Another CPU may have changed the PTE since the fault was taken
+    // (swap-out, migration, the same fault on another thread of as)
+    pte_t pte = paging_get_pte(page);
+    if (pte & PTE_PRESENT) {
+        if (!(err_code & PF_PRESENT) || ((err_code & PF_WRITE) && (pte & PTE_WRITE))) {
+            return 0;       // Already resolved: just retry the access
+        }
+    } else {
+        err_code &= ~PF_PRESENT;
+    }
+
+    if (err_code & PF_PRESENT) {
+        // Only a write to a shared page can be resolved
+        if (!(err_code & PF_WRITE) || vmm_break_cow(vma, page) != 0) {
+            stats.bad_faults++;
+            return -1;
+        }
+    } else if (pte & PTE_SWAPPED) {
+        // Evicted earlier: the only fault that waits on the disk
+        if (vmm_swap_in(vma, page, pte) != 0) {
+            stats.bad_faults++;
+            return -1;
+        }
+        major = 1;
+    } else if (!(err_code & PF_WRITE) && !(vma->flags & VM_SHARED) && zero_page) {
+        // First touch is a read: share the zero page until it is written
+        if (page_map(page, zero_page, vma_pte_flags(vma->flags) & ~PTE_WRITE) != 0) {
+            stats.bad_faults++;
+            return -1;
+        }
+        stats.zero_maps++;
+    } else {
+        // Anonymous memory: a zeroed page, no I/O
+        uint32_t phys = pmm_alloc_zeroed_page();
+        if (!phys) {
+            stats.bad_faults++;
+            return -1;
+        }
+        if (page_map(page, phys, vma_pte_flags(vma->flags)) != 0) {
+            pmm_free_page(phys);
+            stats.bad_faults++;
+            return -1;
+        }
+    }
+
+    task_t *task = task_get_current();
+    if (task && task->space != as) task = NULL;
+    if (major) {
+        stats.major_faults++;
+        if (task) task->maj_flt++;
+    } else {
+        stats.minor_faults++;
+        if (task) task->min_flt++;
+    }
+    return 0;
+}
+
+void vmm_get_stats(vmm_stats_t *out) {
+    *out = stats;
+}
+
+/* ====== Demo ====== */
+
+// Reserve a region in a scratch address space, touch part of it and show
+// that only the touched pages were backed
+void vmm_fault_demo(void) {
+    const uint32_t base = TASK_HEAP_BASE;
+    const uint32_t pages = 64;
+    char buf[16];
+
+    address_space_t *as = paging_space_create();
+    if (!as || vmm_reserve(as, base, pages * PAGE_SIZE, VM_READ | VM_WRITE) != 0) {
+        vga_print("ERROR: could not set up a scratch address space\n");
+        if (as) paging_space_destroy(as);
+        return;
+    }
+
+    uint32_t free_before = pmm_get_free_pages();
+    vmm_stats_t before = stats;
+
+    // Stay in the scratch space until done: the timer also switches CR3
+    uint32_t flags = irq_save();
+    address_space_t *prev = paging_current_space();
+    paging_switch(as);
+    for (uint32_t i = 0; i < pages; i++) {
+        volatile uint32_t *p = (volatile uint32_t *)(base + i * PAGE_SIZE);
+        if (*p != 0) {              // Read fault: maps the zero page
+            vga_print("ERROR: fresh page not zero\n");
+        }
+        if (i % 4 == 0) {
+            *p = i;                 // Write fault: private page
+        }
+    }
+    paging_switch(prev);
+    irq_restore(flags);
+
+    vga_print("Reserved ");
+    utoa(pages, buf, 10);
+    vga_print(buf);
+    vga_print(" pages, read all, wrote every 4th\n");
+    vga_print("  Minor faults: ");
+    utoa(stats.minor_faults - before.minor_faults, buf, 10);
+    vga_print(buf);
+    vga_print(", major: ");
+    utoa(stats.major_faults - before.major_faults, buf, 10);
+    vga_print(buf);
+    vga_print(", zero-page maps: ");
+    utoa(stats.zero_maps - before.zero_maps, buf, 10);
+    vga_print(buf);
+    vga_print("\n  Pages used: ");
+    utoa(free_before - pmm_get_free_pages(), buf, 10);
+    vga_print(buf);
+    vga_print(" (including page tables)\n");
+
+    vmm_release_all(as);
+    paging_space_destroy(as);
+}
+
+void vmm_print_regions(address_space_t *as) {
+    char buf[16];
+    for (vm_area_t *vma = as->vmas; vma; vma = vma->next) {
+        vga_print("  0x");
+        utoa(vma->start, buf, 16);
+        vga_print(buf);
+        vga_print("-0x");
+        utoa(vma->end, buf, 16);
+        vga_print(buf);
+        vga_print((vma->flags & VM_READ) ? " r" : " -");
+        vga_print((vma->flags & VM_WRITE) ? "w" : "-");
+        vga_print((vma->flags & VM_SHARED) ? " shared " : " private ");
+        utoa((vma->end - vma->start) / PAGE_SIZE, buf, 10);
+        vga_print(buf);
+        vga_print(" pages\n");
+    }
+}
+
+// Build up a scratch address space with mmap() and brk() and show how
+// neighbouring regions merge and how munmap() splits them again
+void vmm_mmap_demo(void) {
+    const uint32_t rw = VM_READ | VM_WRITE;
+    char buf[16];
+
+    address_space_t *as = paging_space_create();
+    if (!as) {
+        vga_print("ERROR: could not set up a scratch address space\n");
+        return;
+    }
+    as->brk_base = as->brk = TASK_HEAP_BASE;
+
+    uint32_t flags = irq_save();
+    address_space_t *prev = paging_current_space();
+
+    // Two back-to-back anonymous mappings end up as one region
+    uint32_t a = vmm_mmap(as, 0, 4 * PAGE_SIZE, rw, 0);
+    uint32_t b = vmm_mmap(as, 0, 4 * PAGE_SIZE, rw, 0);
+    uint32_t shared = vmm_mmap(as, 0, 2 * PAGE_SIZE, rw | VM_SHARED, 0);
+    if (!a || !b || !shared) {
+        vga_print("ERROR: mmap failed\n");
+    }
+    vga_print("mmap 4 + 4 pages private, 2 shared:\n");
+    vmm_print_regions(as);
+
+    // Touch every private page, then cut a hole out of the middle
+    paging_switch(as);
+    for (uint32_t addr = a; addr < a + 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        *(volatile uint32_t *)addr = addr;
+    }
+    paging_switch(prev);
+    uint32_t free_before = pmm_get_free_pages();
+    vmm_unmap(as, a + 3 * PAGE_SIZE, 2 * PAGE_SIZE);
+    vga_print("munmap 2 pages from the middle (");
+    utoa(pmm_get_free_pages() - free_before, buf, 10);
+    vga_print(buf);
+    vga_print(" pages freed):\n");
+    vmm_print_regions(as);
+
+    // The heap grows in place however many calls it takes
+    vmm_brk(as, as->brk + 3 * PAGE_SIZE);
+    vmm_brk(as, as->brk + 5 * PAGE_SIZE);
+    vmm_brk(as, as->brk + 100);
+    vmm_brk(as, as->brk - 6 * PAGE_SIZE);
+    vga_print("brk +3, +5 pages, +100 bytes, -6 pages (break 0x");
+    utoa(as->brk, buf, 16);
+    vga_print(buf);
+    vga_print("):\n");
+    vmm_print_regions(as);
+
+    irq_restore(flags);
+
+    vmm_release_all(as);
+    paging_space_destroy(as);
+}
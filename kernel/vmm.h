@@ -0,0 +1,90 @@
+#ifndef VMM_H
+#define VMM_H
+
+#include <stdint.h>
+#include "paging.h"
+
+/*
+ * Virtual memory regions
+ *
+ * A region reserves a range of an address space without backing it.
+ * The page-fault handler fills in zeroed pages the first time each
+ * page is touched, so large stacks and heaps cost nothing until used.
+ */
+
+#define VM_READ   0x1
+#define VM_WRITE  0x2
+#define VM_USER   0x4
+#define VM_SHARED 0x8       // Pages stay shared, not copied, across fork()
+
+// Where regions may live: between the identity map and the kernel
+#define VMM_USER_BASE   IDENTITY_MAP_SIZE
+#define VMM_USER_END    KERNEL_VIRT_BASE
+#define VMM_MMAP_BASE   0x60000000      // mmap() without a usable hint searches from here
+
+// Page-fault error code bits pushed by the CPU
+#define PF_PRESENT  0x1     // Protection violation (page was present)
+#define PF_WRITE    0x2     // Faulting access was a write
+#define PF_USER     0x4     // Fault happened in ring 3
+
+typedef struct vm_area {
+    uint32_t start;             // First byte, page aligned
+    uint32_t end;               // One past the last byte, page aligned
+    uint32_t flags;             // VM_*
+    struct vm_area *prev;       // Sorted by start address
+    struct vm_area *next;
+    struct vm_area *left;       // AVL tree keyed by start address
+    struct vm_area *right;
+    uint32_t height;
+    uint32_t max_gap;           // Largest hole before any region in this subtree
+} vm_area_t;
+
+typedef struct {
+    uint32_t minor_faults;      // Resolved without I/O
+    uint32_t major_faults;      // Needed to read from disk
+    uint32_t bad_faults;        // Outside any region or not permitted
+    uint32_t cow_copies;        // Write faults that copied a shared page
+    uint32_t cow_reused;        // Write faults on a page no longer shared
+    uint32_t zero_maps;         // Read faults served by the shared zero page
+} vmm_stats_t;
+
+void vmm_init(void);
+
+// Reserve [start, start + size) in as; 0 on success, -1 on overlap/no memory
+int vmm_reserve(address_space_t *as, uint32_t start, uint32_t size, uint32_t flags);
+
+// Drop the region containing addr, freeing whatever pages backed it
+int vmm_release(address_space_t *as, uint32_t addr);
+void vmm_release_all(address_space_t *as);
+
+// Remove [start, start + size) from whatever regions cover it, trimming or
+// splitting them; start must be page aligned. 0 on success.
+int vmm_unmap(address_space_t *as, uint32_t start, uint32_t size);
+
+// Anonymous mapping of size bytes. Uses addr if it is free (or, with
+// fixed, after unmapping whatever was there), else the lowest free hole
+// above VMM_MMAP_BASE. Returns the address, or 0 on failure.
+uint32_t vmm_mmap(address_space_t *as, uint32_t addr, uint32_t size, uint32_t flags, int fixed);
+uint32_t vmm_get_unmapped_area(address_space_t *as, uint32_t size);
+
+// Move the program break; returns the new break, or the old one on failure
+uint32_t vmm_brk(address_space_t *as, uint32_t new_brk);
+
+// Give dst the same regions as src, sharing the backed pages copy-on-write
+int vmm_fork(address_space_t *dst, address_space_t *src);
+
+vm_area_t *vmm_find(address_space_t *as, uint32_t addr);
+
+// Called from the #PF handler; returns 0 if the fault was resolved
+int vmm_handle_fault(uint32_t addr, uint32_t err_code);
+
+void vmm_get_stats(vmm_stats_t *out);
+
+// Shell demo: touch part of a reserved region and report the faults
+void vmm_fault_demo(void);
+
+// Shell demo: mmap/munmap/brk in a scratch space, listing regions as they change
+void vmm_mmap_demo(void);
+void vmm_print_regions(address_space_t *as);
+
+#endif
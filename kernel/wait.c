@@ -0,0 +1,91 @@
+#include "wait.h"
+#include <stddef.h>
+
+void wait_queue_init(wait_queue_t *wq) {
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+void wait_prepare(wait_queue_t *wq, wait_entry_t *entry) {
+    entry->task = current_task;
+    entry->next = NULL;
+    entry->queued = 1;
+    if (wq->tail) {
+        wq->tail->next = entry;
+    } else {
+        wq->head = entry;
+    }
+    wq->tail = entry;
+}
+
+void wait_sleep(wait_entry_t *entry) {
+    // A wakeup between prepare and here already took it off the queue
+    if (entry->queued) {
+        task_block();
+    }
+}
+
+void wait_sleep_until(wait_entry_t *entry, uint32_t deadline) {
+    if (!entry->queued || entry->task == NULL) {
+        wait_sleep(entry);
+        return;
+    }
+    timer_arm(entry->task, deadline);
+    task_block();
+    timer_disarm(entry->task);
+}
+
+// Off the queue if nobody woke it (timeout, or the condition came true
+// before it slept)
+void wait_finish(wait_queue_t *wq, wait_entry_t *entry) {
+    if (!entry->queued) return;
+    entry->queued = 0;
+
+    wait_entry_t *prev = NULL;
+    for (wait_entry_t *e = wq->head; e; prev = e, e = e->next) {
+        if (e != entry) continue;
+        if (prev) {
+            prev->next = e->next;
+        } else {
+            wq->head = e->next;
+        }
+        if (wq->tail == e) wq->tail = prev;
+        break;
+    }
+}
+
+static void wake_entry(wait_entry_t *entry) {
+    entry->queued = 0;
+    if (entry->task) {
+        task_wake(entry->task);
+    }
+}
+
+uint32_t wait_wake_one(wait_queue_t *wq) {
+    uint32_t flags = irq_save();
+    wait_entry_t *entry = wq->head;
+    if (entry) {
+        wq->head = entry->next;
+        if (wq->head == NULL) wq->tail = NULL;
+        wake_entry(entry);
+    }
+    irq_restore(flags);
+    return entry != NULL;
+}
+
+uint32_t wait_wake_all(wait_queue_t *wq) {
+    uint32_t flags = irq_save();
+    uint32_t woken = 0;
+    wait_entry_t *entry = wq->head;
+    wq->head = NULL;
+    wq->tail = NULL;
+    while (entry) {
+        // The entry lives on the sleeper's stack: read next first
+        wait_entry_t *next = entry->next;
+        wake_entry(entry);
+        woken++;
+        entry = next;
+    }
+    irq_restore(flags);
+    return woken;
+}
@@ -0,0 +1,81 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "task.h"
+#include "cpu.h"
+#include "timer.h"
+
+/*
+ * Wait queues
+ *
+ * A task that has to wait for something (a key, room in a pipe, a disk
+ * interrupt) puts an entry on the queue for that event and blocks; the
+ * code that makes the event happen wakes one or all of the queue. Waiters
+ * always re-check their condition when they run again, so a wakeup that
+ * turns out to be for someone else costs a trip round the loop, nothing more.
+ *
+ * The condition is checked and the task goes to sleep with interrupts
+ * off, so a wakeup from an interrupt handler can't fall in between.
+ * Don't sleep inside an irq_save() section that protects anything but
+ * the condition: other tasks run while this one is blocked.
+ */
+
+typedef struct wait_entry {
+    task_t *task;
+    struct wait_entry *next;
+    int queued;                 // Still on the queue: not woken yet
+} wait_entry_t;
+
+typedef struct {
+    wait_entry_t *head;         // FIFO, so wake_one is fair
+    wait_entry_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { NULL, NULL }
+
+void wait_queue_init(wait_queue_t *wq);
+
+// The steps of a wait, all with interrupts off: wait_prepare(), check
+// the condition, wait_sleep() if it is still false, wait_finish()
+void wait_prepare(wait_queue_t *wq, wait_entry_t *entry);
+void wait_sleep(wait_entry_t *entry);
+// Same, but also wake up at tick `deadline`
+void wait_sleep_until(wait_entry_t *entry, uint32_t deadline);
+void wait_finish(wait_queue_t *wq, wait_entry_t *entry);
+
+// Both return how many tasks were woken; safe from interrupt handlers
+uint32_t wait_wake_one(wait_queue_t *wq);
+uint32_t wait_wake_all(wait_queue_t *wq);
+
+// Block until cond is true
+#define wait_event(wq, cond) do {                               \
+    uint32_t _wait_flags = irq_save();                          \
+    while (!(cond)) {                                           \
+        wait_entry_t _wait_entry;                               \
+        wait_prepare(&(wq), &_wait_entry);                      \
+        if (!(cond)) wait_sleep(&_wait_entry);                  \
+        wait_finish(&(wq), &_wait_entry);                       \
+    }                                                           \
+    irq_restore(_wait_flags);                                   \
+} while (0)
+
+// Block until cond is true or timeout ticks have passed; evaluates to
+// whether cond is true
+#define wait_event_timeout(wq, cond, timeout) ({                \
+    uint32_t _wait_flags = irq_save();                          \
+    uint32_t _wait_deadline = timer_get_ticks() + (timeout);    \
+    while (!(cond) &&                                           \
+           (int32_t)(timer_get_ticks() - _wait_deadline) < 0) { \
+        wait_entry_t _wait_entry;                               \
+        wait_prepare(&(wq), &_wait_entry);                      \
+        if (!(cond)) wait_sleep_until(&_wait_entry, _wait_deadline); \
+        wait_finish(&(wq), &_wait_entry);                       \
+    }                                                           \
+    int _wait_done = (cond);                                    \
+    irq_restore(_wait_flags);                                   \
+    _wait_done;                                                 \
+})
+
+#endif